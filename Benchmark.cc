@@ -0,0 +1,424 @@
+/*
+Copyright (c) 2012 Chris Lentini
+http://divergentcoder.com
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of 
+this software and associated documentation files (the "Software"), to deal in 
+the Software without restriction, including without limitation the rights to use, 
+copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the 
+Software, and to permit persons to whom the Software is furnished to do so, 
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all 
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS 
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR 
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER 
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN 
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+
+// Native benchmark for the simulation phases and the distance field kernels.
+// Every result is printed as one JSON object per line:
+//
+//   fluidbench [--quick] [name filter]
+//
+// Particle phases report ns per particle, grid sweeps ns per cell and the
+// distance field passes ns per texel; sweeps and passes also report GB/s of 
+// the storage they stream through.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include "Util.h"
+#include "Fluid.h"
+#include "DistanceField.h"
+
+#define TANK_SIZE 64.f
+// Width of the full resolution band kept around the tank's surfaces
+#define FIELD_BAND 4.f
+
+static const char *	gFilter = NULL;
+static int64_t		gMinTime = 200000000;	// ns spent on each measurement
+
+///////////////////////////////////////////////////////////////////////////////
+static bool Enabled(const char * name)
+{
+	return !gFilter || strstr(name, gFilter) != NULL;
+}
+///////////////////////////////////////////////////////////////////////////////
+static void Report(const char * name, const char * params, double ns, 
+	double items, const char * unit, double bytes)
+{
+	printf("{\"bench\": \"%s\", %s, \"ns\": %.1f, \"ns_per_%s\": %.3f", 
+		name, params, ns, unit, ns / items);
+	if (bytes > 0.0)
+		printf(", \"gb_per_s\": %.3f", bytes / ns);
+	printf("}\n");
+	fflush(stdout);
+}
+///////////////////////////////////////////////////////////////////////////////
+//
+// ----------------------------- Simulation phases ----------------------------
+//
+///////////////////////////////////////////////////////////////////////////////
+enum
+{
+	PHASE_CLEAR,
+	PHASE_INIT,
+	PHASE_AVERAGE_VELOCITY,
+	PHASE_ACCEL,
+	PHASE_AVERAGE_ACCEL,
+	PHASE_VELOCITY,
+	PHASE_PARTICLES,
+	PHASE_COUNT
+};
+
+static const char * gPhaseNames[PHASE_COUNT] = 
+{
+	"ClearGrid",
+	"InitGrid",
+	"AverageVelocity",
+	"CalcAccel",
+	"AverageAcceleration",
+	"CalcVelocity",
+	"UpdateParticles"
+};
+
+///////////////////////////////////////////////////////////////////////////////
+static FluidSim * CreateScene(int grid, int particles, int fluids, 
+	GridLayout layout)
+{
+	FluidSim * sim = new FluidSim(TANK_SIZE, TANK_SIZE, TANK_SIZE / (grid - 1),
+		layout);
+
+	for (int i=0; i<fluids; i++)
+	{
+		Fluid * fluid = new Fluid(sim->GWidth, sim->GHeight);
+		fluid->Density = (i & 1) ? 1.f : 2.f;
+		fluid->Viscosity = (i & 1) ? 4.f : 0.f;
+		sim->Fluids.push_back(fluid);
+	}
+
+	// A pool filling the lower two thirds of the tank
+	srand(1);
+	for (int i=0; i<particles; i++)
+	{
+		float x = 4.f + frand() * (sim->GWidth - 8.f);
+		float y = (sim->GHeight / 3.f) + frand() * (sim->GHeight * 2.f / 3.f - 4.f);
+		sim->Fluids[i % fluids]->AddParticle(x, y, 0.f, 0.f);
+	}
+
+	// Let it settle a little so velocities and accelerations are non-trivial
+	for (int i=0; i<10; i++)
+		sim->Update();
+
+	return sim;
+}
+///////////////////////////////////////////////////////////////////////////////
+static void BenchPhases(int grid, int particles, int fluids, 
+	GridLayout layout = GRID_ROW_MAJOR)
+{
+	bool any = false;
+	for (int i=0; i<PHASE_COUNT; i++)
+		any = any || Enabled(gPhaseNames[i]);
+	if (!any)
+		return;
+
+	FluidSim * sim = CreateScene(grid, particles, fluids, layout);
+
+	// Every iteration starts from the same particles so the work is identical
+	std::vector< std::vector<Particle> > snapshot(fluids);
+	for (int i=0; i<fluids; i++)
+		snapshot[i] = sim->Fluids[i]->Particles;
+
+	int64_t times[PHASE_COUNT];
+	memset(times, 0, sizeof(times));
+	int64_t total = 0;
+	int iterations = 0;
+
+	while (total < gMinTime || iterations < 3)
+	{
+		for (int i=0; i<fluids; i++)
+			sim->Fluids[i]->Particles = snapshot[i];
+
+		int64_t t[PHASE_COUNT + 1];
+		t[0] = GetTimeNS();
+		sim->ClearGrid();
+		t[1] = GetTimeNS();
+		for (int i=0; i<fluids; i++)
+			sim->InitGrid(sim->Fluids[i]);
+		t[2] = GetTimeNS();
+		sim->AverageVelocity();
+		t[3] = GetTimeNS();
+		for (int i=0; i<fluids; i++)
+			sim->CalcAccel(sim->Fluids[i]);
+		t[4] = GetTimeNS();
+		sim->AverageAcceleration();
+		t[5] = GetTimeNS();
+		for (int i=0; i<fluids; i++)
+			sim->CalcVelocity(sim->Fluids[i]);
+		t[6] = GetTimeNS();
+		for (int i=0; i<fluids; i++)
+			sim->UpdateParticles(sim->Fluids[i]);
+		t[7] = GetTimeNS();
+
+		for (int i=0; i<PHASE_COUNT; i++)
+			times[i] += t[i + 1] - t[i];
+		total += t[PHASE_COUNT] - t[0];
+		iterations++;
+	}
+
+	int count = sim->ParticleCount();
+	double cells = (double) sim->GWidth * sim->GHeight;
+	char params[160];
+	sprintf(params, "\"grid\": %d, \"layout\": \"%s\", \"particles\": %d, "
+		"\"fluids\": %d, \"iterations\": %d", sim->GWidth, 
+		layout == GRID_TILED ? "tiled" : "rows", count, fluids, iterations);
+
+	for (int i=0; i<PHASE_COUNT; i++)
+	{
+		if (!Enabled(gPhaseNames[i]))
+			continue;
+
+		// The sweeps stream whole planes: the clear writes the shared grid 
+		// and every fluid's, the averages read the shared mass and read and
+		// write two of its other planes
+		double ns = times[i] / (double) iterations;
+		if (i == PHASE_CLEAR)
+		{
+			double bytes = (double) sim->Grid.GetByteCount();
+			for (int f=0; f<fluids; f++)
+				bytes += (double) sim->Fluids[f]->Grid.GetByteCount();
+			Report(gPhaseNames[i], params, ns, cells, "cell", bytes);
+		}
+		else if (i == PHASE_AVERAGE_VELOCITY || i == PHASE_AVERAGE_ACCEL)
+		{
+			Report(gPhaseNames[i], params, ns, cells, "cell",
+				cells * sizeof(float) * 5);
+		}
+		else
+		{
+			Report(gPhaseNames[i], params, ns, count, "particle", 0.0);
+		}
+	}
+
+	delete sim;
+}
+///////////////////////////////////////////////////////////////////////////////
+//
+// ------------------------------ Distance field ------------------------------
+//
+///////////////////////////////////////////////////////////////////////////////
+static void BuildField(DistanceField & field, int res)
+{
+	field.Create(res, res, TANK_SIZE, TANK_SIZE);
+	field.BeginBatch();
+	field.SubRect(2.f, 2.f, TANK_SIZE - 4.f, TANK_SIZE - 4.f);
+	field.AddCircle(TANK_SIZE / 2.f, TANK_SIZE / 2.f, 16.f);
+	field.AddCircle(0.f, TANK_SIZE, 16.f);
+	field.AddCircle(TANK_SIZE, TANK_SIZE, 16.f);
+	field.EndBatch();
+}
+///////////////////////////////////////////////////////////////////////////////
+static void BenchFieldPasses(int res)
+{
+	DistanceField field;
+	BuildField(field, res);
+
+	// Storage includes the one texel border on every side
+	double texels = (double)(res + 2) * (res + 2);
+	char params[96];
+
+	if (Enabled("Propagate"))
+	{
+		int iterations = 0;
+		int64_t start = GetTimeNS(), elapsed = 0;
+		while (elapsed < gMinTime || iterations < 3)
+		{
+			field.Propagate();
+			iterations++;
+			elapsed = GetTimeNS() - start;
+		}
+
+		// Two sweeps reading and writing both distance arrays, then the 
+		// difference pass reading two and writing one
+		sprintf(params, "\"resolution\": %d, \"iterations\": %d", res, iterations);
+		Report("Propagate", params, elapsed / (double) iterations, texels, 
+			"texel", texels * sizeof(float) * 11);
+	}
+
+	if (Enabled("Blur"))
+	{
+		int iterations = 0;
+		int64_t start = GetTimeNS(), elapsed = 0;
+		while (elapsed < gMinTime || iterations < 3)
+		{
+			field.Blur();
+			iterations++;
+			elapsed = GetTimeNS() - start;
+		}
+
+		// A horizontal and a vertical pass, each reading and writing
+		sprintf(params, "\"resolution\": %d, \"iterations\": %d", res, iterations);
+		Report("Blur", params, elapsed / (double) iterations, texels, 
+			"texel", texels * sizeof(float) * 4);
+	}
+
+	if (Enabled("BuildNarrowBand"))
+	{
+		// The band replaces the dense values, so every iteration starts from
+		// a fresh field and only the conversion is timed
+		int iterations = 0;
+		int64_t elapsed = 0;
+		while (elapsed < gMinTime || iterations < 3)
+		{
+			DistanceField band;
+			BuildField(band, res);
+			int64_t start = GetTimeNS();
+			band.BuildNarrowBand(FIELD_BAND);
+			elapsed += GetTimeNS() - start;
+			iterations++;
+		}
+
+		// Reads the dense values once to find the band and again to copy it
+		sprintf(params, "\"resolution\": %d, \"band\": %.1f, "
+			"\"iterations\": %d", res, FIELD_BAND, iterations);
+		Report("BuildNarrowBand", params, elapsed / (double) iterations, 
+			texels, "texel", texels * sizeof(float) * 2);
+	}
+}
+///////////////////////////////////////////////////////////////////////////////
+enum FieldStorage
+{
+	STORAGE_DENSE,
+	STORAGE_FROZEN,
+	STORAGE_BAND,
+	STORAGE_BAND_FROZEN,
+
+	STORAGE_COUNT
+};
+
+static const char * gStorageNames[STORAGE_COUNT] = 
+{
+	"dense", "frozen", "band", "band_frozen"
+};
+///////////////////////////////////////////////////////////////////////////////
+static void BenchFieldSampling(int res, int storage)
+{
+	DistanceField field;
+	BuildField(field, res);
+	if (storage == STORAGE_BAND || storage == STORAGE_BAND_FROZEN)
+		field.BuildNarrowBand(FIELD_BAND);
+	if (storage == STORAGE_FROZEN || storage == STORAGE_BAND_FROZEN)
+		field.Freeze();
+
+	MemoryStats memory;
+	field.CountMemory(memory, MEMORY_DISTANCE_FIELD);
+
+	const int count = 4096;
+	std::vector<float> x(count), y(count), d(count), gx(count), gy(count);
+	srand(2);
+	for (int i=0; i<count; i++)
+	{
+		x[i] = frand() * TANK_SIZE;
+		y[i] = frand() * TANK_SIZE;
+	}
+
+	char params[128];
+	const char * names[4] = 
+	{
+		"SampleDistance", "SampleGradient", 
+		"SampleDistanceBatch", "SampleGradientBatch"
+	};
+
+	for (int b=0; b<4; b++)
+	{
+		if (!Enabled(names[b]))
+			continue;
+
+		int iterations = 0;
+		int64_t start = GetTimeNS(), elapsed = 0;
+		while (elapsed < gMinTime || iterations < 3)
+		{
+			switch (b)
+			{
+			case 0:
+				for (int i=0; i<count; i++)
+					d[i] = field.SampleDistance(x[i], y[i]);
+				break;
+			case 1:
+				for (int i=0; i<count; i++)
+					field.SampleGradient(x[i], y[i], &gx[i], &gy[i]);
+				break;
+			case 2:
+				field.SampleDistanceBatch(&x[0], &y[0], &d[0], count);
+				break;
+			case 3:
+				field.SampleGradientBatch(&x[0], &y[0], &gx[0], &gy[0], count);
+				break;
+			}
+			iterations++;
+			elapsed = GetTimeNS() - start;
+		}
+
+		sprintf(params, "\"resolution\": %d, \"storage\": \"%s\", "
+			"\"bytes\": %lu, \"iterations\": %d", res, gStorageNames[storage], 
+			(unsigned long) memory.Reserved[MEMORY_DISTANCE_FIELD], iterations);
+		Report(names[b], params, elapsed / (double) iterations, count, 
+			"query", 0.0);
+	}
+}
+///////////////////////////////////////////////////////////////////////////////
+int main(int argc, char ** argv)
+{
+	for (int i=1; i<argc; i++)
+	{
+		if (strcmp(argv[i], "--quick") == 0)
+			gMinTime = 20000000;
+		else
+			gFilter = argv[i];
+	}
+
+	// Particle count scaling at the default grid, grid scaling at a fixed 
+	// count, then fluid count scaling
+	static const int particles[] = { 1000, 4000, 16000, 64000 };
+	static const int grids[] = { 65, 129, 257 };
+	static const int fluids[] = { 1, 2, 4 };
+
+	for (int i=0; i<4; i++)
+		BenchPhases(129, particles[i], 2);
+	for (int i=0; i<3; i++)
+	{
+		if (grids[i] != 129)
+			BenchPhases(grids[i], 16000, 2);
+	}
+	for (int i=0; i<3; i++)
+	{
+		if (fluids[i] != 2)
+			BenchPhases(129, 16000, fluids[i]);
+	}
+
+	// Grid layouts, out to grids much wider than a cache page
+	static const int layoutgrids[] = { 129, 513, 1025 };
+	for (int i=0; i<3; i++)
+	{
+		BenchPhases(layoutgrids[i], 64000, 2, GRID_ROW_MAJOR);
+		BenchPhases(layoutgrids[i], 64000, 2, GRID_TILED);
+	}
+
+	static const int resolutions[] = { 128, 256, 512 };
+	for (int i=0; i<3; i++)
+	{
+		BenchFieldPasses(resolutions[i]);
+		for (int storage=0; storage<STORAGE_COUNT; storage++)
+			BenchFieldSampling(resolutions[i], storage);
+	}
+
+	return 0;
+}
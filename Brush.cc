@@ -0,0 +1,99 @@
+/*
+Copyright (c) 2012 Chris Lentini
+http://divergentcoder.com
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of 
+this software and associated documentation files (the "Software"), to deal in 
+the Software without restriction, including without limitation the rights to use, 
+copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the 
+Software, and to permit persons to whom the Software is furnished to do so, 
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all 
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS 
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR 
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER 
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN 
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+
+#include <math.h>
+#include "Util.h"
+#include "Fluid.h"
+#include "Brush.h"
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// -------------------------------- PushBrush --------------------------------- 
+//
+///////////////////////////////////////////////////////////////////////////////
+PushBrush::PushBrush(float x, float y, float radius, float jitter)
+:	X(x),
+	Y(y),
+	Radius(radius),
+	Jitter(jitter)
+{}
+///////////////////////////////////////////////////////////////////////////////
+void PushBrush::GetBounds(float * x0, float * y0, float * x1, float * y1) const
+{
+	*x0 = X - Radius;
+	*y0 = Y - Radius;
+	*x1 = X + Radius;
+	*y1 = Y + Radius;
+}
+///////////////////////////////////////////////////////////////////////////////
+void PushBrush::Apply(Particle & p, uint64_t key, uint32_t counter) const
+{
+	float dx = p.x - X;
+	float dy = p.y - Y;
+	float l2 = dx*dx + dy*dy;
+	if (l2 >= Radius * Radius)
+		return;
+
+	float l = sqrtf(l2);
+	float f = 0.5f - (l / (2.f * Radius));
+	p.vx += f * dx * (1.f + frand(key, counter) * Jitter);
+	p.vy += f * dy * (1.f + frand(key, counter + 1) * Jitter);
+}
+///////////////////////////////////////////////////////////////////////////////
+
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// -------------------------------- StirBrush --------------------------------- 
+//
+///////////////////////////////////////////////////////////////////////////////
+StirBrush::StirBrush(float x, float y, float radius, float strength)
+:	X(x),
+	Y(y),
+	Radius(radius),
+	Strength(strength)
+{}
+///////////////////////////////////////////////////////////////////////////////
+void StirBrush::GetBounds(float * x0, float * y0, float * x1, float * y1) const
+{
+	*x0 = X - Radius;
+	*y0 = Y - Radius;
+	*x1 = X + Radius;
+	*y1 = Y + Radius;
+}
+///////////////////////////////////////////////////////////////////////////////
+void StirBrush::Apply(Particle & p, uint64_t key, uint32_t counter) const
+{
+	float dx = p.x - X;
+	float dy = p.y - Y;
+	float l2 = dx*dx + dy*dy;
+	if (l2 >= Radius * Radius || l2 == 0.f)
+		return;
+
+	// Unit tangent, scaled down linearly towards the rim
+	float l = sqrtf(l2);
+	float f = Strength * (1.f - l / Radius) / l;
+	p.vx -= dy * f;
+	p.vy += dx * f;
+}
+///////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,80 @@
+/*
+Copyright (c) 2012 Chris Lentini
+http://divergentcoder.com
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of 
+this software and associated documentation files (the "Software"), to deal in 
+the Software without restriction, including without limitation the rights to use, 
+copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the 
+Software, and to permit persons to whom the Software is furnished to do so, 
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all 
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS 
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR 
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER 
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN 
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+
+#ifndef HH_MPM_BRUSH_HH
+#define HH_MPM_BRUSH_HH
+
+#include <stdint.h>
+
+struct Particle;
+
+// A tool applied to the particles under a footprint with FluidSim::ApplyBrush.
+// Only the particles in the grid cells overlapping the bounds are visited, so
+// the cost follows the brush area rather than the particle count.
+class Brush
+{
+public:
+	virtual ~Brush() {}
+
+	// Footprint in grid cells, inclusive
+	virtual void	GetBounds(float * x0, float * y0, float * x1, 
+						float * y1) const = 0;
+
+	// Called for every particle within the bounds.  'key' and 'counter' 
+	// select unique random numbers with frand(key, counter + n) for n < 2.
+	virtual void	Apply(Particle & p, uint64_t key, uint32_t counter) const = 0;
+};
+
+// Pushes particles away from the centre, hardest halfway out
+class PushBrush : public Brush
+{
+public:
+	PushBrush(float x, float y, float radius, float jitter = 0.1f);
+
+	virtual void	GetBounds(float * x0, float * y0, float * x1, 
+						float * y1) const;
+	virtual void	Apply(Particle & p, uint64_t key, uint32_t counter) const;
+
+	float	X;
+	float	Y;
+	float	Radius;
+	float	Jitter;			// random fraction added to each impulse
+};
+
+// Swirls particles around the centre, fading to nothing at the edge
+class StirBrush : public Brush
+{
+public:
+	StirBrush(float x, float y, float radius, float strength);
+
+	virtual void	GetBounds(float * x0, float * y0, float * x1, 
+						float * y1) const;
+	virtual void	Apply(Particle & p, uint64_t key, uint32_t counter) const;
+
+	float	X;
+	float	Y;
+	float	Radius;
+	float	Strength;		// tangential speed added at the centre, per step
+};
+
+#endif // HH_MPM_BRUSH_HH
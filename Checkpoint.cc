@@ -0,0 +1,389 @@
+/*
+Copyright (c) 2012 Chris Lentini
+http://divergentcoder.com
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of 
+this software and associated documentation files (the "Software"), to deal in 
+the Software without restriction, including without limitation the rights to use, 
+copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the 
+Software, and to permit persons to whom the Software is furnished to do so, 
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all 
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS 
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR 
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER 
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN 
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "Checkpoint.h"
+
+// Bump whenever the layout below changes
+#define CHECKPOINT_VERSION	1
+
+#define CHECKPOINT_INCOMPRESSIBLE	1
+
+// File layout: this header, one FluidHeader per fluid, then the distance 
+// field values and each fluid's particles and weights at the recorded 
+// offsets.  Every section starts 16 byte aligned.
+struct CheckpointHeader
+{
+	char		magic[4];		// "NFCK"
+	uint32_t	version;
+	uint32_t	headersize;		// sizeof(CheckpointHeader), as a sanity check
+	int32_t		gwidth;
+	int32_t		gheight;
+	float		scale;
+	float		gridcoeff;
+	float		gravityx;
+	float		gravityy;
+	int32_t		sdfx;
+	int32_t		sdfy;
+	uint32_t	sdfcount;
+	uint64_t	sdfoffset;
+	uint32_t	fluidcount;
+	uint32_t	step;			// zero in files older than the field
+	uint32_t	seed;
+	uint32_t	flags;			// CHECKPOINT_*, zero in files older than the field
+	float		volumecorrection;
+	uint32_t	reserved[1];
+};
+
+struct FluidHeader
+{
+	int32_t		color;
+	float		density;
+	float		stiffness;
+	float		viscosity;
+	uint32_t	count;
+	uint32_t	reserved;
+	uint64_t	particles;		// offsets from the start of the file
+	uint64_t	weights;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+static uint64_t Align(uint64_t offset)
+{
+	return (offset + 15) & ~(uint64_t) 15;
+}
+///////////////////////////////////////////////////////////////////////////////
+static bool WriteAt(FILE * file, uint64_t offset, const void * data, 
+	size_t size)
+{
+	// Pad up to the aligned section start
+	static const char zeros[16] = { 0 };
+	long pos = ftell(file);
+	if (pos < 0 || (uint64_t) pos > offset || offset - pos > sizeof(zeros))
+		return false;
+	if (offset > (uint64_t) pos && 
+		fwrite(zeros, 1, offset - pos, file) != offset - pos)
+		return false;
+	return size == 0 || fwrite(data, 1, size, file) == size;
+}
+///////////////////////////////////////////////////////////////////////////////
+//
+// ---------------------------- CheckpointWriter ------------------------------
+//
+///////////////////////////////////////////////////////////////////////////////
+CheckpointWriter::CheckpointWriter()
+:	nQueued(0),
+	nNext(0),
+	bFailed(false),
+	bQuit(false),
+	bStarted(false)
+{
+	pthread_mutex_init(&mutex, NULL);
+	pthread_cond_init(&ready, NULL);
+	pthread_cond_init(&written, NULL);
+	bStarted = pthread_create(&worker, NULL, &WorkerMain, this) == 0;
+}
+///////////////////////////////////////////////////////////////////////////////
+CheckpointWriter::~CheckpointWriter()
+{
+	Finish();
+
+	if (bStarted)
+	{
+		pthread_mutex_lock(&mutex);
+		bQuit = true;
+		pthread_cond_signal(&ready);
+		pthread_mutex_unlock(&mutex);
+		pthread_join(worker, NULL);
+	}
+
+	pthread_cond_destroy(&written);
+	pthread_cond_destroy(&ready);
+	pthread_mutex_destroy(&mutex);
+}
+///////////////////////////////////////////////////////////////////////////////
+void CheckpointWriter::Save(const FluidSim * sim, const char * path)
+{
+	pthread_mutex_lock(&mutex);
+	while (nQueued == 2)
+		pthread_cond_wait(&written, &mutex);
+	Snapshot & s = snapshots[nNext];
+	pthread_mutex_unlock(&mutex);
+
+	// The free slot belongs to this thread until it is queued
+	s.path = path;
+	s.gwidth = sim->GWidth;
+	s.gheight = sim->GHeight;
+	s.scale = sim->Scale;
+	s.gridcoeff = sim->GridCoeff;
+	s.gravityx = sim->GravityX;
+	s.gravityy = sim->GravityY;
+	s.incompressible = sim->Incompressible;
+	s.volumecorrection = sim->VolumeCorrection;
+	s.step = sim->Step;
+	s.seed = sim->Seed;
+	s.sdfx = sim->SDF.GetResolutionX();
+	s.sdfy = sim->SDF.GetResolutionY();
+	s.distances.resize(sim->SDF.GetValueCount());
+	sim->SDF.GetValues(&s.distances[0]);
+
+	s.fluids.resize(sim->Fluids.size());
+	for (unsigned i=0; i<sim->Fluids.size(); i++)
+	{
+		const Fluid * fluid = sim->Fluids[i];
+		FluidState & f = s.fluids[i];
+		f.color = fluid->Color;
+		f.density = fluid->Density;
+		f.stiffness = fluid->Stiffness;
+		f.viscosity = fluid->Viscosity;
+		f.particles = fluid->Particles;
+		f.weights = fluid->Weights;
+		f.weights.resize(f.particles.size());
+	}
+
+	if (!bStarted)
+	{
+		if (!Write(s))
+			bFailed = true;
+		return;
+	}
+
+	pthread_mutex_lock(&mutex);
+	nNext ^= 1;
+	nQueued++;
+	pthread_cond_signal(&ready);
+	pthread_mutex_unlock(&mutex);
+}
+///////////////////////////////////////////////////////////////////////////////
+void CheckpointWriter::Finish()
+{
+	pthread_mutex_lock(&mutex);
+	while (nQueued > 0)
+		pthread_cond_wait(&written, &mutex);
+	pthread_mutex_unlock(&mutex);
+}
+///////////////////////////////////////////////////////////////////////////////
+void * CheckpointWriter::WorkerMain(void * arg)
+{
+	((CheckpointWriter *) arg)->Work();
+	return NULL;
+}
+///////////////////////////////////////////////////////////////////////////////
+void CheckpointWriter::Work()
+{
+	pthread_mutex_lock(&mutex);
+	for (;;)
+	{
+		while (nQueued == 0 && !bQuit)
+			pthread_cond_wait(&ready, &mutex);
+		if (nQueued == 0)
+			break;
+
+		// Snapshots are written in the order they were queued
+		const Snapshot & s = snapshots[nQueued == 2 ? nNext : nNext ^ 1];
+		pthread_mutex_unlock(&mutex);
+
+		bool ok = Write(s);
+
+		pthread_mutex_lock(&mutex);
+		if (!ok)
+			bFailed = true;
+		nQueued--;
+		pthread_cond_broadcast(&written);
+	}
+	pthread_mutex_unlock(&mutex);
+}
+///////////////////////////////////////////////////////////////////////////////
+bool CheckpointWriter::Write(const Snapshot & s)
+{
+	CheckpointHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, "NFCK", 4);
+	header.version = CHECKPOINT_VERSION;
+	header.headersize = sizeof(CheckpointHeader);
+	header.gwidth = s.gwidth;
+	header.gheight = s.gheight;
+	header.scale = s.scale;
+	header.gridcoeff = s.gridcoeff;
+	header.gravityx = s.gravityx;
+	header.gravityy = s.gravityy;
+	header.flags = s.incompressible ? CHECKPOINT_INCOMPRESSIBLE : 0;
+	header.volumecorrection = s.volumecorrection;
+	header.step = s.step;
+	header.seed = s.seed;
+	header.sdfx = s.sdfx;
+	header.sdfy = s.sdfy;
+	header.sdfcount = s.distances.size();
+	header.fluidcount = s.fluids.size();
+
+	uint64_t offset = sizeof(CheckpointHeader) + 
+		s.fluids.size() * sizeof(FluidHeader);
+	header.sdfoffset = offset = Align(offset);
+	offset += s.distances.size() * sizeof(float);
+
+	std::vector<FluidHeader> fluids(s.fluids.size());
+	for (unsigned i=0; i<s.fluids.size(); i++)
+	{
+		const FluidState & f = s.fluids[i];
+		FluidHeader & h = fluids[i];
+		memset(&h, 0, sizeof(h));
+		h.color = f.color;
+		h.density = f.density;
+		h.stiffness = f.stiffness;
+		h.viscosity = f.viscosity;
+		h.count = f.particles.size();
+		h.particles = offset = Align(offset);
+		offset += f.particles.size() * sizeof(Particle);
+		h.weights = offset = Align(offset);
+		offset += f.weights.size() * sizeof(CellWeight);
+	}
+
+	// Write under a temporary name so a crash never leaves a torn checkpoint
+	char tmp[32];
+	sprintf(tmp, ".%d.tmp", (int) getpid());
+	std::string temp = s.path + tmp;
+
+	FILE * file = fopen(temp.c_str(), "wb");
+	if (!file)
+		return false;
+
+	bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+		(fluids.empty() || 
+		fwrite(&fluids[0], sizeof(FluidHeader), fluids.size(), file) == fluids.size()) &&
+		WriteAt(file, header.sdfoffset, &s.distances[0], 
+			s.distances.size() * sizeof(float));
+
+	for (unsigned i=0; i<s.fluids.size() && ok; i++)
+	{
+		const FluidState & f = s.fluids[i];
+		if (f.particles.empty())
+			continue;
+
+		ok = WriteAt(file, fluids[i].particles, &f.particles[0], 
+				f.particles.size() * sizeof(Particle)) &&
+			WriteAt(file, fluids[i].weights, &f.weights[0],
+				f.weights.size() * sizeof(CellWeight));
+	}
+	ok = (fclose(file) == 0) && ok;
+
+	if (!ok || rename(temp.c_str(), s.path.c_str()) != 0)
+	{
+		remove(temp.c_str());
+		return false;
+	}
+	return true;
+}
+///////////////////////////////////////////////////////////////////////////////
+bool LoadCheckpoint(FluidSim * sim, const char * path)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	struct stat info;
+	if (fstat(fd, &info) != 0 || info.st_size < (off_t) sizeof(CheckpointHeader))
+	{
+		close(fd);
+		return false;
+	}
+
+	size_t size = info.st_size;
+	void * mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mapping == MAP_FAILED)
+		return false;
+
+	// Validate everything before touching the simulation
+	const char * base = (const char *) mapping;
+	const CheckpointHeader * header = (const CheckpointHeader *) base;
+	const FluidHeader * fluids = (const FluidHeader *)(header + 1);
+	uint64_t fluidbytes = (uint64_t) header->fluidcount * sizeof(FluidHeader);
+
+	bool ok = memcmp(header->magic, "NFCK", 4) == 0 &&
+		header->version == CHECKPOINT_VERSION &&
+		header->headersize == sizeof(CheckpointHeader) &&
+		header->gwidth == sim->GWidth && header->gheight == sim->GHeight &&
+		header->sdfx > 0 && header->sdfy > 0 &&
+		header->sdfcount == (uint64_t)(header->sdfx + 2) * (header->sdfy + 2) &&
+		sizeof(CheckpointHeader) + fluidbytes <= size &&
+		header->sdfoffset + header->sdfcount * sizeof(float) <= size;
+
+	for (uint32_t i=0; ok && i<header->fluidcount; i++)
+	{
+		uint64_t count = fluids[i].count;
+		ok = fluids[i].particles + count * sizeof(Particle) <= size &&
+			fluids[i].weights + count * sizeof(CellWeight) <= size &&
+			fluids[i].particles % 16 == 0 && fluids[i].weights % 16 == 0;
+	}
+
+	if (!ok)
+	{
+		munmap(mapping, size);
+		return false;
+	}
+
+	sim->Scale = header->scale;
+	sim->GridCoeff = header->gridcoeff;
+	sim->GravityX = header->gravityx;
+	sim->GravityY = header->gravityy;
+	sim->Incompressible = (header->flags & CHECKPOINT_INCOMPRESSIBLE) != 0;
+	if (sim->Incompressible)
+		sim->VolumeCorrection = header->volumecorrection;
+	sim->Step = header->step;
+	sim->Seed = header->seed;
+	sim->SDF.SetValues(header->sdfx, header->sdfy, sim->GWidth, sim->GHeight,
+		(const float *)(base + header->sdfoffset));
+
+	while (sim->Fluids.size() > header->fluidcount)
+	{
+		delete sim->Fluids.back();
+		sim->Fluids.pop_back();
+	}
+	while (sim->Fluids.size() < header->fluidcount)
+		sim->Fluids.push_back(new Fluid(sim->GWidth, sim->GHeight));
+
+	for (uint32_t i=0; i<header->fluidcount; i++)
+	{
+		const FluidHeader & h = fluids[i];
+		Fluid * fluid = sim->Fluids[i];
+		fluid->Color = h.color;
+		fluid->Density = h.density;
+		fluid->Stiffness = h.stiffness;
+		fluid->Viscosity = h.viscosity;
+
+		const Particle * particles = (const Particle *)(base + h.particles);
+		const CellWeight * weights = (const CellWeight *)(base + h.weights);
+		fluid->Particles.assign(particles, particles + h.count);
+		fluid->Weights.assign(weights, weights + h.count);
+	}
+	sim->BuildIndex();
+
+	munmap(mapping, size);
+	return true;
+}
+///////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,106 @@
+/*
+Copyright (c) 2012 Chris Lentini
+http://divergentcoder.com
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of 
+this software and associated documentation files (the "Software"), to deal in 
+the Software without restriction, including without limitation the rights to use, 
+copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the 
+Software, and to permit persons to whom the Software is furnished to do so, 
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all 
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS 
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR 
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER 
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN 
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+
+#ifndef HH_MPM_CHECKPOINT_HH
+#define HH_MPM_CHECKPOINT_HH
+
+#include <pthread.h>
+#include <string>
+#include <vector>
+#include "Fluid.h"
+
+// Saves and restores a running simulation: every fluid's particles, weights
+// and parameters, the FluidSim settings and the collision field distances.
+// Obstacles are not part of a checkpoint.
+//
+// Save() copies the state into a snapshot and returns; a background thread 
+// writes it.  Two snapshots are kept so a save only waits when one is being
+// written and another is already queued behind it.
+class CheckpointWriter
+{
+public:
+	CheckpointWriter();
+	~CheckpointWriter();
+
+	void	Save(const FluidSim * sim, const char * path);
+
+	// Blocks until every requested checkpoint is written
+	void	Finish();
+	bool	HasFailed() const { return bFailed; }
+
+private:
+	CheckpointWriter(const CheckpointWriter &);
+	CheckpointWriter & operator = (const CheckpointWriter &);
+
+	struct FluidState
+	{
+		int						color;
+		float					density;
+		float					stiffness;
+		float					viscosity;
+		std::vector<Particle>	particles;
+		std::vector<CellWeight>	weights;
+	};
+
+	struct Snapshot
+	{
+		std::string				path;
+		int						gwidth;
+		int						gheight;
+		float					scale;
+		float					gridcoeff;
+		float					gravityx;
+		float					gravityy;
+		bool					incompressible;
+		float					volumecorrection;
+		unsigned				step;
+		unsigned				seed;
+		int						sdfx;
+		int						sdfy;
+		std::vector<float>		distances;
+		std::vector<FluidState>	fluids;
+	};
+
+	static void * WorkerMain(void * arg);
+	void	Work();
+	static bool Write(const Snapshot & snapshot);
+
+	Snapshot				snapshots[2];
+	int						nQueued;	// snapshots waiting or being written
+	int						nNext;		// slot the next Save fills
+	pthread_t				worker;
+	pthread_mutex_t			mutex;
+	pthread_cond_t			ready;
+	pthread_cond_t			written;
+	bool					bFailed;
+	bool					bQuit;
+	bool					bStarted;
+};
+
+// Maps a checkpoint and copies it into 'sim', whose grid must have the same
+// size.  Existing fluids are reused in order; extra ones are created and 
+// surplus ones deleted.  Returns false and leaves 'sim' untouched if the 
+// file can't be used.
+bool LoadCheckpoint(FluidSim * sim, const char * path);
+
+#endif // HH_MPM_CHECKPOINT_HH
@@ -21,12 +21,41 @@ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 */
 
 #include "DistanceField.h"
+#include <algorithm>
 #include <math.h>
 #include <float.h>
+#include <stdio.h>
 #include <string.h>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #define SQ2 1.4142135623730950488016887242097f
 
+///////////////////////////////////////////////////////////////////////////////
+template <typename T>
+static inline float Bilerp(const T * t, int stride, float dx, float dy)
+{
+	float d0 = t[0] + (t[1] - t[0]) * dx;
+	float d1 = t[stride] + (t[stride + 1] - t[stride]) * dx;
+	return d0 + (d1 - d0) * dy;
+}
+///////////////////////////////////////////////////////////////////////////////
+// One step of 64-bit FNV-1a over 'size' bytes
+static inline uint64_t HashBytes(uint64_t hash, const void * data, size_t size)
+{
+	const unsigned char * bytes = (const unsigned char *) data;
+	for (size_t i=0; i<size; i++)
+		hash = (hash ^ bytes[i]) * 1099511628211ULL;
+	return hash;
+}
 ///////////////////////////////////////////////////////////////////////////////
 //
 // ------------------------------ DistanceField -------------------------------
@@ -34,56 +63,442 @@ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 ///////////////////////////////////////////////////////////////////////////////
 DistanceField::DistanceField()
 :	pValues(NULL),
+	pFilled(NULL),
+	pEmpty(NULL),
+	pTiles(NULL),
+	pCoarse(NULL),
+	pTileIndex(NULL),
+	pQValues(NULL),
+	pQTiles(NULL),
+	pMapping(NULL),
+	nMappingSize(0),
 	fWidth(0.f),
 	fHeight(0.f),
-	nResolution(0)
+	fTexelScaleX(0.f),
+	fTexelScaleY(0.f),
+	fTexelMaxX(0.f),
+	fTexelMaxY(0.f),
+	fDistScale(0.f),
+	fQuantStep(0.f),
+	fQuantScale(0.f),
+	nResX(0),
+	nResY(0),
+	nStride(0),
+	nRows(0),
+	nTileSize(0),
+	nTilesX(0),
+	nTilesY(0),
+	nTileTexels(0),
+	nPeakBytes(0),
+	nApplied(0),
+	nVersion(0),
+	bBatching(false),
+	bSolid(true)
 {}
 ///////////////////////////////////////////////////////////////////////////////
 DistanceField::~DistanceField()
 {
-	delete [] pValues;
+	ReleaseStorage();
+	delete [] pTiles;
+	delete [] pCoarse;
+	delete [] pTileIndex;
+	delete [] pQValues;
+	delete [] pQTiles;
 }
 ///////////////////////////////////////////////////////////////////////////////
 #define EMPTY 		10000.f
 #define FILLED		0.f
 
+// Largest distance in texels that survives quantization by Freeze()
+#define QUANT_RANGE		256.f
+
+// Bump whenever the file layout or the rasterization of shapes changes, so 
+// stale cache entries are rebuilt rather than loaded
+#define FILE_VERSION	1
+
+enum
+{
+	SHAPE_CREATE,
+	SHAPE_ADD_CIRCLE,
+	SHAPE_SUB_CIRCLE,
+	SHAPE_SUB_RECT,
+	SHAPE_BLUR,
+	SHAPE_CREATE_EMPTY
+};
+
+// Baked field file: this header, then the value, filled and empty arrays of
+// 'count' floats each, starting 'offset' bytes into the file
+struct FileHeader
+{
+	char		magic[4];		// "NFDF"
+	uint32_t	version;
+	uint64_t	hash;			// DistanceField::GetHash() of the field
+	int32_t		xres;
+	int32_t		yres;
+	float		width;
+	float		height;
+	uint32_t	count;
+	uint32_t	offset;
+	uint32_t	reserved[6];
+};
+
 void DistanceField::Create(int nresolution, float w, float h)
 {
-	// adding a 1 pixel border around the image
-	nInternalRes = nresolution + 2;
-	fWidth = w;
-	fHeight = h;
-	nResolution = nresolution;
+	Create(nresolution, nresolution, w, h);
+}
+///////////////////////////////////////////////////////////////////////////////
+void DistanceField::Create(int xresolution, int yresolution, float w, float h, 
+	bool solid)
+{
+	delete [] pTiles;
+	delete [] pCoarse;
+	delete [] pTileIndex;
+	delete [] pQValues;
+	delete [] pQTiles;
+	pTiles = pCoarse = NULL;
+	pTileIndex = NULL;
+	pQValues = pQTiles = NULL;
+
+	SetDimensions(xresolution, yresolution, w, h);
 
-	int count = nInternalRes * nInternalRes;
+	int count = nStride * nRows;
 	
+	ReleaseStorage();
 	pValues = new float[count];
 	pFilled = new float[count];
 	pEmpty = new float[count];
-
+	UpdatePeak();
 
 	int i = 0;
-	for (int y=0; y<nInternalRes; y++)
+	for (int y=0; y<nRows; y++)
 	{
-		for (int x=0; x<nInternalRes; x++, i++)
+		for (int x=0; x<nStride; x++, i++)
 		{
-			pFilled[i] = FILLED;
-			pEmpty[i] = EMPTY;
+			pFilled[i] = solid ? FILLED : EMPTY;
+			pEmpty[i] = solid ? EMPTY : FILLED;
 		}
 	}
 
+	// Start a new shape list, which identifies the field in the cache
+	Shape create = { solid ? SHAPE_CREATE : SHAPE_CREATE_EMPTY, 
+		(float)xresolution, (float)yresolution, w, h };
+	shapes.clear();
+	shapes.push_back(create);
+	nApplied = 1;
+	bBatching = false;
+	bSolid = solid;
+
 	Propagate();
 }
 ///////////////////////////////////////////////////////////////////////////////
 void DistanceField::AddCircle(float x, float y, float r)
 {
-	for (int iy=0; iy<nResolution; iy++)
+	Shape shape = { SHAPE_ADD_CIRCLE, x, y, r, 0.f };
+	Apply(shape);
+}
+///////////////////////////////////////////////////////////////////////////////
+void DistanceField::SubCircle(float x, float y, float r)
+{
+	Shape shape = { SHAPE_SUB_CIRCLE, x, y, r, 0.f };
+	Apply(shape);
+}
+///////////////////////////////////////////////////////////////////////////////
+void DistanceField::SubRect(float x, float y, float w, float h)
+{
+	Shape shape = { SHAPE_SUB_RECT, x, y, w, h };
+	Apply(shape);
+}
+///////////////////////////////////////////////////////////////////////////////
+void DistanceField::Blur()
+{
+	Shape shape = { SHAPE_BLUR, 0.f, 0.f, 0.f, 0.f };
+	Apply(shape);
+}
+///////////////////////////////////////////////////////////////////////////////
+void DistanceField::BeginBatch()
+{
+	bBatching = true;
+}
+///////////////////////////////////////////////////////////////////////////////
+bool DistanceField::EndBatch(const char * cachedir)
+{
+	if (!bBatching)
+		return false;
+	bBatching = false;
+
+	std::string path;
+	if (cachedir)
+	{
+		char name[64];
+		sprintf(name, "/sdf_%016llx.bin", (unsigned long long) GetHash());
+		path = std::string(cachedir) + name;
+		if (Load(path.c_str(), GetHash()))
+		{
+			nApplied = shapes.size();
+			return true;
+		}
+	}
+
+	// Rasterize everything recorded since the batch began, propagating only 
+	// when a blur needs the values and once at the end
+	bool dirty = false;
+	for (; nApplied<(int)shapes.size(); nApplied++)
+	{
+		if (shapes[nApplied].type == SHAPE_BLUR)
+		{
+			if (dirty)
+				Propagate();
+			BlurValues();
+			dirty = false;
+		}
+		else
+		{
+			Rasterize(shapes[nApplied]);
+			dirty = true;
+		}
+	}
+
+	if (dirty)
+		Propagate();
+
+	if (cachedir)
+		Save(path.c_str());
+	return false;
+}
+///////////////////////////////////////////////////////////////////////////////
+uint64_t DistanceField::GetHash() const
+{
+	// The format version, the field's dimensions and starting state, then 
+	// the recorded shape list
+	uint64_t hash = 14695981039346656037ULL;
+	uint32_t version = FILE_VERSION;
+	int32_t res[2] = { nResX, nResY };
+	float extent[2] = { fWidth, fHeight };
+	unsigned char solid = bSolid ? 1 : 0;
+	hash = HashBytes(hash, &version, sizeof(version));
+	hash = HashBytes(hash, res, sizeof(res));
+	hash = HashBytes(hash, extent, sizeof(extent));
+	hash = HashBytes(hash, &solid, sizeof(solid));
+
+	for (unsigned i=0; i<shapes.size(); i++)
+		hash = HashBytes(hash, &shapes[i], sizeof(Shape));
+	return hash;
+}
+///////////////////////////////////////////////////////////////////////////////
+bool DistanceField::Save(const char * path) const
+{
+	if (!pValues || !pFilled || !pEmpty)
+		return false;
+
+	FileHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, "NFDF", 4);
+	header.version = FILE_VERSION;
+	header.hash = GetHash();
+	header.xres = nResX;
+	header.yres = nResY;
+	header.width = fWidth;
+	header.height = fHeight;
+	header.count = nStride * nRows;
+	header.offset = sizeof(FileHeader);
+
+	// Write under a temporary name so concurrent readers never see a 
+	// partially written file
+	char tmp[32];
+	sprintf(tmp, ".%d.tmp", (int) getpid());
+	std::string temp = std::string(path) + tmp;
+
+	FILE * file = fopen(temp.c_str(), "wb");
+	if (!file)
+		return false;
+
+	bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+		fwrite(pValues, sizeof(float), header.count, file) == header.count &&
+		fwrite(pFilled, sizeof(float), header.count, file) == header.count &&
+		fwrite(pEmpty, sizeof(float), header.count, file) == header.count;
+	ok = (fclose(file) == 0) && ok;
+
+	if (!ok || rename(temp.c_str(), path) != 0)
+	{
+		remove(temp.c_str());
+		return false;
+	}
+	return true;
+}
+///////////////////////////////////////////////////////////////////////////////
+bool DistanceField::Load(const char * path, uint64_t hash)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	struct stat info;
+	if (fstat(fd, &info) != 0 || info.st_size < (off_t) sizeof(FileHeader))
+	{
+		close(fd);
+		return false;
+	}
+
+	// Private writable mapping - the arrays are used in place, and any later 
+	// edits or blurs copy only the pages they touch
+	size_t size = info.st_size;
+	void * mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mapping == MAP_FAILED)
+		return false;
+
+	const FileHeader * header = (const FileHeader *) mapping;
+	size_t texels = (size_t)(header->xres + 2) * (header->yres + 2);
+	if (memcmp(header->magic, "NFDF", 4) != 0 ||
+		header->version != FILE_VERSION ||
+		(hash != 0 && header->hash != hash) ||
+		header->xres != nResX || header->yres != nResY ||
+		header->width != fWidth || header->height != fHeight ||
+		header->xres <= 0 || header->yres <= 0 ||
+		!(header->width > 0.f) || !(header->height > 0.f) ||
+		header->count != texels ||
+		header->offset < sizeof(FileHeader) ||
+		header->offset % sizeof(float) != 0 ||
+		size < header->offset + 3 * texels * sizeof(float))
+	{
+		munmap(mapping, size);
+		return false;
+	}
+
+	ReleaseStorage();
+	SetDimensions(header->xres, header->yres, header->width, header->height);
+
+	float * values = (float *)((char *) mapping + header->offset);
+	pValues = values;
+	pFilled = values + texels;
+	pEmpty = values + 2 * texels;
+	pMapping = mapping;
+	nMappingSize = size;
+	UpdatePeak();
+	nVersion++;
+	return true;
+}
+///////////////////////////////////////////////////////////////////////////////
+void DistanceField::GetValues(float * out) const
+{
+	for (int y=0; y<nRows; y++)
+	{
+		for (int x=0; x<nStride; x++)
+			out[y * nStride + x] = GetTexel(x, y);
+	}
+}
+///////////////////////////////////////////////////////////////////////////////
+void DistanceField::SetValues(int xresolution, int yresolution, float w, 
+	float h, const float * values)
+{
+	ReleaseStorage();
+	delete [] pTiles;
+	delete [] pCoarse;
+	delete [] pTileIndex;
+	delete [] pQValues;
+	delete [] pQTiles;
+	pTiles = pCoarse = NULL;
+	pTileIndex = NULL;
+	pQValues = pQTiles = NULL;
+
+	SetDimensions(xresolution, yresolution, w, h);
+	int count = nStride * nRows;
+	pValues = new float[count];
+	memcpy(pValues, values, sizeof(float) * count);
+	UpdatePeak();
+
+	shapes.clear();
+	nApplied = 0;
+	bBatching = false;
+	nVersion++;
+}
+///////////////////////////////////////////////////////////////////////////////
+void DistanceField::Apply(const Shape & shape)
+{
+	// Narrow band fields can't be edited, and restored ones can only blur
+	if (!pValues || (!pFilled && shape.type != SHAPE_BLUR))
+		return;
+
+	shapes.push_back(shape);
+	if (bBatching)
+		return;
+
+	if (shape.type == SHAPE_BLUR)
+	{
+		BlurValues();
+	}
+	else
+	{
+		Rasterize(shape);
+		Propagate();
+	}
+	nApplied = shapes.size();
+}
+///////////////////////////////////////////////////////////////////////////////
+void DistanceField::Rasterize(const Shape & shape)
+{
+	switch (shape.type)
+	{
+	case SHAPE_ADD_CIRCLE:
+		RasterAddCircle(shape.a, shape.b, shape.c);
+		break;
+	case SHAPE_SUB_CIRCLE:
+		RasterSubCircle(shape.a, shape.b, shape.c);
+		break;
+	case SHAPE_SUB_RECT:
+		RasterSubRect(shape.a, shape.b, shape.c, shape.d);
+		break;
+	}
+}
+///////////////////////////////////////////////////////////////////////////////
+void DistanceField::SetDimensions(int xresolution, int yresolution, 
+	float w, float h)
+{
+	// adding a 1 pixel border around the image
+	nStride = xresolution + 2;
+	nRows = yresolution + 2;
+	fWidth = w;
+	fHeight = h;
+	nResX = xresolution;
+	nResY = yresolution;
+
+	// Distances are propagated in texels, which are assumed to be square
+	fTexelScaleX = nResX / w;
+	fTexelScaleY = nResY / h;
+	fDistScale = w / nResX;
+
+	// Texel coordinates are clamped to just short of the last border texel so
+	// that both bilinear taps always land inside the padded storage
+	fTexelMaxX = (nStride - 1) - (1.f / 1024.f);
+	fTexelMaxY = (nRows - 1) - (1.f / 1024.f);
+}
+///////////////////////////////////////////////////////////////////////////////
+void DistanceField::ReleaseStorage()
+{
+	if (pMapping)
+	{
+		munmap(pMapping, nMappingSize);
+		pMapping = NULL;
+		nMappingSize = 0;
+	}
+	else
+	{
+		delete [] pValues;
+		delete [] pFilled;
+		delete [] pEmpty;
+	}
+	pValues = pFilled = pEmpty = NULL;
+}
+///////////////////////////////////////////////////////////////////////////////
+void DistanceField::RasterAddCircle(float x, float y, float r)
+{
+	for (int iy=0; iy<nResY; iy++)
 	{
-		float fy = (iy / (float) nResolution) * fHeight;
+		float fy = (iy / (float) nResY) * fHeight;
 
-		for (int ix=0; ix<nResolution; ix++)
+		for (int ix=0; ix<nResX; ix++)
 		{
-			float fx = (ix / (float) nResolution) * fWidth;
+			float fx = (ix / (float) nResX) * fWidth;
 
 			float dx = fx - x;
 			float dy = fy - y;
@@ -91,25 +506,23 @@ void DistanceField::AddCircle(float x, float y, float r)
 
 			if (d < 0.f)
 			{
-				int i = ((iy + 1) * nInternalRes) + ix + 1;
+				int i = ((iy + 1) * nStride) + ix + 1;
 				pFilled[i] = FILLED;
 				pEmpty[i] = EMPTY;
 			}
 		}
 	}
-
-	Propagate();
 }
 ///////////////////////////////////////////////////////////////////////////////
-void DistanceField::SubCircle(float x, float y, float r)
+void DistanceField::RasterSubCircle(float x, float y, float r)
 {
-	for (int iy=0; iy<nResolution; iy++)
+	for (int iy=0; iy<nResY; iy++)
 	{
-		float fy = (iy / (float) nResolution) * fHeight;
+		float fy = (iy / (float) nResY) * fHeight;
 
-		for (int ix=0; ix<nResolution; ix++)
+		for (int ix=0; ix<nResX; ix++)
 		{
-			float fx = (ix / (float) nResolution) * fWidth;
+			float fx = (ix / (float) nResX) * fWidth;
 
 			float dx = fx - x;
 			float dy = fy - y;
@@ -117,85 +530,63 @@ void DistanceField::SubCircle(float x, float y, float r)
 
 			if (d < 0.f)
 			{
-				int i = ((iy + 1) * nInternalRes) + ix + 1;
+				int i = ((iy + 1) * nStride) + ix + 1;
 				pEmpty[i] = FILLED;
 				pFilled[i] = EMPTY;
 			}
 		}
 	}
-
-	Propagate();
 }
 ///////////////////////////////////////////////////////////////////////////////
-void DistanceField::SubRect(float x, float y, float w, float h)
+void DistanceField::RasterSubRect(float x, float y, float w, float h)
 {
-	for (int iy=0; iy<nResolution; iy++)
+	for (int iy=0; iy<nResY; iy++)
 	{
-		float fy = (iy / (float) nResolution) * fHeight;
+		float fy = (iy / (float) nResY) * fHeight;
 
-		for (int ix=0; ix<nResolution; ix++)
+		for (int ix=0; ix<nResX; ix++)
 		{
-			float fx = (ix / (float) nResolution) * fWidth;
+			float fx = (ix / (float) nResX) * fWidth;
 
 			if (fx > x && fx < (x + w) && fy > y && fy < (y + h))
 			{
-				int i = ((iy + 1) * nInternalRes) + ix + 1;
+				int i = ((iy + 1) * nStride) + ix + 1;
 				pEmpty[i] = FILLED;
 				pFilled[i] = EMPTY;
 			}
 		}
 	}
-
-	Propagate();
 }
 ///////////////////////////////////////////////////////////////////////////////
 float DistanceField::SampleDistance(int x, int y) const
 {
 	x++;
 	y++;
-	x = (x < 0) ? 0 : ((x >= nInternalRes) ? (nInternalRes-1) : x);
-	y = (y < 0) ? 0 : ((y >= nInternalRes) ? (nInternalRes-1) : y);
+	x = (x < 0) ? 0 : ((x >= nStride) ? (nStride-1) : x);
+	y = (y < 0) ? 0 : ((y >= nRows) ? (nRows-1) : y);
 	
-	return pValues[y*nInternalRes+x] * (fWidth / nResolution);
+	return GetTexel(x, y) * fDistScale;
 }
 ///////////////////////////////////////////////////////////////////////////////
 float DistanceField::SampleDistance(float x, float y) const
 {
-	x = (x / fWidth);
-	y = (y / fHeight);
-	return SampleDistanceN(x,y);
+	return SampleTexel(x * fTexelScaleX + 1.f, y * fTexelScaleY + 1.f);
 }
 ///////////////////////////////////////////////////////////////////////////////
 float DistanceField::SampleDistanceN(float x, float y) const
 {
-	x = x * nResolution;
-	y = y * nResolution;
-	int ix = (int)x;
-	int iy = (int)y;
-	float dx = x - ix;
-	float dy = y - iy;
-
-	float d0, d1, d2, d3;
-
-	d0 = SampleDistance(ix, iy);
-	d1 = SampleDistance(ix + 1, iy);
-	d2 = SampleDistance(ix, iy + 1);
-	d3 = SampleDistance(ix + 1, iy + 1);
-
-	d0 = d0 * (1.f - dx) + d1 * dx;
-	d1 = d2 * (1.f - dx) + d3 * dx;
-	return d0 * (1.f - dy) + d1 * dy;
+	return SampleTexel(x * nResX + 1.f, y * nResY + 1.f);
 }
 ///////////////////////////////////////////////////////////////////////////////
 void DistanceField::SampleGradient(float x, float y, float * outx, float * outy) const
 {
-	float d0 = SampleDistance(x, y - (0.5f / nResolution));
-	float d1 = SampleDistance(x - (0.5f / nResolution), y);
-	float d2 = SampleDistance(x + (0.5f / nResolution), y);
-	float d3 = SampleDistance(x, y + (0.5f / nResolution));
+	float d0 = SampleDistance(x, y - (0.5f / nResY));
+	float d1 = SampleDistance(x - (0.5f / nResX), y);
+	float d2 = SampleDistance(x + (0.5f / nResX), y);
+	float d3 = SampleDistance(x, y + (0.5f / nResY));
 
-	*outx = (d2 - d1) * nResolution;
-	*outy = (d3 - d0) * nResolution;
+	*outx = (d2 - d1) * nResX;
+	*outy = (d3 - d0) * nResY;
 }
 ///////////////////////////////////////////////////////////////////////////////
 float DistanceField::SampleNormal(float x, float y, float * outx, float * outy) const
@@ -208,14 +599,49 @@ float DistanceField::SampleNormal(float x, float y, float * outx, float * outy)
 	return len;
 }
 ///////////////////////////////////////////////////////////////////////////////
+void DistanceField::SampleDistanceBatch(const float * x, const float * y,
+	float * out, int count) const
+{
+	SampleBatch(x, y, 0.f, 0.f, out, count);
+}
+///////////////////////////////////////////////////////////////////////////////
+void DistanceField::SampleGradientBatch(const float * x, const float * y,
+	float * outx, float * outy, int count) const
+{
+	// Same central differences as SampleGradient, evaluated a block at a time
+	const int BLOCK = 256;
+	float d0[BLOCK], d1[BLOCK], d2[BLOCK], d3[BLOCK];
+	float hx = 0.5f / nResX;
+	float hy = 0.5f / nResY;
+
+	for (int i=0; i<count; i+=BLOCK)
+	{
+		int n = std::min(BLOCK, count - i);
+		SampleBatch(x + i, y + i, 0.f, -hy, d0, n);
+		SampleBatch(x + i, y + i, -hx, 0.f, d1, n);
+		SampleBatch(x + i, y + i, hx, 0.f, d2, n);
+		SampleBatch(x + i, y + i, 0.f, hy, d3, n);
+
+		for (int j=0; j<n; j++)
+		{
+			outx[i + j] = (d2[j] - d1[j]) * nResX;
+			outy[i + j] = (d3[j] - d0[j]) * nResY;
+		}
+	}
+}
+///////////////////////////////////////////////////////////////////////////////
 void DistanceField::Propagate()
 {
+	if (!pFilled)
+		return;
+	nVersion++;
+
 	// Using 8SSDT Algorithm
-	for (int i=0; i<nInternalRes; i++)
+	for (int i=0; i<nRows; i++)
 	{
-		for (int j=0; j<nInternalRes; j++)
+		for (int j=0; j<nStride; j++)
 		{
-			int id = i*nInternalRes+j;
+			int id = i*nStride+j;
 			float d0, d1, d2, d3, d4;
 
 			{
@@ -257,11 +683,11 @@ void DistanceField::Propagate()
 		}
 	}
 
-	for (int i=nInternalRes-1; i>=0; i--)
+	for (int i=nRows-1; i>=0; i--)
 	{
-		for (int j=nInternalRes-1; j>=0; j--)
+		for (int j=nStride-1; j>=0; j--)
 		{
-			int id = i*nInternalRes+j;
+			int id = i*nStride+j;
 			float d0, d1, d2, d3, d4;
 
 			{
@@ -304,21 +730,25 @@ void DistanceField::Propagate()
 		}
 	}
 
-	for (int i=0; i<nInternalRes; i++)
+	for (int i=0; i<nRows; i++)
 	{
-		for (int j=0; j<nInternalRes; j++)
+		for (int j=0; j<nStride; j++)
 		{
-			int id = i*nInternalRes+j;
+			int id = i*nStride+j;
 			pValues[id] = pFilled[id] - pEmpty[id];
 		}
 	}
 }
 ///////////////////////////////////////////////////////////////////////////////
-void DistanceField::Blur()
+void DistanceField::BlurValues()
 {
-	for (int i=0; i<nInternalRes; i++)
+	if (!pValues)
+		return;
+	nVersion++;
+
+	for (int i=0; i<nRows; i++)
 	{
-		for (int j=0; j<nInternalRes; j++)
+		for (int j=0; j<nStride; j++)
 		{
 			float d[5];
 			d[0] = GetDistance(pValues, j-2, i) * 2.f;
@@ -327,13 +757,13 @@ void DistanceField::Blur()
 			d[3] = GetDistance(pValues, j+1, i) * 4.f;
 			d[4] = GetDistance(pValues, j+2, i) * 2.f;
 
-			pValues[i*nInternalRes+j] = (d[0] + d[1] + d[2] + d[3] + d[4]) / 20.f;
+			pValues[i*nStride+j] = (d[0] + d[1] + d[2] + d[3] + d[4]) / 20.f;
 		}
 	}
 
-	for (int i=0; i<nInternalRes; i++)
+	for (int i=0; i<nRows; i++)
 	{
-		for (int j=0; j<nInternalRes; j++)
+		for (int j=0; j<nStride; j++)
 		{
 			float d[5];
 			d[0] = GetDistance(pValues, j, i-2) * 2.f;
@@ -342,16 +772,325 @@ void DistanceField::Blur()
 			d[3] = GetDistance(pValues, j, i+1) * 4.f;
 			d[4] = GetDistance(pValues, j, i+2) * 2.f;
 
-			pValues[i*nInternalRes+j] = (d[0] + d[1] + d[2] + d[3] + d[4]) / 20.f;
+			pValues[i*nStride+j] = (d[0] + d[1] + d[2] + d[3] + d[4]) / 20.f;
 		}
 	}	
 }
 ///////////////////////////////////////////////////////////////////////////////
 float DistanceField::GetDistance(float * src, int x, int y) const
 {
-	x = (x < 0) ? 0 : ((x >= nInternalRes) ? (nInternalRes-1) : x);
-	y = (y < 0) ? 0 : ((y >= nInternalRes) ? (nInternalRes-1) : y);
+	x = (x < 0) ? 0 : ((x >= nStride) ? (nStride-1) : x);
+	y = (y < 0) ? 0 : ((y >= nRows) ? (nRows-1) : y);
 	
-	return src[y*nInternalRes+x];
+	return src[y*nStride+x];
+}
+///////////////////////////////////////////////////////////////////////////////
+float DistanceField::GetTexel(int x, int y) const
+{
+	if (pQValues)
+		return pQValues[y*nStride+x] * fQuantStep;
+	if (pValues)
+		return pValues[y*nStride+x];
+
+	// Narrow band - the last texel of a row or column lives in the apron of 
+	// the final tile
+	int bx = std::min(x / nTileSize, nTilesX - 1);
+	int by = std::min(y / nTileSize, nTilesY - 1);
+	int lx = x - bx * nTileSize;
+	int ly = y - by * nTileSize;
+	int tile = pTileIndex[by * nTilesX + bx];
+	if (tile >= 0)
+	{
+		int id = tile + ly * (nTileSize + 1) + lx;
+		return pQTiles ? pQTiles[id] * fQuantStep : pTiles[id];
+	}
+
+	float u = lx / (float) nTileSize;
+	float v = ly / (float) nTileSize;
+	return Bilerp(pCoarse + by * (nTilesX + 1) + bx, nTilesX + 1, u, v);
+}
+///////////////////////////////////////////////////////////////////////////////
+float DistanceField::SampleTexel(float tx, float ty) const
+{
+	// (tx, ty) are coordinates in the padded texel space; once clamped the 
+	// four taps need no further bounds checks
+	tx = std::min(std::max(tx, 0.f), fTexelMaxX);
+	ty = std::min(std::max(ty, 0.f), fTexelMaxY);
+	int ix = (int)tx;
+	int iy = (int)ty;
+	float dx = tx - ix;
+	float dy = ty - iy;
+
+	if (pQValues)
+		return Bilerp(pQValues + iy * nStride + ix, nStride, dx, dy) * fQuantScale;
+	if (pValues)
+		return Bilerp(pValues + iy * nStride + ix, nStride, dx, dy) * fDistScale;
+	return SampleBand(ix, iy, dx, dy) * fDistScale;
+}
+///////////////////////////////////////////////////////////////////////////////
+float DistanceField::SampleBand(int ix, int iy, float dx, float dy) const
+{
+	int bx = ix / nTileSize;
+	int by = iy / nTileSize;
+	int lx = ix - bx * nTileSize;
+	int ly = iy - by * nTileSize;
+	int tile = pTileIndex[by * nTilesX + bx];
+
+	if (tile >= 0)
+	{
+		// Tiles carry a one texel apron so both taps stay within the tile
+		int s = nTileSize + 1;
+		int id = tile + ly * s + lx;
+		if (pQTiles)
+			return Bilerp(pQTiles + id, s, dx, dy) * fQuantStep;
+		return Bilerp(pTiles + id, s, dx, dy);
+	}
+
+	// Away from any surface the distance is smooth enough to interpolate 
+	// across the whole tile from its corners
+	float u = (lx + dx) / nTileSize;
+	float v = (ly + dy) / nTileSize;
+	return Bilerp(pCoarse + by * (nTilesX + 1) + bx, nTilesX + 1, u, v);
+}
+///////////////////////////////////////////////////////////////////////////////
+void DistanceField::SampleBatch(const float * x, const float * y, 
+	float ox, float oy, float * out, int count) const
+{
+	int i = 0;
+
+#if defined(__SSE2__)
+	if (pQValues)
+		i = SampleBatchDense(pQValues, fQuantScale, x, y, ox, oy, out, count);
+	else if (pValues)
+		i = SampleBatchDense(pValues, fDistScale, x, y, ox, oy, out, count);
+#endif
+
+	for (; i<count; i++)
+	{
+		out[i] = SampleTexel((x[i] + ox) * fTexelScaleX + 1.f, 
+			(y[i] + oy) * fTexelScaleY + 1.f);
+	}
+}
+///////////////////////////////////////////////////////////////////////////////
+#if defined(__SSE2__)
+template <typename T>
+int DistanceField::SampleBatchDense(const T * values, float scale, 
+	const float * x, const float * y, float ox, float oy, 
+	float * out, int count) const
+{
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 one = _mm_set1_ps(1.f);
+	const __m128 tmaxx = _mm_set1_ps(fTexelMaxX);
+	const __m128 tmaxy = _mm_set1_ps(fTexelMaxY);
+	const __m128 sx = _mm_set1_ps(fTexelScaleX);
+	const __m128 sy = _mm_set1_ps(fTexelScaleY);
+	const __m128 offx = _mm_set1_ps(ox);
+	const __m128 offy = _mm_set1_ps(oy);
+	const __m128 stride = _mm_set1_ps((float)nStride);
+	const __m128 dscale = _mm_set1_ps(scale);
+	const int s = nStride;
+
+	int i = 0;
+	for (; i+4<=count; i+=4)
+	{
+		__m128 tx = _mm_add_ps(_mm_mul_ps(_mm_add_ps(_mm_loadu_ps(x + i), offx), sx), one);
+		__m128 ty = _mm_add_ps(_mm_mul_ps(_mm_add_ps(_mm_loadu_ps(y + i), offy), sy), one);
+		tx = _mm_min_ps(_mm_max_ps(tx, zero), tmaxx);
+		ty = _mm_min_ps(_mm_max_ps(ty, zero), tmaxy);
+
+		// Coordinates are non-negative here so truncation is a floor
+		__m128 fx = _mm_cvtepi32_ps(_mm_cvttps_epi32(tx));
+		__m128 fy = _mm_cvtepi32_ps(_mm_cvttps_epi32(ty));
+		__m128 dx = _mm_sub_ps(tx, fx);
+		__m128 dy = _mm_sub_ps(ty, fy);
+
+		int id[4];
+		_mm_storeu_si128((__m128i *) id, 
+			_mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(fy, stride), fx)));
+
+		const T * t0 = values + id[0];
+		const T * t1 = values + id[1];
+		const T * t2 = values + id[2];
+		const T * t3 = values + id[3];
+
+		__m128 v00 = _mm_set_ps(t3[0], t2[0], t1[0], t0[0]);
+		__m128 v10 = _mm_set_ps(t3[1], t2[1], t1[1], t0[1]);
+		__m128 v01 = _mm_set_ps(t3[s], t2[s], t1[s], t0[s]);
+		__m128 v11 = _mm_set_ps(t3[s+1], t2[s+1], t1[s+1], t0[s+1]);
+
+		__m128 d0 = _mm_add_ps(v00, _mm_mul_ps(_mm_sub_ps(v10, v00), dx));
+		__m128 d1 = _mm_add_ps(v01, _mm_mul_ps(_mm_sub_ps(v11, v01), dx));
+		__m128 d = _mm_add_ps(d0, _mm_mul_ps(_mm_sub_ps(d1, d0), dy));
+		_mm_storeu_ps(out + i, _mm_mul_ps(d, dscale));
+	}
+	return i;
+}
+#endif
+///////////////////////////////////////////////////////////////////////////////
+void DistanceField::Freeze()
+{
+	if (bBatching)
+		EndBatch();
+
+	if (!pValues && !pTiles)
+		return;
+
+	// Distances past the quantization range saturate; only their sign and 
+	// the fact that they're far from a surface matter to the simulation
+	float range = 0.f;
+	int count = pValues ? nStride * nRows : 0;
+	for (int i=0; i<count; i++)
+		range = std::max(range, fabsf(pValues[i]));
+	if (pTiles && !pValues)
+		range = QUANT_RANGE;
+	range = std::min(std::max(range, 1.f), QUANT_RANGE);
+
+	nVersion++;
+	fQuantStep = range / 32767.f;
+	fQuantScale = fQuantStep * fDistScale;
+
+	if (pValues)
+	{
+		pQValues = new short[count];
+		Quantize(pValues, pQValues, count);
+		UpdatePeak();
+		ReleaseStorage();
+	}
+	else
+	{
+		int tiles = 0;
+		for (int i=0; i<nTilesX * nTilesY; i++)
+		{
+			if (pTileIndex[i] >= 0)
+				tiles++;
+		}
+
+		count = tiles * (nTileSize + 1) * (nTileSize + 1);
+		pQTiles = new short[std::max(count, 1)];
+		Quantize(pTiles, pQTiles, count);
+		UpdatePeak();
+		delete [] pTiles;
+		pTiles = NULL;
+	}
+}
+///////////////////////////////////////////////////////////////////////////////
+void DistanceField::Quantize(const float * src, short * dst, int count) const
+{
+	float inv = 1.f / fQuantStep;
+	for (int i=0; i<count; i++)
+	{
+		float q = src[i] * inv;
+		q = std::min(std::max(q, -32767.f), 32767.f);
+		dst[i] = (short)(q < 0.f ? q - 0.5f : q + 0.5f);
+	}
+}
+///////////////////////////////////////////////////////////////////////////////
+void DistanceField::BuildNarrowBand(float band, int tilesize)
+{
+	if (!pValues || tilesize < 1)
+		return;
+
+	// Both bilinear taps of any clamped coordinate must fall in one tile
+	nVersion++;
+	nTileSize = tilesize;
+	nTilesX = (nStride - 2) / nTileSize + 1;
+	nTilesY = (nRows - 2) / nTileSize + 1;
+
+	int s = nTilesX + 1;
+	pCoarse = new float[s * (nTilesY + 1)];
+	for (int by=0; by<=nTilesY; by++)
+	{
+		for (int bx=0; bx<=nTilesX; bx++)
+			pCoarse[by * s + bx] = GetDistance(pValues, bx * nTileSize, by * nTileSize);
+	}
+
+	// Only tiles with a texel inside the band keep full resolution
+	float limit = band / fDistScale;
+	int ts = nTileSize + 1;
+	std::vector<int> offsets(nTilesX * nTilesY, -1);
+	int count = 0;
+
+	for (int by=0; by<nTilesY; by++)
+	{
+		for (int bx=0; bx<nTilesX; bx++)
+		{
+			bool inside = false;
+			for (int y=0; y<ts && !inside; y++)
+			{
+				for (int x=0; x<ts && !inside; x++)
+				{
+					float d = GetDistance(pValues, bx * nTileSize + x, by * nTileSize + y);
+					inside = (d < limit && d > -limit);
+				}
+			}
+
+			if (inside)
+			{
+				offsets[by * nTilesX + bx] = count;
+				count += ts * ts;
+			}
+		}
+	}
+
+	pTiles = new float[std::max(count, 1)];
+	pTileIndex = new int[nTilesX * nTilesY];
+	nTileTexels = std::max(count, 1);
+	for (int by=0; by<nTilesY; by++)
+	{
+		for (int bx=0; bx<nTilesX; bx++)
+		{
+			int offset = offsets[by * nTilesX + bx];
+			pTileIndex[by * nTilesX + bx] = offset;
+			if (offset < 0)
+				continue;
+
+			float * t = pTiles + offset;
+			for (int y=0; y<ts; y++)
+			{
+				for (int x=0; x<ts; x++)
+					t[y * ts + x] = GetDistance(pValues, bx * nTileSize + x, by * nTileSize + y);
+			}
+		}
+	}
+
+	UpdatePeak();
+	ReleaseStorage();
+}
+///////////////////////////////////////////////////////////////////////////////
+void DistanceField::CountMemory(MemoryStats & stats, MemoryTag tag) const
+{
+	// Only the shape list has room to spare
+	size_t heap = GetHeapBytes();
+	size_t spare = (shapes.capacity() - shapes.size()) * sizeof(Shape);
+	stats.Add(tag, heap - spare, heap);
+	stats.Add(MEMORY_MAPPED, nMappingSize, nMappingSize);
+}
+///////////////////////////////////////////////////////////////////////////////
+size_t DistanceField::GetHeapBytes() const
+{
+	size_t texels = (size_t) nStride * nRows;
+	size_t bytes = shapes.capacity() * sizeof(Shape);
+	if (!pMapping)
+	{
+		bytes += (pValues ? texels * sizeof(float) : 0) +
+			(pFilled ? texels * sizeof(float) : 0) +
+			(pEmpty ? texels * sizeof(float) : 0);
+	}
+	if (pQValues)
+		bytes += texels * sizeof(short);
+	if (pCoarse)
+		bytes += (size_t)(nTilesX + 1) * (nTilesY + 1) * sizeof(float);
+	if (pTileIndex)
+		bytes += (size_t) nTilesX * nTilesY * sizeof(int);
+	if (pTiles)
+		bytes += (size_t) nTileTexels * sizeof(float);
+	if (pQTiles)
+		bytes += (size_t) nTileTexels * sizeof(short);
+	return bytes;
+}
+///////////////////////////////////////////////////////////////////////////////
+void DistanceField::UpdatePeak()
+{
+	nPeakBytes = std::max(nPeakBytes, GetHeapBytes());
 }
 ///////////////////////////////////////////////////////////////////////////////
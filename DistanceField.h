@@ -23,6 +23,11 @@ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #ifndef HH_SDFC_DISTANCEFIELD_HH
 #define HH_SDFC_DISTANCEFIELD_HH
 
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+#include "Memory.h"
+
 class DistanceField
 {	
 public:
@@ -30,6 +35,8 @@ public:
 	~DistanceField();
 
 	void 	Create(int nresolution, float w, float h);
+	void 	Create(int xresolution, int yresolution, float w, float h, 
+				bool solid = true);
 
 	void	AddCircle(float x, float y, float r);
 	void	SubCircle(float x, float y, float r);
@@ -41,25 +48,136 @@ public:
 	void	SampleGradient(float x, float y, float * outx, float * outy) const;
 	float	SampleNormal(float x, float y, float * outx, float * outy) const;
 
+	// Batched versions of SampleDistance(float,float) and SampleGradient for
+	// resolving many boundary queries in one pass; arrays hold 'count' points
+	void	SampleDistanceBatch(const float * x, const float * y, 
+				float * out, int count) const;
+	void	SampleGradientBatch(const float * x, const float * y, 
+				float * outx, float * outy, int count) const;
+
 	void	Propagate();
 	void 	Blur();
 
-	int 	GetResolution() const { return nResolution; }
+	// Between BeginBatch and EndBatch shapes and blurs are only recorded; 
+	// EndBatch then rasterizes them with a single propagation. Given a cache
+	// directory it first tries to map a baked field for the same shape list 
+	// and writes one after building, returning true on a cache hit.
+	void	BeginBatch();
+	bool	EndBatch(const char * cachedir = NULL);
+	bool	IsBatching() const { return bBatching; }
+
+	// Baked fields are memory mapped and used in place; a non-zero hash must
+	// match the one stored in the file, and the file's resolution and extent
+	// must match the field's as created.  The hash covers those, whether the
+	// field started solid, and the shape list.
+	bool	Save(const char * path) const;
+	bool	Load(const char * path, uint64_t hash = 0);
+	uint64_t GetHash() const;
+
+	// Dense copy of the distances in texels, whatever the storage, including
+	// the one texel border; for saving simulation state.  A field
+	// restored from such a copy can be blurred but no longer edited.
+	int		GetValueCount() const { return nStride * nRows; }
+	void	GetValues(float * out) const;
+	void	SetValues(int xresolution, int yresolution, float w, float h, 
+				const float * values);
+
+	// Swaps the dense storage for full resolution tiles kept only within 
+	// 'band' world units of a surface, plus coarse per-tile values elsewhere.
+	// The field can't be edited afterwards.
+	void	BuildNarrowBand(float band, int tilesize = 8);
+	bool	IsNarrowBand() const { return pTileIndex != NULL; }
+
+	// Replaces the float values with 16-bit quantized distances and frees the
+	// propagation buffers.  Like the narrow band the field becomes read-only.
+	void	Freeze();
+	bool	IsFrozen() const { return pQValues != NULL || pQTiles != NULL; }
+
+	// Changes whenever the sampled distances do
+	unsigned GetVersion() const { return nVersion; }
+
+	// Adds the heap storage to 'tag' and any mapped file to MEMORY_MAPPED.
+	// The peak of the heap storage covers every change since the field was
+	// made, including the buffers building a field needs only briefly.
+	void	CountMemory(MemoryStats & stats, MemoryTag tag) const;
+	size_t	GetPeakBytes() const { return nPeakBytes; }
+
+	int 	GetResolution() const { return nResX; }
+	int 	GetResolutionX() const { return nResX; }
+	int 	GetResolutionY() const { return nResY; }
 	
 private:		
 	DistanceField(const DistanceField &);
 	DistanceField & operator = (const DistanceField &);
 
+	struct Shape
+	{
+		int		type;
+		float	a, b, c, d;
+	};
+
+	void	Apply(const Shape & shape);
+	void	Rasterize(const Shape & shape);
+	void	RasterAddCircle(float x, float y, float r);
+	void	RasterSubCircle(float x, float y, float r);
+	void	RasterSubRect(float x, float y, float w, float h);
+	void	BlurValues();
+	void	SetDimensions(int xresolution, int yresolution, float w, float h);
+	void	ReleaseStorage();
+
 	float	GetDistance(float * src, int x, int y) const;
+	float	GetTexel(int x, int y) const;
+	float	SampleTexel(float tx, float ty) const;
+	float	SampleBand(int ix, int iy, float dx, float dy) const;
+	void	SampleBatch(const float * x, const float * y, float ox, float oy,
+				float * out, int count) const;
+	template <typename T>
+	int		SampleBatchDense(const T * values, float scale, const float * x, 
+				const float * y, float ox, float oy, float * out, int count) const;
+	void	Quantize(const float * src, short * dst, int count) const;
+	size_t	GetHeapBytes() const;
+	void	UpdatePeak();
 
 	float *		pValues;
 	float *		pFilled;
 	float *		pEmpty;
 
+	// Narrow band storage, NULL while the field is dense
+	float *		pTiles;			// pool of (tilesize+1)^2 texel tiles
+	float *		pCoarse;		// values at tile corners
+	int *		pTileIndex;		// offset of each tile in pTiles, or -1
+
+	// Quantized storage once frozen; distance = value * fQuantStep texels
+	short *		pQValues;
+	short *		pQTiles;
+
+	void *		pMapping;		// baked file the dense arrays point into
+	size_t		nMappingSize;
+
 	float		fWidth;
 	float		fHeight;
-	int			nResolution;
-	int			nInternalRes;
+	float		fTexelScaleX;	// world units -> texels
+	float		fTexelScaleY;
+	float		fTexelMaxX;		// largest texel coordinate needing no clamp
+	float		fTexelMaxY;
+	float		fDistScale;		// texels -> world units
+	float		fQuantStep;		// quantized units -> texels
+	float		fQuantScale;	// quantized units -> world units
+	int			nResX;
+	int			nResY;
+	int			nStride;		// texels per row including the border
+	int			nRows;			// rows including the border
+	int			nTileSize;
+	int			nTilesX;
+	int			nTilesY;
+	int			nTileTexels;	// in pTiles or pQTiles
+	size_t		nPeakBytes;
+
+	std::vector<Shape>	shapes;	// everything applied since Create
+	int			nApplied;		// shapes already rasterized
+	unsigned	nVersion;
+	bool		bBatching;
+	bool		bSolid;			// as created
 };
 
 #endif // HH_SDFC_DISTANCEFIELD_HH
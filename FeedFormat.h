@@ -0,0 +1,102 @@
+/*
+Copyright (c) 2012 Chris Lentini
+http://divergentcoder.com
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of 
+this software and associated documentation files (the "Software"), to deal in 
+the Software without restriction, including without limitation the rights to use, 
+copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the 
+Software, and to permit persons to whom the Software is furnished to do so, 
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all 
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS 
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR 
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER 
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN 
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+
+#ifndef HH_MPM_FEEDFORMAT_HH
+#define HH_MPM_FEEDFORMAT_HH
+
+#include <stdint.h>
+
+// Layout of the shared particle feed, shared by the writer in the simulation
+// and the reader library.  The file starts with a FeedHeader, followed by a
+// ring of 'slots' frames of 'slotBytes' each.  A frame is a FeedSlot and 
+// then the arrays x, y, vx, vy (float) and material (uint16_t, the fluid's
+// index), each 'capacity' long and starting on a FEED_ALIGN boundary.
+//
+// Each slot is guarded by a sequence number that is odd while the writer is
+// in it.  A reader takes the newest frame from 'latest', notes the slot's 
+// sequence and reads in place; the data was consistent if the sequence is 
+// unchanged afterwards.  The writer never waits on readers - one that 
+// holds a frame longer than the ring takes to come around just fails its
+// check.  All counters are 32-bit so they are read and written atomically
+// on every target.
+
+#define FEED_MAGIC		0x44454546	// "FEED"
+#define FEED_VERSION	1
+#define FEED_ALIGN		64
+
+struct FeedHeader
+{
+	uint32_t			magic;
+	uint32_t			version;
+	uint32_t			slots;
+	uint32_t			capacity;	// particles per frame
+	uint32_t			slotBytes;
+	uint32_t			dataOffset;	// of the first slot
+	float				gridWidth;	// positions are in grid cells
+	float				gridHeight;
+	volatile uint32_t	latest;		// newest complete frame, 0 for none
+	volatile uint32_t	retired;	// non-zero once the writer has moved on
+	uint32_t			reserved[6];
+};
+
+struct FeedSlot
+{
+	volatile uint32_t	sequence;
+	uint32_t			frame;		// frame number, slot is frame % slots
+	uint32_t			step;		// FluidSim::Step
+	uint32_t			count;		// particles in the arrays
+	uint32_t			fluids;
+	uint32_t			reserved[11];
+};
+
+enum FeedArray
+{
+	FEED_X,
+	FEED_Y,
+	FEED_VX,
+	FEED_VY,
+	FEED_MATERIAL,
+
+	FEED_ARRAY_COUNT
+};
+
+inline uint32_t FeedAlign(uint32_t bytes)
+{
+	return (bytes + FEED_ALIGN - 1) & ~(uint32_t)(FEED_ALIGN - 1);
+}
+
+// Byte offset of an array from the start of its slot
+inline uint32_t FeedArrayOffset(uint32_t capacity, int array)
+{
+	uint32_t floats = FeedAlign(capacity * sizeof(float));
+	uint32_t offset = FeedAlign(sizeof(FeedSlot));
+	return offset + floats * (array < FEED_MATERIAL ? array : FEED_MATERIAL);
+}
+
+inline uint32_t FeedSlotBytes(uint32_t capacity)
+{
+	return FeedArrayOffset(capacity, FEED_MATERIAL) + 
+		FeedAlign(capacity * sizeof(uint16_t));
+}
+
+#endif // HH_MPM_FEEDFORMAT_HH
@@ -0,0 +1,197 @@
+/*
+Copyright (c) 2012 Chris Lentini
+http://divergentcoder.com
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of 
+this software and associated documentation files (the "Software"), to deal in 
+the Software without restriction, including without limitation the rights to use, 
+copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the 
+Software, and to permit persons to whom the Software is furnished to do so, 
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all 
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS 
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR 
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER 
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN 
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "FeedFormat.h"
+#include "FeedReader.h"
+
+// Times Acquire() looks again when the writer is in the newest slot
+#define ACQUIRE_TRIES	4
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// ------------------------------- FeedReader --------------------------------- 
+//
+///////////////////////////////////////////////////////////////////////////////
+FeedReader::FeedReader()
+:	pMapping(NULL),
+	nSize(0),
+	nDevice(0),
+	nInode(0),
+	bRetired(false)
+{}
+///////////////////////////////////////////////////////////////////////////////
+FeedReader::~FeedReader()
+{
+	Close();
+}
+///////////////////////////////////////////////////////////////////////////////
+bool FeedReader::Open(const char * feedpath)
+{
+	Close();
+	path = feedpath;
+	return Map();
+}
+///////////////////////////////////////////////////////////////////////////////
+void FeedReader::Close()
+{
+	Unmap();
+	path.clear();
+}
+///////////////////////////////////////////////////////////////////////////////
+bool FeedReader::Map()
+{
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	struct stat info;
+	if (fstat(fd, &info) != 0 || info.st_size < (off_t) sizeof(FeedHeader))
+	{
+		close(fd);
+		return false;
+	}
+
+	size_t size = info.st_size;
+	void * mapping = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mapping == MAP_FAILED)
+		return false;
+
+	const FeedHeader * header = (const FeedHeader *) mapping;
+	if (header->magic != FEED_MAGIC || header->version != FEED_VERSION ||
+		header->slots < 2 || 
+		header->slotBytes < FeedSlotBytes(header->capacity) ||
+		size < header->dataOffset + (size_t) header->slotBytes * header->slots)
+	{
+		munmap(mapping, size);
+		return false;
+	}
+
+	pMapping = mapping;
+	nSize = size;
+	nDevice = info.st_dev;
+	nInode = info.st_ino;
+	return true;
+}
+///////////////////////////////////////////////////////////////////////////////
+void FeedReader::Unmap()
+{
+	if (pMapping)
+		munmap(pMapping, nSize);
+	pMapping = NULL;
+	nSize = 0;
+	bRetired = false;
+}
+///////////////////////////////////////////////////////////////////////////////
+bool FeedReader::Refresh()
+{
+	if (path.empty())
+		return false;
+
+	// A retired ring has either been replaced by a larger one at the same 
+	// path or closed for good; only a different file at the path is worth
+	// mapping, otherwise the last frames are kept
+	if (pMapping && ((const FeedHeader *) pMapping)->retired)
+	{
+		struct stat info;
+		if (stat(path.c_str(), &info) != 0 || 
+			(info.st_dev == nDevice && info.st_ino == nInode))
+		{
+			bRetired = true;
+			return true;
+		}
+		Unmap();
+	}
+	return pMapping || Map();
+}
+///////////////////////////////////////////////////////////////////////////////
+bool FeedReader::Acquire(FeedFrame * out)
+{
+	if (!Refresh())
+		return false;
+
+	const FeedHeader * header = (const FeedHeader *) pMapping;
+	for (int i=0; i<ACQUIRE_TRIES; i++)
+	{
+		uint32_t latest = header->latest;
+		if (latest == 0)
+			return false;
+
+		const char * base = (const char *) pMapping + header->dataOffset + 
+			(size_t) header->slotBytes * (latest % header->slots);
+		const FeedSlot * slot = (const FeedSlot *) base;
+
+		uint32_t sequence = slot->sequence;
+		__sync_synchronize();
+		if ((sequence & 1) || slot->frame != latest || 
+			slot->count > header->capacity)
+		{
+			continue;
+		}
+
+		uint32_t capacity = header->capacity;
+		out->frame = latest;
+		out->step = slot->step;
+		out->count = slot->count;
+		out->fluids = slot->fluids;
+		out->x = (const float *)(base + FeedArrayOffset(capacity, FEED_X));
+		out->y = (const float *)(base + FeedArrayOffset(capacity, FEED_Y));
+		out->vx = (const float *)(base + FeedArrayOffset(capacity, FEED_VX));
+		out->vy = (const float *)(base + FeedArrayOffset(capacity, FEED_VY));
+		out->material = (const uint16_t *)(base + 
+			FeedArrayOffset(capacity, FEED_MATERIAL));
+		out->guard = &slot->sequence;
+		out->sequence = sequence;
+
+		// The frame's own fields were read in the slot too
+		if (Validate(*out))
+			return true;
+	}
+	return false;
+}
+///////////////////////////////////////////////////////////////////////////////
+bool FeedReader::Validate(const FeedFrame & frame) const
+{
+	__sync_synchronize();
+	return *frame.guard == frame.sequence;
+}
+///////////////////////////////////////////////////////////////////////////////
+uint32_t FeedReader::GetLatest()
+{
+	return Refresh() ? ((const FeedHeader *) pMapping)->latest : 0;
+}
+///////////////////////////////////////////////////////////////////////////////
+float FeedReader::GetGridWidth() const
+{
+	return pMapping ? ((const FeedHeader *) pMapping)->gridWidth : 0.f;
+}
+///////////////////////////////////////////////////////////////////////////////
+float FeedReader::GetGridHeight() const
+{
+	return pMapping ? ((const FeedHeader *) pMapping)->gridHeight : 0.f;
+}
+///////////////////////////////////////////////////////////////////////////////
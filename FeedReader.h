@@ -0,0 +1,109 @@
+/*
+Copyright (c) 2012 Chris Lentini
+http://divergentcoder.com
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of 
+this software and associated documentation files (the "Software"), to deal in 
+the Software without restriction, including without limitation the rights to use, 
+copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the 
+Software, and to permit persons to whom the Software is furnished to do so, 
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all 
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS 
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR 
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER 
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN 
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+
+#ifndef HH_MPM_FEEDREADER_HH
+#define HH_MPM_FEEDREADER_HH
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <sys/types.h>
+
+// Reads frames from a particle feed published by FeedWriter.  It depends only
+// on FeedFormat.h, so other programs can build it on its own.
+//
+//   FeedReader reader;
+//   FeedFrame frame;
+//   if (reader.Open("/dev/shm/fluid.feed") && reader.Acquire(&frame))
+//   {
+//       ... read frame.x[i] etc. in place ...
+//       if (!reader.Validate(frame))
+//           ... the writer came round again; discard what was read ...
+//   }
+
+// A frame in the shared ring.  The pointers stay valid until the next
+// Acquire() or Close(), but the data only until the writer reuses the slot,
+// which Validate() checks for.
+struct FeedFrame
+{
+	uint32_t			frame;
+	uint32_t			step;
+	int					count;
+	int					fluids;
+	const float *		x;
+	const float *		y;
+	const float *		vx;
+	const float *		vy;
+	const uint16_t *	material;	// index of the particle's fluid
+
+	// The slot's sequence when acquired, for Validate()
+	const volatile uint32_t *	guard;
+	uint32_t			sequence;
+};
+
+class FeedReader
+{
+public:
+	FeedReader();
+	~FeedReader();
+
+	bool	Open(const char * path);
+	void	Close();
+
+	// Points 'out' at the newest complete frame.  Returns false if there 
+	// isn't one yet or the writer kept getting in the way.
+	bool	Acquire(FeedFrame * out);
+
+	// True if the frame's data hasn't changed since Acquire(), so anything
+	// read from it in between is consistent
+	bool	Validate(const FeedFrame & frame) const;
+
+	// Frame number of the newest frame, 0 for none; cheap enough to poll
+	uint32_t GetLatest();
+
+	// True once the writer has closed the feed, as of the last GetLatest() 
+	// or Acquire(); its last frames stay readable.  A writer publishing at
+	// the path again is picked up by the next call.
+	bool	IsRetired() const { return bRetired; }
+
+	bool	IsOpen() const { return pMapping != NULL; }
+	float	GetGridWidth() const;
+	float	GetGridHeight() const;
+
+private:
+	FeedReader(const FeedReader &);
+	FeedReader & operator = (const FeedReader &);
+
+	bool	Map();
+	void	Unmap();
+	bool	Refresh();
+
+	std::string		path;
+	void *			pMapping;
+	size_t			nSize;
+	dev_t			nDevice;	// identity of the mapped file
+	ino_t			nInode;
+	bool			bRetired;
+};
+
+#endif // HH_MPM_FEEDREADER_HH
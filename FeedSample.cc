@@ -0,0 +1,114 @@
+/*
+Copyright (c) 2012 Chris Lentini
+http://divergentcoder.com
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of 
+this software and associated documentation files (the "Software"), to deal in 
+the Software without restriction, including without limitation the rights to use, 
+copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the 
+Software, and to permit persons to whom the Software is furnished to do so, 
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all 
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS 
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR 
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER 
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN 
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+
+// Sample consumer of the particle feed.  Follows the feed a simulation is 
+// publishing and prints a line of statistics per frame read:
+//
+//   fluidfeed [feed path] [seconds]
+//
+// Frames are read in place; the reader never copies or blocks the writer,
+// and frames it falls behind on are counted as skipped.  It stops when the
+// writer closes the feed.
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "FeedReader.h"
+
+#define DEFAULT_PATH	"/dev/shm/fluid.feed"
+#define POLL_US			10000
+#define MAX_FLUIDS		16
+
+///////////////////////////////////////////////////////////////////////////////
+int main(int argc, char ** argv)
+{
+	const char * path = argc > 1 ? argv[1] : DEFAULT_PATH;
+	double seconds = argc > 2 ? atof(argv[2]) : 0.0;
+
+	FeedReader reader;
+	if (!reader.Open(path))
+	{
+		fprintf(stderr, "fluidfeed: can't open feed '%s'\n", path);
+		return 1;
+	}
+
+	uint32_t last = 0;
+	int frames = 0, skipped = 0, torn = 0;
+	long polls = seconds > 0.0 ? (long)(seconds * 1e6 / POLL_US) : -1;
+	for (long poll=0; polls < 0 || poll < polls; poll++)
+	{
+		if (reader.GetLatest() == last)
+		{
+			if (reader.IsRetired())
+			{
+				printf("feed closed\n");
+				break;
+			}
+			usleep(POLL_US);
+			continue;
+		}
+
+		FeedFrame frame;
+		if (!reader.Acquire(&frame))
+			continue;
+
+		// Reduce in place, then check the writer didn't reuse the slot
+		int counts[MAX_FLUIDS] = { 0 };
+		double speed[MAX_FLUIDS] = { 0.0 };
+		float maxspeed = 0.f;
+		for (int i=0; i<frame.count; i++)
+		{
+			int m = frame.material[i] < MAX_FLUIDS ? frame.material[i] : MAX_FLUIDS - 1;
+			float s = sqrtf(frame.vx[i] * frame.vx[i] + frame.vy[i] * frame.vy[i]);
+			counts[m]++;
+			speed[m] += s;
+			maxspeed = s > maxspeed ? s : maxspeed;
+		}
+
+		if (!reader.Validate(frame))
+		{
+			torn++;
+			continue;
+		}
+
+		if (last != 0 && frame.frame > last + 1)
+			skipped += frame.frame - last - 1;
+		last = frame.frame;
+		frames++;
+
+		printf("frame %u step %u particles %d max speed %.3f", frame.frame, 
+			frame.step, frame.count, maxspeed);
+		for (int f=0; f<frame.fluids && f<MAX_FLUIDS; f++)
+		{
+			printf(" | fluid %d: %d, mean speed %.3f", f, counts[f], 
+				counts[f] ? speed[f] / counts[f] : 0.0);
+		}
+		printf("\n");
+		fflush(stdout);
+	}
+
+	printf("read %d frames, skipped %d, discarded %d\n", frames, skipped, torn);
+	return 0;
+}
+///////////////////////////////////////////////////////////////////////////////
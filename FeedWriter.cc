@@ -0,0 +1,215 @@
+/*
+Copyright (c) 2012 Chris Lentini
+http://divergentcoder.com
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of 
+this software and associated documentation files (the "Software"), to deal in 
+the Software without restriction, including without limitation the rights to use, 
+copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the 
+Software, and to permit persons to whom the Software is furnished to do so, 
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all 
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS 
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR 
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER 
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN 
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+
+#include <algorithm>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "Fluid.h"
+#include "FeedFormat.h"
+#include "FeedWriter.h"
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// ------------------------------- FeedWriter --------------------------------- 
+//
+///////////////////////////////////////////////////////////////////////////////
+FeedWriter::FeedWriter()
+:	pMapping(NULL),
+	nSize(0),
+	nSlots(0),
+	nCapacity(0),
+	nFrame(0)
+{}
+///////////////////////////////////////////////////////////////////////////////
+FeedWriter::~FeedWriter()
+{
+	Close();
+}
+///////////////////////////////////////////////////////////////////////////////
+bool FeedWriter::Open(const char * feedpath, int slots, int capacity)
+{
+	Close();
+	if (!feedpath || slots < 2)
+		return false;
+
+	// Nothing is mapped until there's a frame to size the ring from, but
+	// the path is checked now
+	path = feedpath;
+	nSlots = slots;
+	nCapacity = capacity;
+	std::string temp = path + ".tmp";
+	int fd = open(temp.c_str(), O_RDWR | O_CREAT, 0644);
+	if (fd < 0)
+	{
+		Close();
+		return false;
+	}
+	close(fd);
+	unlink(temp.c_str());
+	return true;
+}
+///////////////////////////////////////////////////////////////////////////////
+void FeedWriter::Close()
+{
+	// The file stays so late readers see the last frames; it is retired so
+	// they know no more are coming
+	Unmap();
+	path.clear();
+	nSlots = 0;
+	nCapacity = 0;
+}
+///////////////////////////////////////////////////////////////////////////////
+void FeedWriter::Unmap()
+{
+	if (!pMapping)
+		return;
+
+	FeedHeader * header = (FeedHeader *) pMapping;
+	__sync_synchronize();
+	header->retired = 1;
+	munmap(pMapping, nSize);
+	pMapping = NULL;
+	nSize = 0;
+}
+///////////////////////////////////////////////////////////////////////////////
+bool FeedWriter::Create(const FluidSim * sim, int capacity)
+{
+	uint32_t slotbytes = FeedSlotBytes(capacity);
+	uint32_t offset = FeedAlign(sizeof(FeedHeader));
+	size_t size = offset + (size_t) slotbytes * nSlots;
+
+	// Built aside and renamed into place, so a reader opening the path sees
+	// either the old ring or the complete new one
+	std::string temp = path + ".tmp";
+	int fd = open(temp.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return false;
+
+	if (ftruncate(fd, size) != 0)
+	{
+		close(fd);
+		unlink(temp.c_str());
+		return false;
+	}
+
+	void * mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mapping == MAP_FAILED)
+	{
+		unlink(temp.c_str());
+		return false;
+	}
+
+	// The file starts zeroed: no frames, every slot sequence even
+	FeedHeader * header = (FeedHeader *) mapping;
+	header->magic = FEED_MAGIC;
+	header->version = FEED_VERSION;
+	header->slots = nSlots;
+	header->capacity = capacity;
+	header->slotBytes = slotbytes;
+	header->dataOffset = offset;
+	header->gridWidth = (float) sim->GWidth;
+	header->gridHeight = (float) sim->GHeight;
+
+	if (rename(temp.c_str(), path.c_str()) != 0)
+	{
+		munmap(mapping, size);
+		unlink(temp.c_str());
+		return false;
+	}
+
+	Unmap();
+	pMapping = mapping;
+	nSize = size;
+	nCapacity = capacity;
+	return true;
+}
+///////////////////////////////////////////////////////////////////////////////
+bool FeedWriter::Publish(const FluidSim * sim)
+{
+	if (!IsOpen())
+		return false;
+
+	// A new ring for a new grid, or one grown by half again so a steadily 
+	// filling scene rarely moves it
+	int count = sim->ParticleCount();
+	FeedHeader * header = (FeedHeader *) pMapping;
+	if (!header || count > nCapacity || 
+		header->gridWidth != (float) sim->GWidth || 
+		header->gridHeight != (float) sim->GHeight)
+	{
+		int capacity = std::max(nCapacity, 1024);
+		if (count > capacity)
+			capacity = count + count / 2;
+		if (!Create(sim, capacity))
+			return false;
+		header = (FeedHeader *) pMapping;
+	}
+
+	// Frame 0 means none yet, so it's skipped when the counter wraps
+	if (++nFrame == 0)
+		nFrame++;
+	uint32_t frame = nFrame;
+	char * base = (char *) pMapping + header->dataOffset + 
+		(size_t) header->slotBytes * (frame % nSlots);
+	FeedSlot * slot = (FeedSlot *) base;
+
+	uint32_t sequence = slot->sequence;
+	slot->sequence = sequence + 1;
+	__sync_synchronize();
+
+	slot->frame = frame;
+	slot->step = sim->Step;
+	slot->count = count;
+	slot->fluids = sim->Fluids.size();
+
+	float * x = (float *)(base + FeedArrayOffset(nCapacity, FEED_X));
+	float * y = (float *)(base + FeedArrayOffset(nCapacity, FEED_Y));
+	float * vx = (float *)(base + FeedArrayOffset(nCapacity, FEED_VX));
+	float * vy = (float *)(base + FeedArrayOffset(nCapacity, FEED_VY));
+	uint16_t * material = (uint16_t *)(base + FeedArrayOffset(nCapacity, FEED_MATERIAL));
+
+	int n = 0;
+	for (int f=0, flim=sim->Fluids.size(); f<flim; f++)
+	{
+		const std::vector<Particle> & particles = sim->Fluids[f]->Particles;
+		for (int i=0, lim=particles.size(); i<lim; i++, n++)
+		{
+			x[n] = particles[i].x;
+			y[n] = particles[i].y;
+			vx[n] = particles[i].vx;
+			vy[n] = particles[i].vy;
+			material[n] = (uint16_t) f;
+		}
+	}
+
+	__sync_synchronize();
+	slot->sequence = sequence + 2;
+	__sync_synchronize();
+	header->latest = frame;
+	return true;
+}
+///////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,70 @@
+/*
+Copyright (c) 2012 Chris Lentini
+http://divergentcoder.com
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of 
+this software and associated documentation files (the "Software"), to deal in 
+the Software without restriction, including without limitation the rights to use, 
+copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the 
+Software, and to permit persons to whom the Software is furnished to do so, 
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all 
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS 
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR 
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER 
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN 
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+
+#ifndef HH_MPM_FEEDWRITER_HH
+#define HH_MPM_FEEDWRITER_HH
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+class FluidSim;
+
+// Publishes every step's particles into a shared memory ring (see 
+// FeedFormat.h) for other processes to read in place.  The ring lives in a 
+// file, normally on tmpfs such as /dev/shm.  When the particles outgrow it 
+// a larger ring replaces the file and the old one is marked retired, which 
+// readers take as their cue to map the path again.
+class FeedWriter
+{
+public:
+	FeedWriter();
+	~FeedWriter();
+
+	// The ring is made by the first Publish(), holding at least 'capacity'
+	// particles per frame; a new grid size also makes a new ring
+	bool	Open(const char * path, int slots = 8, int capacity = 0);
+	void	Close();
+
+	// Never blocks on readers
+	bool	Publish(const FluidSim * sim);
+
+	bool	IsOpen() const { return !path.empty(); }
+	int		GetCapacity() const { return nCapacity; }
+
+private:
+	FeedWriter(const FeedWriter &);
+	FeedWriter & operator = (const FeedWriter &);
+
+	bool	Create(const FluidSim * sim, int capacity);
+	void	Unmap();
+
+	std::string		path;
+	void *			pMapping;
+	size_t			nSize;
+	int				nSlots;
+	int				nCapacity;
+	uint32_t		nFrame;		// last published, carried across rings
+};
+
+#endif // HH_MPM_FEEDWRITER_HH
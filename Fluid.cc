@@ -28,8 +28,37 @@ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include <string.h>
 #include "Util.h"
 #include "DistanceField.h"
+#include "Obstacle.h"
 #include "Fluid.h"
+#include "Profiler.h"
+#include "ThreadPool.h"
+#include "Brush.h"
+
+// Per-particle work is split into fixed chunks whatever the thread count, and
+// each chunk writes only its own particles.  Scatters into the shared grids
+// then run in particle order on the calling thread, so every float is summed
+// in the same order with or without threads.  Chunks are kept to multiples 
+// of four so the vectorized kernels split the same way whatever their size.
+#define PARTICLE_CHUNK	1024
+#define CELL_CHUNK		4096
+
+// Nodes carrying less than this fraction of the rest density are left out of
+// the pressure solve as free surface
+#define PRESSURE_FLUID_MASS	0.5f
+
+// Particles are pushed back from within a cell of the boundary and so leave
+// those nodes nearly empty; the solve counts them as walls, not free surface
+#define PRESSURE_WALL_DISTANCE	1.f
 
+///////////////////////////////////////////////////////////////////////////////
+// Pressure difference across a node from its neighbours before and after
+static inline float PressureGradient(float before, float at, float after, 
+	bool solidbefore, bool solidafter)
+{
+	if (solidbefore)
+		return solidafter ? 0.f : after - at;
+	return solidafter ? at - before : 0.5f * (after - before);
+}
 ///////////////////////////////////////////////////////////////////////////////
 //
 // ---------------------------------- Fluid ----------------------------------- 
@@ -41,18 +70,11 @@ Fluid::Fluid(int gwidth, int gheight)
 	Stiffness(0.5f),
 	Viscosity(0.f)
 {
-	Grid = new GridCell*[gheight];
-	Grid[0] = new GridCell[gheight * gwidth];
-	for (int i=1; i<gheight; i++)
-		Grid[i] = Grid[i-1] + gwidth;
+	Grid.Create(gwidth, gheight, GRID_ROW_MAJOR, GRID_MASS_VELOCITY);
 }
 ///////////////////////////////////////////////////////////////////////////////
 Fluid::~Fluid()
-{
-	delete [] Grid[0];
-	delete [] Grid;
-	Grid = NULL;
-}
+{}
 ///////////////////////////////////////////////////////////////////////////////
 void Fluid::AddParticle(float x, float y, float vx, float vy)
 {
@@ -65,6 +87,14 @@ void Fluid::AddParticle(float x, float y, float vx, float vy)
 	Weights.push_back(CellWeight());
 }
 ///////////////////////////////////////////////////////////////////////////////
+void Fluid::CountMemory(MemoryStats & stats) const
+{
+	Grid.CountMemory(stats, MEMORY_FLUID_GRIDS);
+	stats.Add(MEMORY_PARTICLES, Particles);
+	stats.Add(MEMORY_WEIGHTS, Weights);
+	stats.Add(MEMORY_OBJECTS, sizeof(Fluid), sizeof(Fluid));
+}
+///////////////////////////////////////////////////////////////////////////////
 
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -72,78 +102,79 @@ void Fluid::AddParticle(float x, float y, float vx, float vy)
 // --------------------------------- FluidSim --------------------------------- 
 //
 ///////////////////////////////////////////////////////////////////////////////
-FluidSim::FluidSim(int width, int height, float scale)
+FluidSim::FluidSim(int width, int height, float scale, GridLayout layout,
+	bool batching)
 {
 	Scale = scale;
 	GWidth = (width / scale) + 1;
 	GHeight = (height / scale) + 1;
-
-	Grid = new GridCell*[GHeight];
-	Grid[0] = new GridCell[GWidth * GHeight];
-	for (int i=1; i<GHeight; i++)
-		Grid[i] = Grid[i - 1] + GWidth;
+	Grid.Create(GWidth, GHeight, layout, GRID_ALL_FIELDS);
 
 	GridCoeff = 1.f;
 	GravityX = 0.f;
 	GravityY = (9.81f / scale) * (1.f / 900.f);
+	Threads = NULL;
+	ParticleChunk = PARTICLE_CHUNK;
+	CellChunk = CELL_CHUNK;
+	Step = 0;
+	Seed = 0;
+	nJitterKey = 0;
+	nIndexCount = -1;
+	nIndexStep = 0;
+	Incompressible = false;
+	PressureIterations = 30;
+	PressureTolerance = 0.01f;
+	VolumeCorrection = 0.3f;
+	nSolidVersion = 0;
+	fRestDensity = 1.f;
+
+	// 256 texels across, with as many rows as keeps the texels square
+	int yres = std::max(1, (int)(256.f * GHeight / GWidth + 0.5f));
+	SDF.Create(256, yres, GWidth, GHeight);
 
-	SDF.Create(256, GWidth, GHeight);
+	SDF.BeginBatch();
 	SDF.SubRect(2.f, 2.f, GWidth-4.f, GHeight-4.f);
 	SDF.Blur();
+	if (!batching)
+		SDF.EndBatch();
 }
 ///////////////////////////////////////////////////////////////////////////////
 FluidSim::~FluidSim()
 {
-	delete [] Grid[0];
-	delete [] Grid;
-	Grid = NULL;
-
 	for (unsigned i=0; i<Fluids.size(); i++)
 		delete Fluids[i];
 	Fluids.clear();
+
+	for (unsigned i=0; i<Obstacles.size(); i++)
+		delete Obstacles[i];
+	Obstacles.clear();
 }
 ///////////////////////////////////////////////////////////////////////////////
 void FluidSim::Update()
 {
-	// Clear all grid cells
-	memset(Grid[0], 0, sizeof(GridCell) * GWidth * GHeight);
-	for (int i=0, lim=Fluids.size(); i<lim; i++)
-		memset(Fluids[i]->Grid[0], 0, sizeof(GridCell) * GWidth * GHeight);
+	PROFILE_SCOPE("Update");
+	if (SDF.IsBatching())
+		SDF.EndBatch();
+
+	for (int i=0, lim=Obstacles.size(); i<lim; i++)
+		Obstacles[i]->Advance();
+
+	ClearGrid();
 
 	// Fill out grid initial grid information
 	for (int i=0, lim=Fluids.size(); i<lim; i++)
 		InitGrid(Fluids[i]);
 
-	// Average grid velocity
-	for (int y=0, ylim=GHeight; y<ylim; y++)
-	{
-		for (int x=0, xlim=GWidth; x<xlim; x++)
-		{
-			float m = Grid[y][x].m;
-			if (m == 0.f)
-				continue;
-			Grid[y][x].vx /= m;
-			Grid[y][x].vy /= m;
-		}
-	}
+	AverageVelocity();
 	
 	// Compute particle acceleration and propagate to grid
 	for (int i=0, lim=Fluids.size(); i<lim; i++)
 		CalcAccel(Fluids[i]);
 
-	// Average grid acceleration
-	for (int y=0, ylim=GHeight; y<ylim; y++)
-	{
-		for (int x=0, xlim=GWidth; x<xlim; x++)
-		{
-			GridCell & cell = Grid[y][x];
-			float m = cell.m;
-			if (m == 0.f)
-				continue;
-			cell.ax /= m;
-			cell.ay /= m;
-		}
-	}
+	AverageAcceleration();
+
+	// Take out what the grid velocities would diverge, if asked to
+	Project();
 	
 	// Update fluid velocity fields
 	// Update particle positions
@@ -152,13 +183,608 @@ void FluidSim::Update()
 		CalcVelocity(Fluids[i]);
 		UpdateParticles(Fluids[i]);
 	}
+
+	Step++;
+	BuildIndex();
+	UpdateMemory();
+}
+///////////////////////////////////////////////////////////////////////////////
+void FluidSim::ClearGrid()
+{
+	PROFILE_SCOPE("ClearGrid");
+	Grid.Clear();
+	for (int i=0, lim=Fluids.size(); i<lim; i++)
+	{
+		// Fluids are created on their own; give them the simulation's layout.
+		// Their grids only ever carry mass and velocity.
+		CellGrid & grid = Fluids[i]->Grid;
+		if (grid.GetLayout() != Grid.GetLayout() || 
+			grid.GetWidth() != GWidth || grid.GetHeight() != GHeight ||
+			grid.GetFields() != GRID_MASS_VELOCITY)
+		{
+			grid.Create(GWidth, GHeight, Grid.GetLayout(), GRID_MASS_VELOCITY);
+		}
+		else
+		{
+			grid.Clear();
+		}
+	}
+}
+///////////////////////////////////////////////////////////////////////////////
+void FluidSim::AverageVelocity()
+{
+	PROFILE_SCOPE("AverageVelocity");
+	ParallelFor(&FluidSim::AverageVelocityCells, NULL, Grid.GetCellCount(), 
+		CellChunk);
+}
+///////////////////////////////////////////////////////////////////////////////
+void FluidSim::AverageAcceleration()
+{
+	PROFILE_SCOPE("AverageAcceleration");
+	ParallelFor(&FluidSim::AverageAccelerationCells, NULL, 
+		Grid.GetCellCount(), CellChunk);
+}
+///////////////////////////////////////////////////////////////////////////////
+void FluidSim::Project()
+{
+	if (!Incompressible)
+		return;
+
+	PROFILE_SCOPE("Project");
+	UpdateSolidNodes();
+
+	// Fluids settle at their own densities; weighting each by its particles
+	// gives the density the grid as a whole should settle at
+	float mass = 0.f, rest = 0.f;
+	for (int i=0, lim=Fluids.size(); i<lim; i++)
+	{
+		float count = (float) Fluids[i]->Particles.size();
+		mass += count;
+		rest += count * Fluids[i]->Density;
+	}
+	fRestDensity = std::max(1.f, mass > 0.f ? rest / mass : 1.f);
+
+	Pressure.Create(GWidth, GHeight);
+	int rows = std::max(4, CellChunk / GWidth);
+	bool tiled = Grid.GetLayout() == GRID_TILED;
+	ParallelFor(tiled ? &FluidSim::BuildPressure<TiledAccess> : 
+		&FluidSim::BuildPressure<RowMajorAccess>, NULL, GHeight, rows);
+
+	Pressure.Solve(Threads, CellChunk, PressureIterations, PressureTolerance);
+
+	ParallelFor(tiled ? &FluidSim::ApplyPressure<TiledAccess> : 
+		&FluidSim::ApplyPressure<RowMajorAccess>, NULL, GHeight, rows);
 }
 ///////////////////////////////////////////////////////////////////////////////
 void FluidSim::InitGrid(Fluid * fluid)
 {
+	PROFILE_SCOPE("InitGrid");
+	ParallelFor(&FluidSim::CalcWeights, fluid, fluid->Particles.size(), 
+		ParticleChunk);
+
+	if (Grid.GetLayout() == GRID_TILED)
+		ScatterMass<TiledAccess>(fluid);
+	else
+		ScatterMass<RowMajorAccess>(fluid);
+}
+///////////////////////////////////////////////////////////////////////////////
+void FluidSim::CalcAccel(Fluid * fluid)
+{
+	PROFILE_SCOPE("CalcAccel");
+	int count = fluid->Particles.size();
+	QueryX.resize(count);
+	QueryY.resize(count);
+	for (int i=0; i<count; i++)
+	{
+		QueryX[i] = fluid->Particles[i].x;
+		QueryY[i] = fluid->Particles[i].y;
+	}
+	ResolveBoundary(count, 3.f);
+
+	Forces.resize(count);
+	if (Grid.GetLayout() == GRID_TILED)
+	{
+		ParallelFor(&FluidSim::CalcForces<TiledAccess>, fluid, count, 
+			ParticleChunk);
+		ScatterForces<TiledAccess>(fluid);
+	}
+	else
+	{
+		ParallelFor(&FluidSim::CalcForces<RowMajorAccess>, fluid, count, 
+			ParticleChunk);
+		ScatterForces<RowMajorAccess>(fluid);
+	}
+}
+///////////////////////////////////////////////////////////////////////////////
+void FluidSim::CalcVelocity(Fluid * fluid)
+{	
+	PROFILE_SCOPE("CalcVelocity");
+	int count = fluid->Particles.size();
+	QueryX.resize(count);
+	QueryY.resize(count);
+
+	bool tiled = Grid.GetLayout() == GRID_TILED;
+	ParallelFor(tiled ? &FluidSim::AddGridAccel<TiledAccess> : 
+		&FluidSim::AddGridAccel<RowMajorAccess>, fluid, count, ParticleChunk);
+
+	// Check new positions against the distance field in one pass
+	ResolveBoundary(count, 1.f);
+
+	int index = std::find(Fluids.begin(), Fluids.end(), fluid) - Fluids.begin();
+	nJitterKey = GetRandomKey(index);
+	ParallelFor(&FluidSim::PushFromBoundary, fluid, count, ParticleChunk);
+
+	if (tiled)
+		ScatterVelocity<TiledAccess>(fluid);
+	else
+		ScatterVelocity<RowMajorAccess>(fluid);
+
+	// Average out the fluid velocity grid
+	ParallelFor(&FluidSim::AverageVelocityCells, fluid, 
+		fluid->Grid.GetCellCount(), CellChunk);
+}
+///////////////////////////////////////////////////////////////////////////////
+void FluidSim::UpdateParticles(Fluid * fluid)
+{
+	PROFILE_SCOPE("UpdateParticles");
+	int count = fluid->Particles.size();
+	QueryX.resize(count);
+	QueryY.resize(count);
+
+	ParallelFor(Grid.GetLayout() == GRID_TILED ? 
+		&FluidSim::MoveParticles<TiledAccess> : 
+		&FluidSim::MoveParticles<RowMajorAccess>, fluid, count, ParticleChunk);
+	ResolveBoundary(count, 0.f);
+	ParallelFor(&FluidSim::ClampParticles, fluid, count, ParticleChunk);
+}
+///////////////////////////////////////////////////////////////////////////////
+void FluidSim::BuildIndex()
+{
+	PROFILE_SCOPE("BuildIndex");
+	int cells = GWidth * GHeight;
+	int count = ParticleCount();
+	IndexStart.assign(cells + 1, 0);
+	IndexCell.resize(count);
+	IndexEntries.resize(count);
+
+	// Counting sort by cell, keeping particle order within each cell
+	for (int f=0, n=0, flim=Fluids.size(); f<flim; f++)
+	{
+		const std::vector<Particle> & particles = Fluids[f]->Particles;
+		for (int i=0, lim=particles.size(); i<lim; i++, n++)
+		{
+			int cx = std::min(GWidth-1, std::max(0, (int) particles[i].x));
+			int cy = std::min(GHeight-1, std::max(0, (int) particles[i].y));
+			int c = cy * GWidth + cx;
+			IndexCell[n] = c;
+			IndexStart[c + 1]++;
+		}
+	}
+
+	for (int c=0; c<cells; c++)
+		IndexStart[c + 1] += IndexStart[c];
+
+	// IndexStart[c] is used as the insertion point for cell c and ends up 
+	// at the start of cell c + 1, so shift it back afterwards
+	for (int f=0, n=0, flim=Fluids.size(); f<flim; f++)
+	{
+		for (int i=0, lim=Fluids[f]->Particles.size(); i<lim; i++, n++)
+		{
+			ParticleRef & ref = IndexEntries[IndexStart[IndexCell[n]]++];
+			ref.fluid = f;
+			ref.index = i;
+		}
+	}
+
+	for (int c=cells; c>0; c--)
+		IndexStart[c] = IndexStart[c - 1];
+	IndexStart[0] = 0;
+
+	nIndexCount = count;
+	nIndexStep = Step;
+}
+///////////////////////////////////////////////////////////////////////////////
+void FluidSim::UpdateIndex()
+{
+	if (nIndexCount != ParticleCount() || nIndexStep != Step)
+		BuildIndex();
+}
+///////////////////////////////////////////////////////////////////////////////
+void FluidSim::GetCellRange(float x0, float y0, float x1, float y1, int * cx0,
+	int * cy0, int * cx1, int * cy1) const
+{
+	*cx0 = std::max(0, (int) floorf(x0));
+	*cy0 = std::max(0, (int) floorf(y0));
+	*cx1 = std::min(GWidth - 1, (int) floorf(x1));
+	*cy1 = std::min(GHeight - 1, (int) floorf(y1));
+}
+///////////////////////////////////////////////////////////////////////////////
+void FluidSim::ApplyBrush(const Brush & brush, unsigned stream)
+{
+	PROFILE_SCOPE("ApplyBrush");
+	UpdateIndex();
+
+	std::vector<uint64_t> keys(Fluids.size());
+	for (int f=0, flim=Fluids.size(); f<flim; f++)
+		keys[f] = GetRandomKey(stream + f);
+
+	float x0, y0, x1, y1;
+	brush.GetBounds(&x0, &y0, &x1, &y1);
+
+	int cx0, cy0, cx1, cy1;
+	GetCellRange(x0, y0, x1, y1, &cx0, &cy0, &cx1, &cy1);
+	for (int cy=cy0; cy<=cy1; cy++)
+	{
+		for (int c=cy*GWidth + cx0, clim=cy*GWidth + cx1; c<=clim; c++)
+		{
+			for (int e=IndexStart[c], elim=IndexStart[c + 1]; e<elim; e++)
+			{
+				const ParticleRef & ref = IndexEntries[e];
+				brush.Apply(Fluids[ref.fluid]->Particles[ref.index], 
+					keys[ref.fluid], 2 * ref.index);
+			}
+		}
+	}
+}
+///////////////////////////////////////////////////////////////////////////////
+void FluidSim::QueryRect(float x0, float y0, float x1, float y1, 
+	std::vector<ParticleRef> & out, int fluid)
+{
+	UpdateIndex();
+
+	int cx0, cy0, cx1, cy1;
+	GetCellRange(x0, y0, x1, y1, &cx0, &cy0, &cx1, &cy1);
+	for (int cy=cy0; cy<=cy1; cy++)
+	{
+		for (int c=cy*GWidth + cx0, clim=cy*GWidth + cx1; c<=clim; c++)
+		{
+			for (int e=IndexStart[c], elim=IndexStart[c + 1]; e<elim; e++)
+			{
+				const ParticleRef & ref = IndexEntries[e];
+				if (fluid >= 0 && ref.fluid != fluid)
+					continue;
+
+				const Particle & p = Fluids[ref.fluid]->Particles[ref.index];
+				if (p.x >= x0 && p.x <= x1 && p.y >= y0 && p.y <= y1)
+					out.push_back(ref);
+			}
+		}
+	}
+}
+///////////////////////////////////////////////////////////////////////////////
+void FluidSim::QueryRadius(float x, float y, float radius, 
+	std::vector<ParticleRef> & out, int fluid)
+{
+	UpdateIndex();
+
+	int cx0, cy0, cx1, cy1;
+	GetCellRange(x - radius, y - radius, x + radius, y + radius, 
+		&cx0, &cy0, &cx1, &cy1);
+	float r2 = radius * radius;
+	for (int cy=cy0; cy<=cy1; cy++)
+	{
+		for (int c=cy*GWidth + cx0, clim=cy*GWidth + cx1; c<=clim; c++)
+		{
+			for (int e=IndexStart[c], elim=IndexStart[c + 1]; e<elim; e++)
+			{
+				const ParticleRef & ref = IndexEntries[e];
+				if (fluid >= 0 && ref.fluid != fluid)
+					continue;
+
+				const Particle & p = Fluids[ref.fluid]->Particles[ref.index];
+				float dx = p.x - x;
+				float dy = p.y - y;
+				if (dx*dx + dy*dy <= r2)
+					out.push_back(ref);
+			}
+		}
+	}
+}
+///////////////////////////////////////////////////////////////////////////////
+struct NearestEntry
+{
+	float		d2;
+	ParticleRef	ref;
+
+	bool operator < (const NearestEntry & other) const
+	{
+		return d2 < other.d2;
+	}
+};
+///////////////////////////////////////////////////////////////////////////////
+void FluidSim::QueryNearest(float x, float y, int k, 
+	std::vector<ParticleRef> & out, int fluid)
+{
+	out.clear();
+	if (k <= 0)
+		return;
+	UpdateIndex();
+
+	// Walk out from the cell holding (x, y) one square ring at a time, 
+	// keeping the best k in a max-heap, until no cell of the next ring can 
+	// hold anything closer than the worst of them
+	int cx = std::min(GWidth-1, std::max(0, (int) floorf(x)));
+	int cy = std::min(GHeight-1, std::max(0, (int) floorf(y)));
+	float margin = std::max(0.f, std::min(std::min(x - cx, cx + 1 - x), 
+		std::min(y - cy, cy + 1 - y)));
+	int rings = std::max(std::max(cx, GWidth - 1 - cx), 
+		std::max(cy, GHeight - 1 - cy));
+
+	std::vector<NearestEntry> heap;
+	heap.reserve(k + 1);
+	for (int r=0; r<=rings; r++)
+	{
+		if ((int) heap.size() == k)
+		{
+			float bound = r - 1 + margin;
+			if (bound > 0.f && bound * bound >= heap.front().d2)
+				break;
+		}
+
+		int y0 = std::max(0, cy - r), y1 = std::min(GHeight - 1, cy + r);
+		int x0 = std::max(0, cx - r), x1 = std::min(GWidth - 1, cx + r);
+		for (int gy=y0; gy<=y1; gy++)
+		{
+			// Only the outline of the square is new
+			bool edge = gy == cy - r || gy == cy + r;
+			int step = edge ? 1 : 2 * r;
+			for (int gx=cx - r; gx<=cx + r; gx+=step)
+			{
+				if (gx < x0 || gx > x1)
+					continue;
+
+				int c = gy * GWidth + gx;
+				for (int e=IndexStart[c], elim=IndexStart[c + 1]; e<elim; e++)
+				{
+					const ParticleRef & ref = IndexEntries[e];
+					if (fluid >= 0 && ref.fluid != fluid)
+						continue;
+
+					const Particle & p = Fluids[ref.fluid]->Particles[ref.index];
+					NearestEntry entry;
+					entry.d2 = (p.x - x) * (p.x - x) + (p.y - y) * (p.y - y);
+					entry.ref = ref;
+					if ((int) heap.size() < k)
+					{
+						heap.push_back(entry);
+						std::push_heap(heap.begin(), heap.end());
+					}
+					else if (entry.d2 < heap.front().d2)
+					{
+						std::pop_heap(heap.begin(), heap.end());
+						heap.back() = entry;
+						std::push_heap(heap.begin(), heap.end());
+					}
+				}
+			}
+		}
+	}
+
+	std::sort_heap(heap.begin(), heap.end());
+	out.resize(heap.size());
+	for (int i=0, lim=heap.size(); i<lim; i++)
+		out[i] = heap[i].ref;
+}
+///////////////////////////////////////////////////////////////////////////////
+void FluidSim::GetRegionMass(float x0, float y0, float x1, float y1, 
+	float * mass, float * vx, float * vy, int fluid) const
+{
+	// Grid nodes sit on integer coordinates
+	int nx0 = std::max(0, (int) ceilf(x0));
+	int ny0 = std::max(0, (int) ceilf(y0));
+	int nx1 = std::min(GWidth - 1, (int) floorf(x1));
+	int ny1 = std::min(GHeight - 1, (int) floorf(y1));
+
+	// The shared grid holds every fluid together; each fluid's own grid 
+	// holds its velocities after the grid forces
+	const CellGrid & grid = (fluid >= 0 && fluid < (int) Fluids.size()) ? 
+		Fluids[fluid]->Grid : Grid;
+
+	float m = 0.f, mvx = 0.f, mvy = 0.f;
+	for (int y=ny0; y<=ny1; y++)
+	{
+		for (int x=nx0; x<=nx1; x++)
+		{
+			int o = grid.Index(x, y);
+			m += grid.M[o];
+			mvx += grid.M[o] * grid.VX[o];
+			mvy += grid.M[o] * grid.VY[o];
+		}
+	}
+
+	*mass = m;
+	*vx = m > 0.f ? mvx / m : 0.f;
+	*vy = m > 0.f ? mvy / m : 0.f;
+}
+///////////////////////////////////////////////////////////////////////////////
+uint64_t FluidSim::GetRandomKey(unsigned stream) const
+{
+	return RandomKey(Seed, Step, stream);
+}
+///////////////////////////////////////////////////////////////////////////////
+const MemoryStats & FluidSim::GetMemoryStats()
+{
+	UpdateMemory();
+	return memory;
+}
+///////////////////////////////////////////////////////////////////////////////
+void FluidSim::UpdateMemory()
+{
+	memory.Clear();
+	memory.Add(MEMORY_OBJECTS, sizeof(FluidSim), sizeof(FluidSim));
+	memory.Add(MEMORY_OBJECTS, Fluids);
+	memory.Add(MEMORY_OBJECTS, Obstacles);
+	Grid.CountMemory(memory, MEMORY_GRID);
+	SDF.CountMemory(memory, MEMORY_DISTANCE_FIELD);
+
+	for (int i=0, lim=Fluids.size(); i<lim; i++)
+		Fluids[i]->CountMemory(memory);
+
+	size_t obstaclepeak = 0;
+	for (int i=0, lim=Obstacles.size(); i<lim; i++)
+	{
+		Obstacles[i]->Field.CountMemory(memory, MEMORY_OBSTACLES);
+		memory.Add(MEMORY_OBJECTS, sizeof(Obstacle), sizeof(Obstacle));
+		obstaclepeak += Obstacles[i]->Field.GetPeakBytes();
+	}
+
+	memory.Add(MEMORY_SCRATCH, QueryX);
+	memory.Add(MEMORY_SCRATCH, QueryY);
+	memory.Add(MEMORY_SCRATCH, QueryD);
+	memory.Add(MEMORY_SCRATCH, QueryGX);
+	memory.Add(MEMORY_SCRATCH, QueryGY);
+	memory.Add(MEMORY_SCRATCH, QueryOwner);
+	memory.Add(MEMORY_SCRATCH, NearX);
+	memory.Add(MEMORY_SCRATCH, NearY);
+	memory.Add(MEMORY_SCRATCH, NearGX);
+	memory.Add(MEMORY_SCRATCH, NearGY);
+	memory.Add(MEMORY_SCRATCH, NearIndex);
+	memory.Add(MEMORY_SCRATCH, Forces);
+
+	memory.Add(MEMORY_INDEX, IndexStart);
+	memory.Add(MEMORY_INDEX, IndexEntries);
+	memory.Add(MEMORY_INDEX, IndexCell);
+
+	Pressure.CountMemory(memory, MEMORY_PRESSURE);
+	memory.Add(MEMORY_PRESSURE, SolidNodes);
+
+	// Vectors only grow, so sampling catches their peaks; the fields free 
+	// their build buffers between samples and so report their own
+	size_t transient[MEMORY_TAG_COUNT] = { 0 };
+	transient[MEMORY_DISTANCE_FIELD] = SDF.GetPeakBytes();
+	transient[MEMORY_OBSTACLES] = obstaclepeak;
+	memory.UpdatePeaks(transient);
+}
+///////////////////////////////////////////////////////////////////////////////
+void FluidSim::ParallelFor(RangeFn fn, Fluid * fluid, int count, int chunk)
+{
+	RangeTask task;
+	task.sim = this;
+	task.fn = fn;
+	task.fluid = fluid;
+	task.count = count;
+	task.chunk = std::max(4, chunk & ~3);
+
+	int chunks = (count + task.chunk - 1) / task.chunk;
+	if (Threads && chunks > 1)
+	{
+		Threads->Run(&RunRange, &task, chunks);
+	}
+	else
+	{
+		for (int i=0; i<chunks; i++)
+			RunRange(&task, i);
+	}
+}
+///////////////////////////////////////////////////////////////////////////////
+void FluidSim::RunRange(void * data, int index)
+{
+	const RangeTask * task = (const RangeTask *) data;
+	int begin = index * task->chunk;
+	int end = std::min(task->count, begin + task->chunk);
+	(task->sim->*task->fn)(task->fluid, begin, end);
+}
+///////////////////////////////////////////////////////////////////////////////
+template <class Access>
+void FluidSim::ScatterMass(Fluid * fluid)
+{
+	Access grid(Grid);
+	float * m = Grid.M;
+	float * gvx = Grid.VX;
+	float * gvy = Grid.VY;
 	for (int i=0, lim=fluid->Particles.size(); i<lim; i++)
 	{
-		Particle p = fluid->Particles[i];
+		const Particle & p = fluid->Particles[i];
+
+		int cx = std::min(GWidth-3, std::max(0, (int)(p.x - 0.5f)));
+		int cy = std::min(GHeight-3, std::max(0, (int)(p.y - 0.5f)));
+		Stencil<Access> stencil(grid, cx, cy);
+
+		const CellWeight & weight = fluid->Weights[i];
+		for (int y=0; y<3; y++)
+		{
+			for (int x=0; x<3; x++)
+			{
+				float w = weight.wy[y] * weight.wx[x];
+
+				int o = stencil(x, y);
+				m[o] += w;
+				gvx[o] += p.vx * w;
+				gvy[o] += p.vy * w;
+			}
+		}
+	}
+}
+///////////////////////////////////////////////////////////////////////////////
+template <class Access>
+void FluidSim::ScatterForces(Fluid * fluid)
+{
+	Access grid(Grid);
+	float * gax = Grid.AX;
+	float * gay = Grid.AY;
+	for (int i=0, lim=fluid->Particles.size(); i<lim; i++)
+	{
+		float fx = fluid->Particles[i].x;
+		float fy = fluid->Particles[i].y;
+		int cx = std::min(GWidth-3, std::max(0, (int)(fx - 0.5f)));
+		int cy = std::min(GHeight-3, std::max(0, (int)(fy - 0.5f)));
+		Stencil<Access> stencil(grid, cx, cy);
+
+		const CellWeight & weight = fluid->Weights[i];
+		const ParticleForce & f = Forces[i];
+
+		// Update grid acceleration values
+		for (int y=0; y<3; y++)
+		{
+			for (int x=0; x<3; x++)
+			{
+				float w = weight.wx[x] * weight.wy[y];
+				float dx = weight.gx[x] * weight.wy[y];
+				float dy = weight.wx[x] * weight.gy[y];
+
+				int o = stencil(x, y);
+				gax[o] += f.ax * w - dx * f.pressure - (f.dudx * dx + f.dudy * dy) * fluid->Viscosity * w;
+				gay[o] += f.ay * w - dy * f.pressure - (f.dvdx * dx + f.dvdy * dy) * fluid->Viscosity * w;
+			}
+		}
+	}
+}
+///////////////////////////////////////////////////////////////////////////////
+template <class Access>
+void FluidSim::ScatterVelocity(Fluid * fluid)
+{
+	Access grid(fluid->Grid);
+	float * m = fluid->Grid.M;
+	float * gvx = fluid->Grid.VX;
+	float * gvy = fluid->Grid.VY;
+	for (int i=0, lim=fluid->Particles.size(); i<lim; i++)
+	{
+		const Particle & p = fluid->Particles[i];
+		int cx = std::min(GWidth-3, std::max(0, (int)(p.x - 0.5f)));
+		int cy = std::min(GHeight-3, std::max(0, (int)(p.y - 0.5f)));
+		Stencil<Access> stencil(grid, cx, cy);
+
+		// Update fluid specific velocity grid
+		const CellWeight & weight = fluid->Weights[i];
+		for (int y=0; y<3; y++)
+		{
+			for (int x=0; x<3; x++)
+			{
+				float w = weight.wx[x] * weight.wy[y];
+				int o = stencil(x, y);
+				m[o] += w;
+				gvx[o] += (w * p.vx);
+				gvy[o] += (w * p.vy);
+			}
+		}
+	}
+}
+///////////////////////////////////////////////////////////////////////////////
+void FluidSim::CalcWeights(Fluid * fluid, int begin, int end)
+{
+	for (int i=begin; i<end; i++)
+	{
+		const Particle & p = fluid->Particles[i];
 
 		int cx = std::min(GWidth-3, std::max(0, (int)(p.x - 0.5f)));
 		int cy = std::min(GHeight-3, std::max(0, (int)(p.y - 0.5f)));
@@ -186,32 +812,29 @@ void FluidSim::InitGrid(Fluid * fluid)
 		v++;
 		weight.wy[2] = 0.5f * v * v - 1.5f * v + 1.125f;
 		weight.gy[2] = v - 1.5f;
-
-		for (int y=0; y<3; y++)
-		{
-			for (int x=0; x<3; x++)
-			{
-				float w = weight.wy[y] * weight.wx[x];
-
-				GridCell & cell = Grid[cy + y][cx + x];
-				cell.m += w;
-				cell.vx += p.vx * w;
-				cell.vy += p.vy * w;
-			}
-		}
 	}
 }
 ///////////////////////////////////////////////////////////////////////////////
-void FluidSim::CalcAccel(Fluid * fluid)
+template <class Access>
+void FluidSim::CalcForces(Fluid * fluid, int begin, int end)
 {
-	for (int i=0, lim=fluid->Particles.size(); i<lim; i++)
+	Access grid(Grid);
+	const float * m = Grid.M;
+	const float * gvx = Grid.VX;
+	const float * gvy = Grid.VY;
+
+	// Pressure comes from the projection instead when it's on
+	float stiffness = Incompressible ? 0.f : 
+		fluid->Stiffness / std::max(1.f, fluid->Density);
+	for (int i=begin; i<end; i++)
 	{
 		float fx = fluid->Particles[i].x;
 		float fy = fluid->Particles[i].y;
 		int cx = std::min(GWidth-3, std::max(0, (int)(fx - 0.5f)));
 		int cy = std::min(GHeight-3, std::max(0, (int)(fy - 0.5f)));
 
-		CellWeight & weight = fluid->Weights[i];
+		Stencil<Access> stencil(grid, cx, cy);
+		const CellWeight & weight = fluid->Weights[i];
 
 		// Determine interpolated mass and velocity derivatives
 		float dudx = 0.f, dudy = 0.f;
@@ -225,117 +848,113 @@ void FluidSim::CalcAccel(Fluid * fluid)
 				float dx = weight.gx[x] * weight.wy[y];
 				float dy = weight.wx[x] * weight.gy[y];
 
-				GridCell & cell = Grid[cy + y][cx + x];
+				int o = stencil(x, y);
 
-				dudx += cell.vx * dx;
-				dudy += cell.vx * dy;
-				dvdx += cell.vy * dx;
-				dvdy += cell.vy * dy;
-				mass += cell.m * w;
+				dudx += gvx[o] * dx;
+				dudy += gvx[o] * dy;
+				dvdx += gvy[o] * dx;
+				dvdy += gvy[o] * dy;
+				mass += m[o] * w;
 			}
 		}
-		
-		float pressure = (fluid->Stiffness / std::max(1.f, fluid->Density)) * 
-			(mass - fluid->Density);
+
+		ParticleForce & f = Forces[i];
+		f.pressure = stiffness * (mass - fluid->Density);
+		f.dudx = dudx;
+		f.dudy = dudy;
+		f.dvdx = dvdx;
+		f.dvdy = dvdy;
 
 		// Add a bit of a pushing force near the collision boundaries
-		float ax = 0.f, ay = 0.f;
-		float d = SDF.SampleDistance(fx, fy);
+		f.ax = 0.f;
+		f.ay = 0.f;
+		float d = QueryD[i];
 		if (d < 3.f)
 		{
-			float dirx, diry;
-			SDF.SampleGradient(fx, fy, &dirx, &diry);
-			ax += dirx * (1.f - (d / 3.f));
-			ay += diry * (1.f - (d / 3.f));
-		}
-
-		// Update grid acceleration values
-		for (int y=0; y<3; y++)
-		{
-			for (int x=0; x<3; x++)
-			{
-				float w = weight.wx[x] * weight.wy[y];
-				float dx = weight.gx[x] * weight.wy[y];
-				float dy = weight.wx[x] * weight.gy[y];
-
-				GridCell & cell = Grid[cy + y][cx + x];
-				cell.ax += ax * w - dx * pressure - (dudx * dx + dudy * dy) * fluid->Viscosity * w;
-				cell.ay += ay * w - dy * pressure - (dvdx * dx + dvdy * dy) * fluid->Viscosity * w;
-			}
+			f.ax += QueryGX[i] * (1.f - (d / 3.f));
+			f.ay += QueryGY[i] * (1.f - (d / 3.f));
 		}
 	}
 }
 ///////////////////////////////////////////////////////////////////////////////
-void FluidSim::CalcVelocity(Fluid * fluid)
-{	
-	for (int i=0, lim=fluid->Particles.size(); i<lim; i++)
+template <class Access>
+void FluidSim::AddGridAccel(Fluid * fluid, int begin, int end)
+{
+	Access grid(Grid);
+	const float * gax = Grid.AX;
+	const float * gay = Grid.AY;
+	for (int i=begin; i<end; i++)
 	{
 		Particle & p = fluid->Particles[i];
-		float fx = p.x;
-		float fy = p.y;
-		int cx = std::min(GWidth-3, std::max(0, (int)(fx - 0.5f)));
-		int cy = std::min(GHeight-3, std::max(0, (int)(fy - 0.5f)));
+		int cx = std::min(GWidth-3, std::max(0, (int)(p.x - 0.5f)));
+		int cy = std::min(GHeight-3, std::max(0, (int)(p.y - 0.5f)));
 
 		// Add grid acceleration to the particle velocities
-		CellWeight & weight = fluid->Weights[i];
+		Stencil<Access> stencil(grid, cx, cy);
+		const CellWeight & weight = fluid->Weights[i];
 		for (int y=0; y<3; y++)
 		{
 			for (int x=0; x<3; x++)
 			{
-				GridCell & cell = Grid[cy + y][cx + x];
+				int o = stencil(x, y);
 				float w = weight.wx[x] * weight.wy[y];
-				p.vx += w * cell.ax;
-				p.vy += w * cell.ay;
+				p.vx += w * gax[o];
+				p.vy += w * gay[o];
 			}
 		}
 
 		p.vx += GravityX;
 		p.vy += GravityY; 
 
-		// Check new position and push away from distance field boundaries
-		float nx = fx + p.vx;
-		float ny = fy + p.vy;
-		float d = SDF.SampleDistance(nx, ny);
-		if (d < 1.f)
-		{
-			float dirx, diry;
-			SDF.SampleGradient(nx, ny, &dirx, &diry);
-			p.vx += (dirx) * (1.f - d) * (1.f + frand() * 0.01f);
-			p.vy += (diry) * (1.f - d) * (1.f + frand() * 0.01f);
-		}
+		QueryX[i] = p.x + p.vx;
+		QueryY[i] = p.y + p.vy;
+	}
+}
+///////////////////////////////////////////////////////////////////////////////
+void FluidSim::PushFromBoundary(Fluid * fluid, int begin, int end)
+{
+	for (int i=begin; i<end; i++)
+	{
+		// Push away from distance field boundaries, jittered a touch so 
+		// particles don't stack up along the surface
+		float d = QueryD[i];
+		if (d >= 1.f)
+			continue;
 
-		// Update fluid specific velocity grid
-		for (int y=0; y<3; y++)
+		Particle & p = fluid->Particles[i];
+		p.vx += (QueryGX[i]) * (1.f - d) * (1.f + frand(nJitterKey, 2*i) * 0.01f);
+		p.vy += (QueryGY[i]) * (1.f - d) * (1.f + frand(nJitterKey, 2*i + 1) * 0.01f);
+
+		// Moving obstacles carry the fluid with them - cancel whatever 
+		// velocity is left heading into the surface relative to its motion
+		if (QueryOwner[i] >= 0)
 		{
-			for (int x=0; x<3; x++)
+			float len = sqrtf(QueryGX[i]*QueryGX[i] + QueryGY[i]*QueryGY[i]);
+			if (len > 0.f)
 			{
-				float w = weight.wx[x] * weight.wy[y];
-				GridCell & cell = fluid->Grid[cy+y][cx+x];
-				cell.m += w;
-				cell.vx += (w * p.vx);
-				cell.vy += (w * p.vy);
-			}
-		}
-	}
+				float nx = QueryGX[i] / len;
+				float ny = QueryGY[i] / len;
+				float ovx, ovy;
+				Obstacles[QueryOwner[i]]->VelocityAt(QueryX[i], QueryY[i], &ovx, &ovy);
 
-	// Average out the fluid velocity grid
-	for (int y=0, ylim=GHeight; y<ylim; y++)
-	{
-		for (int x=0, xlim=GWidth; x<xlim; x++)
-		{
-			GridCell & cell = fluid->Grid[y][x];
-			float m = cell.m;
-			if (m == 0.f)
-				continue;
-			cell.vx /= m;
-			cell.vy /= m;
+				float vn = (p.vx - ovx) * nx + (p.vy - ovy) * ny;
+				if (vn < 0.f)
+				{
+					p.vx -= vn * nx;
+					p.vy -= vn * ny;
+				}
+			}
 		}
 	}
 }
 ///////////////////////////////////////////////////////////////////////////////
-void FluidSim::UpdateParticles(Fluid * fluid)
+template <class Access>
+void FluidSim::MoveParticles(Fluid * fluid, int begin, int end)
 {
-	for (int i=0, lim=fluid->Particles.size(); i<lim; i++)
+	Access grid(fluid->Grid);
+	const float * gvx = fluid->Grid.VX;
+	const float * gvy = fluid->Grid.VY;
+	for (int i=begin; i<end; i++)
 	{
 		Particle & p = fluid->Particles[i];
 	
@@ -343,16 +962,17 @@ void FluidSim::UpdateParticles(Fluid * fluid)
 		int cy = std::min(GHeight-3, std::max(0, (int)(p.y - 0.5f)));
 
 		// Get interpolated velocity
-		CellWeight & weight = fluid->Weights[i];
+		Stencil<Access> stencil(grid, cx, cy);
+		const CellWeight & weight = fluid->Weights[i];
 		float vx = 0.f, vy = 0.f;
 		for (int y=0; y<3; y++)
 		{
 			for (int x=0; x<3; x++)
 			{
-				GridCell & cell = fluid->Grid[cy+y][cx+x];
+				int o = stencil(x, y);
 				float w = weight.wx[x] * weight.wy[y];
-				vx += w * cell.vx;
-				vy += w * cell.vy;
+				vx += w * gvx[o];
+				vy += w * gvy[o];
 			}
 		}
 
@@ -362,23 +982,263 @@ void FluidSim::UpdateParticles(Fluid * fluid)
 		p.vx += GridCoeff * (vx - p.vx);
 		p.vy += GridCoeff * (vy - p.vy);
 
+		QueryX[i] = p.x;
+		QueryY[i] = p.y;
+	}
+}
+///////////////////////////////////////////////////////////////////////////////
+void FluidSim::ClampParticles(Fluid * fluid, int begin, int end)
+{
+	for (int i=begin; i<end; i++)
+	{
 		// Resolve collisions, clamp positions, update velocities based on this
-		float x = p.x;
-		float y = p.y;
-			
-		float d = SDF.SampleDistance(x, y);
-		if (d < 0.f)
+		float x = QueryX[i];
+		float y = QueryY[i];
+		if (QueryD[i] < 0.f)
 		{
-			float dx, dy;
-			SDF.SampleGradient(x, y, &dx, &dy);
-			x -= dx;
-			y -= dy;
+			if (QueryOwner[i] < 0)
+			{
+				x -= QueryGX[i];
+				y -= QueryGY[i];
+			}
+			else
+			{
+				// Moving obstacles sweep into particles, so push them back
+				// out along the surface normal by the penetration depth
+				x -= QueryGX[i] * QueryD[i];
+				y -= QueryGY[i] * QueryD[i];
+			}
 		}
 
 		x = std::min(std::max(x, 1.f), GWidth - 2.f);
 		y = std::min(std::max(y, 1.f), GHeight - 2.f);
-		p.x = x;
-		p.y = y;
+		fluid->Particles[i].x = x;
+		fluid->Particles[i].y = y;
+	}
+}
+///////////////////////////////////////////////////////////////////////////////
+void FluidSim::AverageVelocityCells(Fluid * fluid, int begin, int end)
+{
+	CellGrid & grid = fluid ? fluid->Grid : Grid;
+	DivideByMass(grid.M, grid.VX, grid.VY, begin, end);
+}
+///////////////////////////////////////////////////////////////////////////////
+void FluidSim::AverageAccelerationCells(Fluid * fluid, int begin, int end)
+{
+	DivideByMass(Grid.M, Grid.AX, Grid.AY, begin, end);
+}
+///////////////////////////////////////////////////////////////////////////////
+void FluidSim::SampleBoundary(Fluid * fluid, int begin, int end)
+{
+	SDF.SampleDistanceBatch(&QueryX[begin], &QueryY[begin], &QueryD[begin], 
+		end - begin);
+}
+///////////////////////////////////////////////////////////////////////////////
+template <class Access>
+void FluidSim::BuildPressure(Fluid * fluid, int begin, int end)
+{
+	Access grid(Grid);
+	const float * m = Grid.M;
+	const float * gvx = Grid.VX;
+	const float * gvy = Grid.VY;
+	const float * gax = Grid.AX;
+	const float * gay = Grid.AY;
+	unsigned char * nodes = Pressure.GetNodes();
+	float * rhs = Pressure.GetRHS();
+	int stride = Pressure.GetStride();
+	float fluidmass = PRESSURE_FLUID_MASS * fRestDensity;
+	float invrest = 1.f / fRestDensity;
+
+	for (int y=begin; y<end; y++)
+	{
+		for (int x=0; x<GWidth; x++)
+		{
+			int n = y * stride + x;
+			int c = y * GWidth + x;
+			rhs[n] = 0.f;
+			if (x == 0 || y == 0 || x == GWidth-1 || y == GHeight-1 || 
+				SolidNodes[c])
+			{
+				nodes[n] = PRESSURE_SOLID;
+				continue;
+			}
+
+			int o = grid.OffsetX(x) + grid.OffsetY(y);
+			if (m[o] < fluidmass)
+			{
+				nodes[n] = PRESSURE_AIR;
+				continue;
+			}
+			nodes[n] = PRESSURE_FLUID;
+
+			// Central differences of the velocity the particles are about to
+			// take from the grid, walls and empty nodes holding still
+			int l = grid.OffsetX(x - 1) + grid.OffsetY(y);
+			int r = grid.OffsetX(x + 1) + grid.OffsetY(y);
+			int d = grid.OffsetX(x) + grid.OffsetY(y - 1);
+			int u = grid.OffsetX(x) + grid.OffsetY(y + 1);
+			float ul = (SolidNodes[c - 1] || m[l] == 0.f) ? 0.f : 
+				gvx[l] + gax[l] + GravityX;
+			float ur = (SolidNodes[c + 1] || m[r] == 0.f) ? 0.f : 
+				gvx[r] + gax[r] + GravityX;
+			float vd = (SolidNodes[c - GWidth] || m[d] == 0.f) ? 0.f : 
+				gvy[d] + gay[d] + GravityY;
+			float vu = (SolidNodes[c + GWidth] || m[u] == 0.f) ? 0.f : 
+				gvy[u] + gay[u] + GravityY;
+			float div = 0.5f * ((ur - ul) + (vu - vd));
+
+			// Crowded nodes are given some outflow to spread back out
+			float excess = std::max(0.f, m[o] * invrest - 1.f);
+			rhs[n] = VolumeCorrection * excess - div;
+		}
+	}
+}
+///////////////////////////////////////////////////////////////////////////////
+template <class Access>
+void FluidSim::ApplyPressure(Fluid * fluid, int begin, int end)
+{
+	Access grid(Grid);
+	const float * m = Grid.M;
+	float * gax = Grid.AX;
+	float * gay = Grid.AY;
+	const float * p = Pressure.GetPressure();
+	int stride = Pressure.GetStride();
+
+	begin = std::max(1, begin);
+	end = std::min(GHeight - 1, end);
+	for (int y=begin; y<end; y++)
+	{
+		for (int x=1; x<GWidth-1; x++)
+		{
+			int c = y * GWidth + x;
+			int o = grid.OffsetX(x) + grid.OffsetY(y);
+			if (SolidNodes[c] || m[o] == 0.f)
+				continue;
+
+			// Against a wall the difference is taken one-sided, over the 
+			// node and its open neighbour, so the wall holds up the full 
+			// weight on it; the free surface is already at zero
+			int n = y * stride + x;
+			gax[o] -= PressureGradient(p[n - 1], p[n], p[n + 1], 
+				SolidNodes[c - 1], SolidNodes[c + 1]);
+			gay[o] -= PressureGradient(p[n - stride], p[n], p[n + stride], 
+				SolidNodes[c - GWidth], SolidNodes[c + GWidth]);
+		}
+	}
+}
+///////////////////////////////////////////////////////////////////////////////
+void FluidSim::UpdateSolidNodes()
+{
+	int cells = GWidth * GHeight;
+	if ((int) SolidNodes.size() == cells && nSolidVersion == SDF.GetVersion())
+		return;
+
+	SolidNodes.resize(cells);
+	for (int y=0; y<GHeight; y++)
+	{
+		for (int x=0; x<GWidth; x++)
+		{
+			float d = SDF.SampleDistance((float) x, (float) y);
+			SolidNodes[y * GWidth + x] = d < PRESSURE_WALL_DISTANCE;
+		}
+	}
+	nSolidVersion = SDF.GetVersion();
+}
+///////////////////////////////////////////////////////////////////////////////
+void FluidSim::ResolveBoundary(int count, float threshold)
+{
+	PROFILE_SCOPE("ResolveBoundary");
+	QueryD.resize(count);
+	QueryGX.resize(count);
+	QueryGY.resize(count);
+	QueryOwner.assign(count, -1);
+	if (count == 0)
+		return;
+
+	ParallelFor(&FluidSim::SampleBoundary, NULL, count, ParticleChunk);
+
+	// Moving obstacles only look at the points within their bounds, and the 
+	// combined field is the closest surface of all of them
+	for (int k=0, lim=Obstacles.size(); k<lim; k++)
+	{
+		const Obstacle * obstacle = Obstacles[k];
+
+		NearIndex.clear();
+		NearX.clear();
+		NearY.clear();
+		for (int i=0; i<count; i++)
+		{
+			if (!obstacle->Contains(QueryX[i], QueryY[i]))
+				continue;
+
+			float lx, ly;
+			obstacle->ToLocal(QueryX[i], QueryY[i], &lx, &ly);
+			NearIndex.push_back(i);
+			NearX.push_back(lx);
+			NearY.push_back(ly);
+		}
+
+		int near = NearIndex.size();
+		if (near == 0)
+			continue;
+
+		NearGX.resize(near);
+		obstacle->Field.SampleDistanceBatch(&NearX[0], &NearY[0], &NearGX[0], near);
+		for (int i=0; i<near; i++)
+		{
+			int id = NearIndex[i];
+			if (NearGX[i] < QueryD[id])
+			{
+				QueryD[id] = NearGX[i];
+				QueryOwner[id] = k;
+			}
+		}
+	}
+
+	// Gradients for only the handful of points that are close enough to a 
+	// boundary to need one, taken from whichever field was closest
+	for (int k=-1, lim=Obstacles.size(); k<lim; k++)
+	{
+		const Obstacle * obstacle = (k < 0) ? NULL : Obstacles[k];
+
+		NearIndex.clear();
+		NearX.clear();
+		NearY.clear();
+		for (int i=0; i<count; i++)
+		{
+			if (QueryOwner[i] != k || QueryD[i] >= threshold)
+				continue;
+
+			float x = QueryX[i], y = QueryY[i];
+			if (obstacle)
+				obstacle->ToLocal(QueryX[i], QueryY[i], &x, &y);
+			NearIndex.push_back(i);
+			NearX.push_back(x);
+			NearY.push_back(y);
+		}
+
+		int near = NearIndex.size();
+		if (near == 0)
+			continue;
+
+		NearGX.resize(near);
+		NearGY.resize(near);
+		const DistanceField & field = obstacle ? obstacle->Field : SDF;
+		field.SampleGradientBatch(&NearX[0], &NearY[0], &NearGX[0], &NearGY[0], near);
+
+		for (int i=0; i<near; i++)
+		{
+			int id = NearIndex[i];
+			if (obstacle)
+			{
+				obstacle->ToWorldDir(NearGX[i], NearGY[i], &QueryGX[id], &QueryGY[id]);
+			}
+			else
+			{
+				QueryGX[id] = NearGX[i];
+				QueryGY[id] = NearGY[i];
+			}
+		}
 	}
 }
 ///////////////////////////////////////////////////////////////////////////////
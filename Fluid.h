@@ -23,17 +23,18 @@ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #ifndef HH_MPM_FLUID_HH
 #define HH_MPM_FLUID_HH
 
+#include <stdint.h>
 #include <vector>
 #include "DistanceField.h"
+#include "Obstacle.h"
+#include "Grid.h"
+#include "Pressure.h"
 
-struct GridCell
-{	
-	float m;		// mass
-	float vx;		// x-axis velocity
-	float vy;		// y-axis velocity
-	float ax;		// x-axis acceleration
-	float ay;		// y-axis acceleration
-};
+class ThreadPool;
+class Brush;
+
+// Streams below this are reserved for the simulation's own random numbers
+#define RANDOM_STREAM_USER	0x10000
 
 // Cell weights for performing quadratic interpolation
 struct CellWeight
@@ -52,6 +53,13 @@ struct Particle
 	float vy;		// y-axis velocity
 };
 
+// A particle named by its fluid and its position in that fluid's arrays
+struct ParticleRef
+{
+	int fluid;
+	int index;
+};
+
 class Fluid
 {
 public:
@@ -60,6 +68,9 @@ public:
 
 	void AddParticle(float x, float y, float vx, float vy);
 
+	// Adds the fluid's grid, particles and weights to 'stats'
+	void CountMemory(MemoryStats & stats) const;
+
 	int 						Color;
 
 	std::vector<Particle>		Particles;
@@ -68,7 +79,7 @@ public:
 	float						Density;
 	float						Stiffness;
 	float						Viscosity;
-	GridCell **					Grid;
+	CellGrid					Grid;	// recreated to match the simulation's
 
 private:
 	Fluid(const Fluid &);
@@ -78,20 +89,68 @@ private:
 class FluidSim
 {
 public:
-	FluidSim(int width, int height, float scale);
+	// The tank's walls are built into the collision field before this 
+	// returns.  With 'batching' the field is left batching instead, so the 
+	// caller's shapes share the walls' propagation; the caller then builds 
+	// it with SDF.EndBatch().
+	FluidSim(int width, int height, float scale, 
+		GridLayout layout = GRID_ROW_MAJOR, bool batching = false);
 	~FluidSim();
 
+	// Update() runs these in order; they are public so each phase can be 
+	// timed on its own
 	void Update();
+	void ClearGrid();
 	void InitGrid(Fluid * fluid);
+	void AverageVelocity();
 	void CalcAccel(Fluid * fluid);
+	void AverageAcceleration();
+	void Project();
 	void CalcVelocity(Fluid * fluid);
 	void UpdateParticles(Fluid * fluid);
 	
 	int ParticleCount() const;
 
+	// Buckets every particle by the grid cell it lies in.  Update() rebuilds
+	// the index as its last phase; anything else that moves particles should
+	// call it before the index is next used.  Adding or removing particles 
+	// is picked up automatically.
+	void BuildIndex();
+
+	// Applies the brush to the particles in the cells under its footprint,
+	// drawing random numbers from 'stream' plus the fluid's index
+	void ApplyBrush(const Brush & brush, unsigned stream);
+
+	// Particles of the given fluid, or of all with -1, within a rectangle or
+	// a circle in grid cells; results are appended to 'out'
+	void QueryRect(float x0, float y0, float x1, float y1, 
+			std::vector<ParticleRef> & out, int fluid = -1);
+	void QueryRadius(float x, float y, float radius, 
+			std::vector<ParticleRef> & out, int fluid = -1);
+
+	// Replaces 'out' with the k particles closest to (x, y), nearest first
+	void QueryNearest(float x, float y, int k, std::vector<ParticleRef> & out,
+			int fluid = -1);
+
+	// Total mass and mass weighted velocity over the grid nodes within the 
+	// rectangle, as of the last step.  Particles each carry unit mass.
+	void GetRegionMass(float x0, float y0, float x1, float y1, float * mass,
+			float * vx, float * vy, int fluid = -1) const;
+
+	// Key for this step's random numbers in the given stream; fluids use 
+	// their index, callers adding particles or forces pick their own above
+	// RANDOM_STREAM_USER
+	uint64_t GetRandomKey(unsigned stream) const;
+
+	// Memory held by the simulation, its fluids, distance fields and 
+	// obstacles.  Peaks are sampled after every step and on each call, 
+	// while the distance fields track their own through every allocation.
+	const MemoryStats & GetMemoryStats();
+
 	DistanceField				SDF;
-	GridCell **					Grid;
+	CellGrid					Grid;
 	std::vector<Fluid *>		Fluids;
+	std::vector<Obstacle *>		Obstacles;	// owned, moved every Update
 	float 						GridCoeff;
 	float						GravityX;
 	float						GravityY;
@@ -99,9 +158,128 @@ public:
 	int							GWidth;
 	int							GHeight;
 
+	// Per-particle work runs on this pool when set.  Results don't depend on
+	// the thread count, so runs with and without it match bit for bit.
+	ThreadPool *				Threads;
+
+	// Particles and grid cells per parallel task, rounded down to multiples
+	// of four.  Like the thread count they change only the speed.
+	int							ParticleChunk;
+	int							CellChunk;
+
+	unsigned					Step;		// Update() calls so far
+	unsigned					Seed;
+
+	// With Incompressible set the fluids' stiffness is ignored and Project()
+	// instead removes the divergence of the grid velocities after forces, 
+	// with nodes within a cell of the SDF boundary as walls and those with 
+	// little mass as free surface.  Moving obstacles still act only through
+	// the particles.  VolumeCorrection is the fraction of any density 
+	// above the fluids' average rest density pushed apart each step, which
+	// keeps the volume from drifting.  The solver stops at the tolerance, 
+	// relative to the largest divergence, or after PressureIterations.
+	bool						Incompressible;
+	int							PressureIterations;
+	float						PressureTolerance;
+	float						VolumeCorrection;
+	PressureSolver				Pressure;
+
 private:
 	FluidSim(const FluidSim &);
 	FluidSim & operator = (const FluidSim &);
+
+	typedef void (FluidSim::*RangeFn)(Fluid * fluid, int begin, int end);
+
+	struct RangeTask
+	{
+		FluidSim *		sim;
+		RangeFn			fn;
+		Fluid *			fluid;
+		int				count;
+		int				chunk;
+	};
+
+	// Per-particle parts of each phase, run over fixed chunks of particles 
+	// (or grid cells); each writes only the particles or cells it is given.
+	// Those touching the grid are instantiated for each layout.
+	struct ParticleForce
+	{
+		float	ax, ay;
+		float	pressure;
+		float	dudx, dudy;
+		float	dvdx, dvdy;
+	};
+
+	void ParallelFor(RangeFn fn, Fluid * fluid, int count, int chunk);
+	static void RunRange(void * data, int index);
+
+	void CalcWeights(Fluid * fluid, int begin, int end);
+	template <class Access>
+	void CalcForces(Fluid * fluid, int begin, int end);
+	template <class Access>
+	void AddGridAccel(Fluid * fluid, int begin, int end);
+	void PushFromBoundary(Fluid * fluid, int begin, int end);
+	template <class Access>
+	void MoveParticles(Fluid * fluid, int begin, int end);
+	void ClampParticles(Fluid * fluid, int begin, int end);
+	void AverageVelocityCells(Fluid * fluid, int begin, int end);
+	void AverageAccelerationCells(Fluid * fluid, int begin, int end);
+	void SampleBoundary(Fluid * fluid, int begin, int end);
+
+	// Row by row, so 'begin' and 'end' are grid rows
+	template <class Access>
+	void BuildPressure(Fluid * fluid, int begin, int end);
+	template <class Access>
+	void ApplyPressure(Fluid * fluid, int begin, int end);
+
+	// The serial scatters into the grids
+	template <class Access>
+	void ScatterMass(Fluid * fluid);
+	template <class Access>
+	void ScatterForces(Fluid * fluid);
+	template <class Access>
+	void ScatterVelocity(Fluid * fluid);
+
+	void UpdateIndex();
+	void GetCellRange(float x0, float y0, float x1, float y1, int * cx0, 
+			int * cy0, int * cx1, int * cy1) const;
+
+	void ResolveBoundary(int count, float threshold);
+	void UpdateSolidNodes();
+	void UpdateMemory();
+
+	// Scratch space for batching distance field queries within a phase; 
+	// QueryGX/QueryGY are only valid where QueryD is below the threshold, and
+	// QueryOwner is the obstacle closest to each point or -1 for the SDF
+	std::vector<float>			QueryX;
+	std::vector<float>			QueryY;
+	std::vector<float>			QueryD;
+	std::vector<float>			QueryGX;
+	std::vector<float>			QueryGY;
+	std::vector<int>			QueryOwner;
+	std::vector<float>			NearX;
+	std::vector<float>			NearY;
+	std::vector<float>			NearGX;
+	std::vector<float>			NearGY;
+	std::vector<int>			NearIndex;
+	std::vector<ParticleForce>	Forces;
+
+	// Particles sorted by cell, those in cell c being 
+	// IndexEntries[IndexStart[c]] up to IndexEntries[IndexStart[c + 1]]
+	std::vector<int>			IndexStart;
+	std::vector<ParticleRef>	IndexEntries;
+	std::vector<int>			IndexCell;		// scratch, cell per particle
+	int							nIndexCount;	// particles when built
+	unsigned					nIndexStep;
+	uint64_t					nJitterKey;
+
+	// Wall nodes of the pressure solve as of SDF version nSolidVersion, one
+	// byte each row-major
+	std::vector<unsigned char>	SolidNodes;
+	unsigned					nSolidVersion;
+	float						fRestDensity;	// for the pressure solve
+
+	MemoryStats					memory;
 };
 
 #endif // HH_MPM_FLUID_HH
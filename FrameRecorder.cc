@@ -0,0 +1,286 @@
+/*
+Copyright (c) 2012 Chris Lentini
+http://divergentcoder.com
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of 
+this software and associated documentation files (the "Software"), to deal in 
+the Software without restriction, including without limitation the rights to use, 
+copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the 
+Software, and to permit persons to whom the Software is furnished to do so, 
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all 
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS 
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR 
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER 
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN 
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+
+#include <stdio.h>
+#include <string.h>
+#include "FrameRecorder.h"
+#include "Profiler.h"
+
+#define QOI_OP_INDEX	0x00
+#define QOI_OP_DIFF		0x40
+#define QOI_OP_LUMA		0x80
+#define QOI_OP_RUN		0xc0
+#define QOI_OP_RGB		0xfe
+#define QOI_OP_RGBA		0xff
+
+///////////////////////////////////////////////////////////////////////////////
+static void Put32(std::vector<unsigned char> & out, unsigned v)
+{
+	out.push_back((v >> 24) & 0xff);
+	out.push_back((v >> 16) & 0xff);
+	out.push_back((v >> 8) & 0xff);
+	out.push_back(v & 0xff);
+}
+///////////////////////////////////////////////////////////////////////////////
+//
+// ------------------------------ FrameRecorder -------------------------------
+//
+///////////////////////////////////////////////////////////////////////////////
+FrameRecorder::FrameRecorder(const char * path, int threads, int depth)
+:	prefix(path, path + strlen(path) + 1),
+	nSubmitted(0),
+	nBusy(0),
+	bFailed(false),
+	bQuit(false)
+{
+	pthread_mutex_init(&mutex, NULL);
+	pthread_cond_init(&ready, NULL);
+	pthread_cond_init(&freed, NULL);
+
+	for (int i=0; i<(depth > 0 ? depth : 1); i++)
+	{
+		frames.push_back(new Frame);
+		idle.push_back(frames.back());
+	}
+
+	for (int i=0; i<(threads > 0 ? threads : 1); i++)
+	{
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, &WorkerMain, this) != 0)
+			break;
+		workers.push_back(thread);
+	}
+
+	if (workers.empty())
+		bFailed = true;
+}
+///////////////////////////////////////////////////////////////////////////////
+FrameRecorder::~FrameRecorder()
+{
+	Finish();
+
+	pthread_mutex_lock(&mutex);
+	bQuit = true;
+	pthread_cond_broadcast(&ready);
+	pthread_mutex_unlock(&mutex);
+
+	for (unsigned i=0; i<workers.size(); i++)
+		pthread_join(workers[i], NULL);
+
+	for (unsigned i=0; i<frames.size(); i++)
+		delete frames[i];
+
+	pthread_cond_destroy(&freed);
+	pthread_cond_destroy(&ready);
+	pthread_mutex_destroy(&mutex);
+}
+///////////////////////////////////////////////////////////////////////////////
+void FrameRecorder::Submit(const int32_t * pixels, int width, int height)
+{
+	if (workers.empty() || width <= 0 || height <= 0)
+		return;
+
+	pthread_mutex_lock(&mutex);
+	while (idle.empty())
+		pthread_cond_wait(&freed, &mutex);
+	Frame * frame = idle.back();
+	idle.pop_back();
+	frame->index = nSubmitted++;
+	pthread_mutex_unlock(&mutex);
+
+	// The copy happens outside the lock so workers can keep dequeuing
+	frame->pixels.assign(pixels, pixels + width * height);
+	frame->width = width;
+	frame->height = height;
+
+	pthread_mutex_lock(&mutex);
+	queue.push_back(frame);
+	pthread_cond_signal(&ready);
+	pthread_mutex_unlock(&mutex);
+}
+///////////////////////////////////////////////////////////////////////////////
+void FrameRecorder::Finish()
+{
+	pthread_mutex_lock(&mutex);
+	while (!queue.empty() || nBusy > 0)
+		pthread_cond_wait(&freed, &mutex);
+	pthread_mutex_unlock(&mutex);
+}
+///////////////////////////////////////////////////////////////////////////////
+void * FrameRecorder::WorkerMain(void * arg)
+{
+	((FrameRecorder *) arg)->Work();
+	return NULL;
+}
+///////////////////////////////////////////////////////////////////////////////
+void FrameRecorder::Work()
+{
+	// Each worker reuses its own encode buffer across frames
+	std::vector<unsigned char> encoded;
+
+	pthread_mutex_lock(&mutex);
+	for (;;)
+	{
+		while (queue.empty() && !bQuit)
+			pthread_cond_wait(&ready, &mutex);
+		if (queue.empty())
+			break;
+
+		Frame * frame = queue.front();
+		queue.pop_front();
+		nBusy++;
+		pthread_mutex_unlock(&mutex);
+
+		bool ok = Write(frame, encoded);
+
+		pthread_mutex_lock(&mutex);
+		if (!ok)
+			bFailed = true;
+		nBusy--;
+		idle.push_back(frame);
+		pthread_cond_broadcast(&freed);
+	}
+	pthread_mutex_unlock(&mutex);
+}
+///////////////////////////////////////////////////////////////////////////////
+bool FrameRecorder::Write(const Frame * frame, 
+	std::vector<unsigned char> & encoded)
+{
+	PROFILE_SCOPE("WriteFrame");
+	EncodeQOI(&frame->pixels[0], frame->width, frame->height, encoded);
+
+	std::vector<char> path(prefix.size() + 16);
+	snprintf(&path[0], path.size(), "%s%06d.qoi", &prefix[0], frame->index);
+
+	// The whole image goes out in a single write
+	FILE * file = fopen(&path[0], "wb");
+	if (!file)
+		return false;
+
+	bool ok = fwrite(&encoded[0], 1, encoded.size(), file) == encoded.size();
+	if (fclose(file) != 0)
+		ok = false;
+	return ok;
+}
+///////////////////////////////////////////////////////////////////////////////
+void FrameRecorder::EncodeQOI(const int32_t * pixels, int width, int height,
+	std::vector<unsigned char> & out)
+{
+	int count = width * height;
+
+	// Worst case is a tag plus four channels per pixel
+	out.clear();
+	out.reserve(14 + count * 5 + 8);
+
+	out.push_back('q');
+	out.push_back('o');
+	out.push_back('i');
+	out.push_back('f');
+	Put32(out, width);
+	Put32(out, height);
+	out.push_back(4);		// RGBA
+	out.push_back(0);		// sRGB with linear alpha
+
+	unsigned index[64];
+	memset(index, 0, sizeof(index));
+	unsigned prev = 0xff000000;
+	int run = 0;
+
+	for (int i=0; i<count; i++)
+	{
+		// Buffer pixels are 0xAARRGGBB
+		unsigned px = (unsigned) pixels[i];
+		if (px == prev)
+		{
+			run++;
+			if (run == 62 || i == count - 1)
+			{
+				out.push_back(QOI_OP_RUN | (run - 1));
+				run = 0;
+			}
+			continue;
+		}
+
+		if (run > 0)
+		{
+			out.push_back(QOI_OP_RUN | (run - 1));
+			run = 0;
+		}
+
+		int a = (px >> 24) & 0xff;
+		int r = (px >> 16) & 0xff;
+		int g = (px >> 8) & 0xff;
+		int b = px & 0xff;
+		int hash = (r * 3 + g * 5 + b * 7 + a * 11) & 63;
+
+		if (index[hash] == px)
+		{
+			out.push_back(QOI_OP_INDEX | hash);
+		}
+		else if (a != (int)((prev >> 24) & 0xff))
+		{
+			out.push_back(QOI_OP_RGBA);
+			out.push_back(r);
+			out.push_back(g);
+			out.push_back(b);
+			out.push_back(a);
+		}
+		else
+		{
+			// Channel differences wrap like the byte arithmetic in decoders
+			signed char dr = (signed char)(r - (int)((prev >> 16) & 0xff));
+			signed char dg = (signed char)(g - (int)((prev >> 8) & 0xff));
+			signed char db = (signed char)(b - (int)(prev & 0xff));
+			signed char drg = (signed char)(dr - dg);
+			signed char dbg = (signed char)(db - dg);
+
+			if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && 
+				db >= -2 && db <= 1)
+			{
+				out.push_back(QOI_OP_DIFF | (dr + 2) << 4 | (dg + 2) << 2 | 
+					(db + 2));
+			}
+			else if (dg >= -32 && dg <= 31 && drg >= -8 && drg <= 7 && 
+				dbg >= -8 && dbg <= 7)
+			{
+				out.push_back(QOI_OP_LUMA | (dg + 32));
+				out.push_back((drg + 8) << 4 | (dbg + 8));
+			}
+			else
+			{
+				out.push_back(QOI_OP_RGB);
+				out.push_back(r);
+				out.push_back(g);
+				out.push_back(b);
+			}
+		}
+
+		index[hash] = px;
+		prev = px;
+	}
+
+	for (int i=0; i<7; i++)
+		out.push_back(0);
+	out.push_back(1);
+}
+///////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,86 @@
+/*
+Copyright (c) 2012 Chris Lentini
+http://divergentcoder.com
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of 
+this software and associated documentation files (the "Software"), to deal in 
+the Software without restriction, including without limitation the rights to use, 
+copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the 
+Software, and to permit persons to whom the Software is furnished to do so, 
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all 
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS 
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR 
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER 
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN 
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+
+#ifndef HH_MPM_FRAMERECORDER_HH
+#define HH_MPM_FRAMERECORDER_HH
+
+#include <pthread.h>
+#include <stdint.h>
+#include <deque>
+#include <vector>
+
+// Writes rendered frames out as a numbered QOI image sequence.  Submit() only
+// copies the frame into one of a fixed number of buffers; worker threads 
+// encode and write them in the background, so the caller blocks only when 
+// every buffer is still waiting on the disk.
+class FrameRecorder
+{
+public:
+	// Frames go to <prefix>NNNNNN.qoi
+	FrameRecorder(const char * prefix, int threads = 2, int depth = 8);
+	~FrameRecorder();
+
+	void	Submit(const int32_t * pixels, int width, int height);
+
+	// Blocks until every submitted frame is on disk
+	void	Finish();
+
+	int		GetFrameCount() const { return nSubmitted; }
+	bool	HasFailed() const { return bFailed; }
+
+	// Encodes BGRA pixels as they are laid out in the image buffer
+	static void EncodeQOI(const int32_t * pixels, int width, int height,
+					std::vector<unsigned char> & out);
+
+private:
+	FrameRecorder(const FrameRecorder &);
+	FrameRecorder & operator = (const FrameRecorder &);
+
+	struct Frame
+	{
+		std::vector<int32_t>	pixels;
+		int						width;
+		int						height;
+		int						index;
+	};
+
+	static void * WorkerMain(void * arg);
+	void	Work();
+	bool	Write(const Frame * frame, std::vector<unsigned char> & encoded);
+
+	std::vector<Frame *>	frames;		// every buffer, owned
+	std::vector<Frame *>	idle;		// buffers free for Submit
+	std::deque<Frame *>		queue;		// buffers waiting to be written
+	std::vector<pthread_t>	workers;
+	pthread_mutex_t			mutex;
+	pthread_cond_t			ready;		// queue gained a frame
+	pthread_cond_t			freed;		// idle gained a frame
+
+	std::vector<char>		prefix;
+	int						nSubmitted;
+	int						nBusy;		// frames being encoded
+	bool					bFailed;
+	bool					bQuit;
+};
+
+#endif // HH_MPM_FRAMERECORDER_HH
@@ -0,0 +1,157 @@
+/*
+Copyright (c) 2012 Chris Lentini
+http://divergentcoder.com
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of 
+this software and associated documentation files (the "Software"), to deal in 
+the Software without restriction, including without limitation the rights to use, 
+copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the 
+Software, and to permit persons to whom the Software is furnished to do so, 
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all 
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS 
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR 
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER 
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN 
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+
+#include <string.h>
+#include "Grid.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// -------------------------------- CellGrid ---------------------------------- 
+//
+///////////////////////////////////////////////////////////////////////////////
+CellGrid::CellGrid()
+:	M(NULL),
+	VX(NULL),
+	VY(NULL),
+	AX(NULL),
+	AY(NULL),
+	pData(NULL),
+	nWidth(0),
+	nHeight(0),
+	nStride(0),
+	nCount(0),
+	nPlanes(0),
+	nFields(0),
+	nLayout(GRID_ROW_MAJOR)
+{}
+///////////////////////////////////////////////////////////////////////////////
+CellGrid::~CellGrid()
+{
+	delete [] pData;
+}
+///////////////////////////////////////////////////////////////////////////////
+void CellGrid::Create(int width, int height, GridLayout layout, int fields)
+{
+	delete [] pData;
+
+	nWidth = width;
+	nHeight = height;
+	nLayout = layout;
+	nFields = fields;
+	if (layout == GRID_TILED)
+	{
+		int tilesx = (width + 3) / 4;
+		int tilesy = (height + 3) / 4;
+		nStride = tilesx * 16;
+		nCount = nStride * tilesy;
+	}
+	else
+	{
+		nStride = width;
+		nCount = (width * height + 3) & ~3;
+	}
+
+	nPlanes = 0;
+	if (fields & GRID_MASS)
+		nPlanes += 1;
+	if (fields & GRID_VELOCITY)
+		nPlanes += 2;
+	if (fields & GRID_ACCELERATION)
+		nPlanes += 2;
+
+	// Whole multiples of four keep every plane as aligned as the first
+	pData = new float[nPlanes * nCount];
+	float * plane = pData;
+	M = (fields & GRID_MASS) ? plane : NULL;
+	plane += M ? nCount : 0;
+	VX = (fields & GRID_VELOCITY) ? plane : NULL;
+	VY = (fields & GRID_VELOCITY) ? plane + nCount : NULL;
+	plane += VX ? 2 * nCount : 0;
+	AX = (fields & GRID_ACCELERATION) ? plane : NULL;
+	AY = (fields & GRID_ACCELERATION) ? plane + nCount : NULL;
+
+	Clear();
+}
+///////////////////////////////////////////////////////////////////////////////
+void CellGrid::Clear()
+{
+	memset(pData, 0, sizeof(float) * nPlanes * nCount);
+}
+///////////////////////////////////////////////////////////////////////////////
+void CellGrid::CountMemory(MemoryStats & stats, MemoryTag tag) const
+{
+	size_t used = (size_t) nPlanes * nWidth * nHeight * sizeof(float);
+	stats.Add(tag, used, GetByteCount());
+}
+///////////////////////////////////////////////////////////////////////////////
+//
+// ------------------------------- Functions ---------------------------------- 
+//
+///////////////////////////////////////////////////////////////////////////////
+void DivideByMass(const float * m, float * a, float * b, int begin, int end)
+{
+	int i = begin;
+
+#if defined(__SSE2__)
+	// One divide gives the reciprocal for both planes; where the mass is 
+	// zero the mask swaps it for one so those nodes keep their values
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 one = _mm_set1_ps(1.f);
+	if (b)
+	{
+		for (; i+4<=end; i+=4)
+		{
+			__m128 mass = _mm_loadu_ps(m + i);
+			__m128 mask = _mm_cmpneq_ps(mass, zero);
+			__m128 inv = _mm_or_ps(_mm_and_ps(mask, _mm_div_ps(one, mass)), 
+				_mm_andnot_ps(mask, one));
+			_mm_storeu_ps(a + i, _mm_mul_ps(_mm_loadu_ps(a + i), inv));
+			_mm_storeu_ps(b + i, _mm_mul_ps(_mm_loadu_ps(b + i), inv));
+		}
+	}
+	else
+	{
+		for (; i+4<=end; i+=4)
+		{
+			__m128 mass = _mm_loadu_ps(m + i);
+			__m128 mask = _mm_cmpneq_ps(mass, zero);
+			__m128 inv = _mm_or_ps(_mm_and_ps(mask, _mm_div_ps(one, mass)), 
+				_mm_andnot_ps(mask, one));
+			_mm_storeu_ps(a + i, _mm_mul_ps(_mm_loadu_ps(a + i), inv));
+		}
+	}
+#endif
+
+	for (; i<end; i++)
+	{
+		float inv = m[i] != 0.f ? 1.f / m[i] : 1.f;
+		a[i] *= inv;
+		if (b)
+			b[i] *= inv;
+	}
+}
+///////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,157 @@
+/*
+Copyright (c) 2012 Chris Lentini
+http://divergentcoder.com
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of 
+this software and associated documentation files (the "Software"), to deal in 
+the Software without restriction, including without limitation the rights to use, 
+copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the 
+Software, and to permit persons to whom the Software is furnished to do so, 
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all 
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS 
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR 
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER 
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN 
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+
+#ifndef HH_MPM_GRID_HH
+#define HH_MPM_GRID_HH
+
+#include <stddef.h>
+#include "Memory.h"
+
+enum GridLayout
+{
+	GRID_ROW_MAJOR,		// one row after another
+	GRID_TILED			// 4x4 tiles, row by row within and between the tiles
+};
+
+// Fields a grid carries, each in its own plane
+enum GridFields
+{
+	GRID_MASS			= 1,	// m
+	GRID_VELOCITY		= 2,	// vx, vy
+	GRID_ACCELERATION	= 4,	// ax, ay
+
+	GRID_MASS_VELOCITY	= GRID_MASS | GRID_VELOCITY,
+	GRID_ALL_FIELDS		= GRID_MASS | GRID_VELOCITY | GRID_ACCELERATION
+};
+
+// Grid nodes in either layout.  Both split a node's index into a part that
+// depends only on x and one that depends only on y, so a 3x3 stencil works 
+// out three of each rather than nine indices.  Tiles keep a stencil within
+// a few hundred bytes however wide the grid; rows spread it across three 
+// rows of the grid.
+// Each field lives in a separate plane indexed the same way, so sweeps over
+// the whole grid stream just the planes they use.  Planes the grid wasn't 
+// created with are NULL.
+class CellGrid
+{
+public:
+	CellGrid();
+	~CellGrid();
+
+	void		Create(int width, int height, GridLayout layout, 
+					int fields = GRID_ALL_FIELDS);
+	void		Clear();
+
+	int			OffsetX(int x) const
+	{
+		return nLayout == GRID_TILED ? ((x >> 2) << 4) + (x & 3) : x;
+	}
+	int			OffsetY(int y) const
+	{
+		return nLayout == GRID_TILED ? 
+			(y >> 2) * nStride + ((y & 3) << 2) : y * nStride;
+	}
+	int			Index(int x, int y) const { return OffsetX(x) + OffsetY(y); }
+
+	// Node count including any padding out to whole tiles or to a multiple
+	// of four, which stays empty
+	int			GetCellCount() const { return nCount; }
+	int			GetStride() const { return nStride; }
+	int			GetWidth() const { return nWidth; }
+	int			GetHeight() const { return nHeight; }
+	GridLayout	GetLayout() const { return nLayout; }
+	int			GetFields() const { return nFields; }
+	size_t		GetByteCount() const { return nPlanes * nCount * sizeof(float); }
+
+	// Adds the planes to 'tag', the padding counting as reserved only
+	void		CountMemory(MemoryStats & stats, MemoryTag tag) const;
+
+	float *		M;		// mass
+	float *		VX;		// velocity
+	float *		VY;
+	float *		AX;		// acceleration
+	float *		AY;
+
+private:
+	CellGrid(const CellGrid &);
+	CellGrid & operator = (const CellGrid &);
+
+	float *		pData;			// all planes, one after another
+	int			nWidth;
+	int			nHeight;
+	int			nStride;		// index step between rows, or rows of tiles
+	int			nCount;
+	int			nPlanes;
+	int			nFields;
+	GridLayout	nLayout;
+};
+
+// Divides 'a' and, if not NULL, 'b' by 'm' over [begin, end) wherever m is
+// non-zero, leaving the rest untouched.  Vectorized without branches; the
+// range should start on a multiple of four.
+void DivideByMass(const float * m, float * a, float * b, int begin, int end);
+
+// Accessors with the layout fixed at compile time, for the simulation's 
+// inner loops
+struct RowMajorAccess
+{
+	explicit RowMajorAccess(const CellGrid & grid) 
+	:	stride(grid.GetStride()) {}
+
+	int			OffsetX(int x) const { return x; }
+	int			OffsetY(int y) const { return y * stride; }
+
+	int			stride;
+};
+
+struct TiledAccess
+{
+	explicit TiledAccess(const CellGrid & grid) 
+	:	stride(grid.GetStride()) {}
+
+	int			OffsetX(int x) const { return ((x >> 2) << 4) + (x & 3); }
+	int			OffsetY(int y) const { return (y >> 2) * stride + ((y & 3) << 2); }
+
+	int			stride;
+};
+
+// Plane indices of the 3x3 nodes from (x, y) to (x + 2, y + 2)
+template <class Access>
+struct Stencil
+{
+	Stencil(const Access & access, int x, int y)
+	{
+		for (int i=0; i<3; i++)
+		{
+			ox[i] = access.OffsetX(x + i);
+			oy[i] = access.OffsetY(y + i);
+		}
+	}
+
+	int			operator () (int i, int j) const { return ox[i] + oy[j]; }
+
+	int			ox[3];
+	int			oy[3];
+};
+
+#endif // HH_MPM_GRID_HH
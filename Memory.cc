@@ -0,0 +1,104 @@
+/*
+Copyright (c) 2012 Chris Lentini
+http://divergentcoder.com
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of 
+this software and associated documentation files (the "Software"), to deal in 
+the Software without restriction, including without limitation the rights to use, 
+copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the 
+Software, and to permit persons to whom the Software is furnished to do so, 
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all 
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS 
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR 
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER 
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN 
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+
+#include <algorithm>
+#include "Memory.h"
+
+static const char * gTagNames[MEMORY_TAG_COUNT] =
+{
+	"grid",
+	"fluid_grids",
+	"particles",
+	"weights",
+	"scratch",
+	"index",
+	"pressure",
+	"distance_field",
+	"obstacles",
+	"mapped",
+	"objects"
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// ------------------------------- MemoryStats -------------------------------- 
+//
+///////////////////////////////////////////////////////////////////////////////
+MemoryStats::MemoryStats()
+:	PeakTotal(0)
+{
+	for (int i=0; i<MEMORY_TAG_COUNT; i++)
+		Peak[i] = 0;
+	Clear();
+}
+///////////////////////////////////////////////////////////////////////////////
+void MemoryStats::Clear()
+{
+	for (int i=0; i<MEMORY_TAG_COUNT; i++)
+	{
+		Used[i] = 0;
+		Reserved[i] = 0;
+	}
+}
+///////////////////////////////////////////////////////////////////////////////
+void MemoryStats::Add(MemoryTag tag, size_t used, size_t reserved)
+{
+	Used[tag] += used;
+	Reserved[tag] += reserved;
+}
+///////////////////////////////////////////////////////////////////////////////
+void MemoryStats::UpdatePeaks(const size_t * transient)
+{
+	size_t total = 0;
+	for (int i=0; i<MEMORY_TAG_COUNT; i++)
+	{
+		size_t bytes = Reserved[i];
+		if (transient)
+			bytes = std::max(bytes, transient[i]);
+		Peak[i] = std::max(Peak[i], bytes);
+		total += bytes;
+	}
+	PeakTotal = std::max(PeakTotal, total);
+}
+///////////////////////////////////////////////////////////////////////////////
+size_t MemoryStats::GetUsed() const
+{
+	size_t total = 0;
+	for (int i=0; i<MEMORY_TAG_COUNT; i++)
+		total += Used[i];
+	return total;
+}
+///////////////////////////////////////////////////////////////////////////////
+size_t MemoryStats::GetReserved() const
+{
+	size_t total = 0;
+	for (int i=0; i<MEMORY_TAG_COUNT; i++)
+		total += Reserved[i];
+	return total;
+}
+///////////////////////////////////////////////////////////////////////////////
+const char * MemoryStats::GetTagName(int tag)
+{
+	return (tag >= 0 && tag < MEMORY_TAG_COUNT) ? gTagNames[tag] : "unknown";
+}
+///////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,80 @@
+/*
+Copyright (c) 2012 Chris Lentini
+http://divergentcoder.com
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of 
+this software and associated documentation files (the "Software"), to deal in 
+the Software without restriction, including without limitation the rights to use, 
+copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the 
+Software, and to permit persons to whom the Software is furnished to do so, 
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all 
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS 
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR 
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER 
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN 
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+
+#ifndef HH_MPM_MEMORY_HH
+#define HH_MPM_MEMORY_HH
+
+#include <stddef.h>
+#include <vector>
+
+// Subsystems that memory is accounted to
+enum MemoryTag
+{
+	MEMORY_GRID,			// the simulation's shared grid
+	MEMORY_FLUID_GRIDS,		// each fluid's velocity grid
+	MEMORY_PARTICLES,
+	MEMORY_WEIGHTS,			// per-particle interpolation weights
+	MEMORY_SCRATCH,			// per-particle query and force buffers
+	MEMORY_INDEX,			// the cell index of particles
+	MEMORY_PRESSURE,		// the pressure solver's levels and walls
+	MEMORY_DISTANCE_FIELD,	// the boundary's heap storage
+	MEMORY_OBSTACLES,		// the obstacles' distance fields
+	MEMORY_MAPPED,			// baked distance fields mapped in place
+	MEMORY_OBJECTS,			// the simulation and fluid objects themselves
+
+	MEMORY_TAG_COUNT
+};
+
+// Bytes held per subsystem: 'Used' by live data, 'Reserved' including spare
+// vector capacity and grid padding.  Peaks are of the reserved bytes and are
+// kept across Clear() as whoever owns the stats samples them.
+struct MemoryStats
+{
+	MemoryStats();
+
+	void	Clear();
+	void	Add(MemoryTag tag, size_t used, size_t reserved);
+	template <class T>
+	void	Add(MemoryTag tag, const std::vector<T> & v)
+	{
+		Add(tag, v.size() * sizeof(T), v.capacity() * sizeof(T));
+	}
+
+	// Folds the current figures into the peaks.  'transient' optionally 
+	// gives per tag peaks reached between samples, such as the buffers a 
+	// distance field frees once built; they count towards the total on top 
+	// of everything else held now.
+	void	UpdatePeaks(const size_t * transient = NULL);
+
+	size_t	GetUsed() const;
+	size_t	GetReserved() const;
+
+	static const char * GetTagName(int tag);
+
+	size_t	Used[MEMORY_TAG_COUNT];
+	size_t	Reserved[MEMORY_TAG_COUNT];
+	size_t	Peak[MEMORY_TAG_COUNT];
+	size_t	PeakTotal;				// largest total seen at one time
+};
+
+#endif // HH_MPM_MEMORY_HH
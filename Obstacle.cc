@@ -0,0 +1,120 @@
+/*
+Copyright (c) 2012 Chris Lentini
+http://divergentcoder.com
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of 
+this software and associated documentation files (the "Software"), to deal in 
+the Software without restriction, including without limitation the rights to use, 
+copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the 
+Software, and to permit persons to whom the Software is furnished to do so, 
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all 
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS 
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR 
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER 
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN 
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+
+#include <algorithm>
+#include <math.h>
+#include "Obstacle.h"
+
+#define PI 3.1415926535897932384626433832795f
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// -------------------------------- Obstacle ---------------------------------- 
+//
+///////////////////////////////////////////////////////////////////////////////
+Obstacle::Obstacle(int resolution, float w, float h)
+:	PivotX(w * 0.5f),
+	PivotY(h * 0.5f),
+	X(0.f),
+	Y(0.f),
+	Angle(0.f),
+	VX(0.f),
+	VY(0.f),
+	Spin(0.f),
+	fWidth(w),
+	fHeight(h)
+{
+	// Keep the texels square, and the border empty so the edge of the local
+	// field doesn't read as solid
+	int yres = std::max(1, (int)(resolution * h / w + 0.5f));
+	Field.Create(resolution, yres, w, h, false);
+	UpdateTransform();
+}
+///////////////////////////////////////////////////////////////////////////////
+Obstacle::~Obstacle()
+{}
+///////////////////////////////////////////////////////////////////////////////
+void Obstacle::MoveTo(float x, float y, float angle)
+{
+	VX = x - X;
+	VY = y - Y;
+
+	float spin = fmodf(angle - Angle, 2.f * PI);
+	if (spin > PI)
+		spin -= 2.f * PI;
+	else if (spin < -PI)
+		spin += 2.f * PI;
+	Spin = spin;
+}
+///////////////////////////////////////////////////////////////////////////////
+void Obstacle::Advance()
+{
+	X += VX;
+	Y += VY;
+	Angle += Spin;
+	UpdateTransform();
+}
+///////////////////////////////////////////////////////////////////////////////
+void Obstacle::ToLocal(float x, float y, float * lx, float * ly) const
+{
+	float dx = x - X;
+	float dy = y - Y;
+	*lx = fCos * dx + fSin * dy + PivotX;
+	*ly = -fSin * dx + fCos * dy + PivotY;
+}
+///////////////////////////////////////////////////////////////////////////////
+void Obstacle::ToWorldDir(float lx, float ly, float * wx, float * wy) const
+{
+	*wx = fCos * lx - fSin * ly;
+	*wy = fSin * lx + fCos * ly;
+}
+///////////////////////////////////////////////////////////////////////////////
+void Obstacle::VelocityAt(float x, float y, float * vx, float * vy) const
+{
+	// Linear velocity plus the tangential velocity from spinning about the 
+	// pivot
+	*vx = VX - Spin * (y - Y);
+	*vy = VY + Spin * (x - X);
+}
+///////////////////////////////////////////////////////////////////////////////
+void Obstacle::UpdateTransform()
+{
+	fCos = cosf(Angle);
+	fSin = sinf(Angle);
+
+	float cx[4] = { 0.f, fWidth, 0.f, fWidth };
+	float cy[4] = { 0.f, 0.f, fHeight, fHeight };
+
+	MinX = MinY = 1e30f;
+	MaxX = MaxY = -1e30f;
+	for (int i=0; i<4; i++)
+	{
+		float wx, wy;
+		ToWorldDir(cx[i] - PivotX, cy[i] - PivotY, &wx, &wy);
+		MinX = std::min(MinX, X + wx);
+		MinY = std::min(MinY, Y + wy);
+		MaxX = std::max(MaxX, X + wx);
+		MaxY = std::max(MaxY, Y + wy);
+	}
+}
+///////////////////////////////////////////////////////////////////////////////
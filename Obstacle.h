@@ -0,0 +1,84 @@
+/*
+Copyright (c) 2012 Chris Lentini
+http://divergentcoder.com
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of 
+this software and associated documentation files (the "Software"), to deal in 
+the Software without restriction, including without limitation the rights to use, 
+copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the 
+Software, and to permit persons to whom the Software is furnished to do so, 
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all 
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS 
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR 
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER 
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN 
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+
+#ifndef HH_MPM_OBSTACLE_HH
+#define HH_MPM_OBSTACLE_HH
+
+#include "DistanceField.h"
+
+// A rigid body that moves through the simulation without touching the static
+// collision field.  Its shape lives in a local distance field covering 
+// [0,w] x [0,h] which is sampled through the body's current transform.
+class Obstacle
+{
+public:
+	Obstacle(int resolution, float w, float h);
+	~Obstacle();
+
+	// Sets the pose to reach by the next step; the linear and angular 
+	// velocity are derived from the change.  VX, VY and Spin persist after
+	// that step, so the body keeps drifting at the same velocity unless 
+	// MoveTo is called again or the velocity is reset every step.
+	void	MoveTo(float x, float y, float angle);
+
+	// Advances the pose by the current velocity, called once per step
+	void	Advance();
+
+	bool	Contains(float x, float y) const
+	{
+		return x >= MinX && x <= MaxX && y >= MinY && y <= MaxY;
+	}
+
+	void	ToLocal(float x, float y, float * lx, float * ly) const;
+	void	ToWorldDir(float lx, float ly, float * wx, float * wy) const;
+	void	VelocityAt(float x, float y, float * vx, float * vy) const;
+
+	DistanceField	Field;		// empty on creation - add shapes to it
+
+	float	PivotX;				// local point the body rotates about
+	float	PivotY;
+	float	X;					// world position of the pivot
+	float	Y;
+	float	Angle;				// rotation in radians
+	float	VX;					// velocity per step
+	float	VY;
+	float	Spin;				// angular velocity in radians per step
+
+	float	MinX;				// world bounds of the local field
+	float	MinY;
+	float	MaxX;
+	float	MaxY;
+
+private:
+	Obstacle(const Obstacle &);
+	Obstacle & operator = (const Obstacle &);
+
+	void	UpdateTransform();
+
+	float	fWidth;
+	float	fHeight;
+	float	fCos;
+	float	fSin;
+};
+
+#endif // HH_MPM_OBSTACLE_HH
@@ -0,0 +1,165 @@
+/*
+Copyright (c) 2012 Chris Lentini
+http://divergentcoder.com
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of 
+this software and associated documentation files (the "Software"), to deal in 
+the Software without restriction, including without limitation the rights to use, 
+copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the 
+Software, and to permit persons to whom the Software is furnished to do so, 
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all 
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS 
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR 
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER 
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN 
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+
+#include <algorithm>
+#include <math.h>
+#include "Util.h"
+#include "Fluid.h"
+#include "ThreadPool.h"
+#include "ParticleRenderer.h"
+#include "Profiler.h"
+
+#define TILE_SIZE 64
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// ---------------------------- ParticleRenderer ------------------------------
+//
+///////////////////////////////////////////////////////////////////////////////
+ParticleRenderer::ParticleRenderer(ThreadPool * threadpool)
+:	pool(threadpool),
+	pPixels(NULL),
+	nWidth(0),
+	nHeight(0),
+	nTilesX(0),
+	nTilesY(0)
+{}
+///////////////////////////////////////////////////////////////////////////////
+ParticleRenderer::~ParticleRenderer()
+{}
+///////////////////////////////////////////////////////////////////////////////
+void ParticleRenderer::Render(const FluidSim * sim, int32_t * pixels, 
+	int width, int height)
+{
+	PROFILE_SCOPE("ParticleRender");
+	sprites.resize(sim->ParticleCount());
+
+	int n = 0;
+	for (int f=0, flim=sim->Fluids.size(); f<flim; f++)
+	{
+		const Fluid * fluid = sim->Fluids[f];
+		for (int i=0, lim=fluid->Particles.size(); i<lim; i++, n++)
+		{
+			const Particle & p = fluid->Particles[i];
+			Sprite & s = sprites[n];
+			s.color = fluid->Color;
+			s.x0 = s.x1 = floor((p.x / sim->GWidth) * width);
+			s.y0 = s.y1 = floor((p.y / sim->GHeight) * height);
+
+			float dx = (p.vx / sim->GWidth) * width;
+			float dy = (p.vy / sim->GHeight) * height;
+			float len = sqrtf(dx*dx + dy*dy);
+			s.dot = (len < 0.5f);
+			if (s.dot)
+				continue;
+
+			dx /= len;
+			dy /= len;
+			s.x1 = floor(s.x0 - dx*std::min(len*4.f, 10.f));
+			s.y1 = floor(s.y0 - dy*std::min(len*4.f, 10.f));
+		}
+	}
+
+	pPixels = pixels;
+	nWidth = width;
+	nHeight = height;
+	Bin(width, height);
+
+	pool->Run(&RenderTile, this, nTilesX * nTilesY);
+}
+///////////////////////////////////////////////////////////////////////////////
+void ParticleRenderer::Bin(int width, int height)
+{
+	nTilesX = (width + TILE_SIZE - 1) / TILE_SIZE;
+	nTilesY = (height + TILE_SIZE - 1) / TILE_SIZE;
+	int tiles = nTilesX * nTilesY;
+
+	// Counting sort of sprites into every tile their bounds overlap; stable,
+	// so each tile sees its sprites in simulation order
+	tileStart.assign(tiles + 1, 0);
+	for (int pass=0; pass<2; pass++)
+	{
+		if (pass == 1)
+		{
+			for (int i=0, sum=0; i<=tiles; i++)
+			{
+				int count = tileStart[i];
+				tileStart[i] = sum;
+				sum += count;
+			}
+			binned.resize(tileStart[tiles]);
+		}
+
+		for (int i=0, lim=sprites.size(); i<lim; i++)
+		{
+			const Sprite & s = sprites[i];
+			int tx0 = std::max(0, (std::min(s.x0, s.x1) - 1) / TILE_SIZE);
+			int ty0 = std::max(0, (std::min(s.y0, s.y1) - 1) / TILE_SIZE);
+			int tx1 = std::min(nTilesX - 1, (std::max(s.x0, s.x1) + 1) / TILE_SIZE);
+			int ty1 = std::min(nTilesY - 1, (std::max(s.y0, s.y1) + 1) / TILE_SIZE);
+
+			for (int ty=ty0; ty<=ty1; ty++)
+			{
+				for (int tx=tx0; tx<=tx1; tx++)
+				{
+					if (pass == 0)
+						tileStart[ty * nTilesX + tx]++;
+					else
+						binned[tileStart[ty * nTilesX + tx]++] = i;
+				}
+			}
+		}
+	}
+
+	// The fill pass advanced each start to the next tile's; shift them back
+	for (int i=tiles; i>0; i--)
+		tileStart[i] = tileStart[i - 1];
+	tileStart[0] = 0;
+}
+///////////////////////////////////////////////////////////////////////////////
+void ParticleRenderer::RenderTile(void * data, int tile)
+{
+	PROFILE_SCOPE("RenderTile");
+	ParticleRenderer * r = (ParticleRenderer *) data;
+
+	int x0 = (tile % r->nTilesX) * TILE_SIZE;
+	int y0 = (tile / r->nTilesX) * TILE_SIZE;
+	int x1 = x0 + TILE_SIZE;
+	int y1 = y0 + TILE_SIZE;
+
+	for (int i=r->tileStart[tile], lim=r->tileStart[tile + 1]; i<lim; i++)
+	{
+		const Sprite & s = r->sprites[r->binned[i]];
+		if (s.dot)
+		{
+			DrawCircle(r->pPixels, r->nWidth, r->nHeight, s.x0, s.y0, 1, 
+				s.color, x0, y0, x1, y1);
+		}
+		else
+		{
+			DrawLine(r->pPixels, r->nWidth, r->nHeight, s.x0, s.y0, s.x1, 
+				s.y1, s.color, x0, y0, x1, y1);
+		}
+	}
+}
+///////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,72 @@
+/*
+Copyright (c) 2012 Chris Lentini
+http://divergentcoder.com
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of 
+this software and associated documentation files (the "Software"), to deal in 
+the Software without restriction, including without limitation the rights to use, 
+copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the 
+Software, and to permit persons to whom the Software is furnished to do so, 
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all 
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS 
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR 
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER 
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN 
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+
+#ifndef HH_MPM_PARTICLERENDERER_HH
+#define HH_MPM_PARTICLERENDERER_HH
+
+#include <stdint.h>
+#include <vector>
+
+class FluidSim;
+class ThreadPool;
+
+// Draws the particles of every fluid as dots or velocity streaks.  Particles
+// are projected and binned into screen tiles first, then the tiles are 
+// rasterized in parallel; each tile draws its particles in simulation order 
+// so the image matches a serial render.
+class ParticleRenderer
+{
+public:
+	explicit ParticleRenderer(ThreadPool * pool);
+	~ParticleRenderer();
+
+	void	Render(const FluidSim * sim, int32_t * pixels, int width, int height);
+
+private:
+	ParticleRenderer(const ParticleRenderer &);
+	ParticleRenderer & operator = (const ParticleRenderer &);
+
+	// A projected particle, drawn as a dot or a streak back to (x1, y1)
+	struct Sprite
+	{
+		int		x0, y0;
+		int		x1, y1;
+		int		color;
+		bool	dot;
+	};
+
+	static void RenderTile(void * data, int tile);
+	void	Bin(int width, int height);
+
+	ThreadPool *			pool;
+	std::vector<Sprite>		sprites;
+	std::vector<int>		tileStart;		// first entry of each tile in binned
+	std::vector<int>		binned;			// sprite indices sorted by tile
+	int32_t *				pPixels;
+	int						nWidth;
+	int						nHeight;
+	int						nTilesX;
+	int						nTilesY;
+};
+
+#endif // HH_MPM_PARTICLERENDERER_HH
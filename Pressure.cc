@@ -0,0 +1,571 @@
+/*
+Copyright (c) 2012 Chris Lentini
+http://divergentcoder.com
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of 
+this software and associated documentation files (the "Software"), to deal in 
+the Software without restriction, including without limitation the rights to use, 
+copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the 
+Software, and to permit persons to whom the Software is furnished to do so, 
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all 
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS 
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR 
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER 
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN 
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+
+#include <algorithm>
+#include <math.h>
+#include "Pressure.h"
+#include "ThreadPool.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Levels are added while both sides of the last one are longer than this
+#define MIN_LEVEL_SIZE	8
+
+// Jacobi sweeps before and after each coarse correction, and on the 
+// coarsest level in place of an exact solve
+#define SMOOTH_SWEEPS	2
+#define COARSE_SWEEPS	16
+
+// Damping keeps every sweep a contraction, which the V-cycle needs to stay 
+// positive definite as a preconditioner
+#define JACOBI_WEIGHT	0.8f
+
+///////////////////////////////////////////////////////////////////////////////
+// Writes mask * (b - A x) over [begin, end) of a row, or mask * A x when 'b'
+// is NULL, where A x is diag * x less the four neighbours
+static void StencilRow(const float * x, const float * b, const float * mask, 
+	const float * diag, float * out, int begin, int end, int stride)
+{
+	int i = begin;
+
+#if defined(__SSE2__)
+	if (b)
+	{
+		for (; i+4<=end; i+=4)
+		{
+			__m128 n = _mm_add_ps(
+				_mm_add_ps(_mm_loadu_ps(x + i - 1), _mm_loadu_ps(x + i + 1)),
+				_mm_add_ps(_mm_loadu_ps(x + i - stride), 
+					_mm_loadu_ps(x + i + stride)));
+			__m128 ax = _mm_sub_ps(
+				_mm_mul_ps(_mm_loadu_ps(diag + i), _mm_loadu_ps(x + i)), n);
+			_mm_storeu_ps(out + i, _mm_mul_ps(_mm_loadu_ps(mask + i), 
+				_mm_sub_ps(_mm_loadu_ps(b + i), ax)));
+		}
+	}
+	else
+	{
+		for (; i+4<=end; i+=4)
+		{
+			__m128 n = _mm_add_ps(
+				_mm_add_ps(_mm_loadu_ps(x + i - 1), _mm_loadu_ps(x + i + 1)),
+				_mm_add_ps(_mm_loadu_ps(x + i - stride), 
+					_mm_loadu_ps(x + i + stride)));
+			__m128 ax = _mm_sub_ps(
+				_mm_mul_ps(_mm_loadu_ps(diag + i), _mm_loadu_ps(x + i)), n);
+			_mm_storeu_ps(out + i, _mm_mul_ps(_mm_loadu_ps(mask + i), ax));
+		}
+	}
+#endif
+
+	for (; i<end; i++)
+	{
+		float ax = diag[i] * x[i] - 
+			((x[i - 1] + x[i + 1]) + (x[i - stride] + x[i + stride]));
+		out[i] = mask[i] * (b ? b[i] - ax : ax);
+	}
+}
+///////////////////////////////////////////////////////////////////////////////
+// One damped Jacobi sweep over [begin, end) of a row, writing x plus
+// inv * (b - A x) to 'out'; 'inv' is zero off fluid nodes, leaving them be
+static void JacobiRow(const float * x, const float * b, const float * diag, 
+	const float * inv, float * out, int begin, int end, int stride)
+{
+	int i = begin;
+
+#if defined(__SSE2__)
+	for (; i+4<=end; i+=4)
+	{
+		__m128 c = _mm_loadu_ps(x + i);
+		__m128 n = _mm_add_ps(
+			_mm_add_ps(_mm_loadu_ps(x + i - 1), _mm_loadu_ps(x + i + 1)),
+			_mm_add_ps(_mm_loadu_ps(x + i - stride), 
+				_mm_loadu_ps(x + i + stride)));
+		__m128 ax = _mm_sub_ps(_mm_mul_ps(_mm_loadu_ps(diag + i), c), n);
+		_mm_storeu_ps(out + i, _mm_add_ps(c, _mm_mul_ps(_mm_loadu_ps(inv + i),
+			_mm_sub_ps(_mm_loadu_ps(b + i), ax))));
+	}
+#endif
+
+	for (; i<end; i++)
+	{
+		float ax = diag[i] * x[i] - 
+			((x[i - 1] + x[i + 1]) + (x[i - stride] + x[i + stride]));
+		out[i] = x[i] + inv[i] * (b[i] - ax);
+	}
+}
+///////////////////////////////////////////////////////////////////////////////
+//
+// ----------------------------- PressureSolver ------------------------------- 
+//
+///////////////////////////////////////////////////////////////////////////////
+PressureSolver::PressureSolver()
+:	pThreads(NULL),
+	nChunk(0),
+	pDotA(NULL),
+	pDotB(NULL),
+	fAlpha(0.f),
+	fBeta(0.f),
+	nWidth(0),
+	nHeight(0),
+	nStride(0),
+	nIterations(0),
+	fResidual(0.f)
+{}
+///////////////////////////////////////////////////////////////////////////////
+PressureSolver::~PressureSolver()
+{}
+///////////////////////////////////////////////////////////////////////////////
+void PressureSolver::Create(int width, int height)
+{
+	if (width == nWidth && height == nHeight)
+		return;
+
+	nWidth = width;
+	nHeight = height;
+	nStride = (width + 3) & ~3;
+
+	levels.clear();
+	int w = width, h = height;
+	while (true)
+	{
+		Level level;
+		level.width = w;
+		level.height = h;
+		level.stride = (w + 3) & ~3;
+
+		int count = level.stride * h;
+		level.node.assign(count, PRESSURE_SOLID);
+		level.mask.assign(count, 0.f);
+		level.diag.assign(count, 0.f);
+		level.inv.assign(count, 0.f);
+		level.x.assign(count, 0.f);
+		level.b.assign(count, 0.f);
+		level.r.assign(count, 0.f);
+		levels.push_back(level);
+
+		if (w <= MIN_LEVEL_SIZE || h <= MIN_LEVEL_SIZE)
+			break;
+		w = (w + 1) / 2;
+		h = (h + 1) / 2;
+	}
+
+	int count = nStride * height;
+	cgB.assign(count, 0.f);
+	cgX.assign(count, 0.f);
+	cgP.assign(count, 0.f);
+	cgQ.assign(count, 0.f);
+	rowSums.assign(height, 0.f);
+}
+///////////////////////////////////////////////////////////////////////////////
+int PressureSolver::Solve(ThreadPool * threads, int chunk, int iterations, 
+	float tolerance)
+{
+	pThreads = threads;
+	nChunk = chunk;
+	nIterations = 0;
+	fResidual = 0.f;
+
+	// Coarser rings are never written, so only the finest needs sealing
+	unsigned char * node = &levels[0].node[0];
+	for (int x=0; x<nWidth; x++)
+	{
+		node[x] = PRESSURE_SOLID;
+		node[(nHeight - 1) * nStride + x] = PRESSURE_SOLID;
+	}
+	for (int y=0; y<nHeight; y++)
+	{
+		node[y * nStride] = PRESSURE_SOLID;
+		node[y * nStride + nWidth - 1] = PRESSURE_SOLID;
+	}
+
+	for (int i=0, lim=levels.size(); i<lim; i++)
+	{
+		if (i > 0)
+			ParallelRows(&PressureSolver::CoarsenRows, i);
+		ParallelRows(&PressureSolver::SetupRows, i);
+	}
+
+	// The residual starts as the right hand side, with the pressure at zero
+	Level & fine = levels[0];
+	ParallelRows(&PressureSolver::StartRows, 0);
+	float bmax = MaxAbs(&fine.b[0]);
+	if (bmax == 0.f)
+		return 0;
+
+	VCycle(0);
+	cgP = fine.x;
+	float rz = Dot(&fine.b[0], &fine.x[0]);
+	float residual = 1.f;
+
+	while (nIterations < iterations)
+	{
+		ParallelRows(&PressureSolver::ApplyRows, 0);
+		float pq = Dot(&cgP[0], &cgQ[0]);
+		if (pq <= 0.f)
+			break;
+
+		fAlpha = rz / pq;
+		ParallelRows(&PressureSolver::UpdateRows, 0);
+		nIterations++;
+
+		residual = MaxAbs(&fine.b[0]) / bmax;
+		if (residual <= tolerance)
+			break;
+
+		VCycle(0);
+		float next = Dot(&fine.b[0], &fine.x[0]);
+		fBeta = next / rz;
+		rz = next;
+		ParallelRows(&PressureSolver::DirectionRows, 0);
+	}
+
+	fResidual = residual;
+	return nIterations;
+}
+///////////////////////////////////////////////////////////////////////////////
+void PressureSolver::CountMemory(MemoryStats & stats, MemoryTag tag) const
+{
+	for (int i=0, lim=levels.size(); i<lim; i++)
+	{
+		const Level & level = levels[i];
+		stats.Add(tag, level.node);
+		stats.Add(tag, level.mask);
+		stats.Add(tag, level.diag);
+		stats.Add(tag, level.inv);
+		stats.Add(tag, level.x);
+		stats.Add(tag, level.b);
+		stats.Add(tag, level.r);
+	}
+	stats.Add(tag, levels);
+	stats.Add(tag, cgB);
+	stats.Add(tag, cgX);
+	stats.Add(tag, cgP);
+	stats.Add(tag, cgQ);
+	stats.Add(tag, rowSums);
+}
+///////////////////////////////////////////////////////////////////////////////
+void PressureSolver::ParallelRows(RowFn fn, int level)
+{
+	RowTask task;
+	task.solver = this;
+	task.fn = fn;
+	task.level = level;
+	task.rows = levels[level].height;
+	task.chunk = std::max(1, nChunk / levels[level].stride);
+
+	int chunks = (task.rows + task.chunk - 1) / task.chunk;
+	if (pThreads && chunks > 1)
+	{
+		pThreads->Run(&RunRows, &task, chunks);
+	}
+	else
+	{
+		for (int i=0; i<chunks; i++)
+			RunRows(&task, i);
+	}
+}
+///////////////////////////////////////////////////////////////////////////////
+void PressureSolver::RunRows(void * data, int index)
+{
+	const RowTask * task = (const RowTask *) data;
+	const Level & level = task->solver->levels[task->level];
+
+	// Only interior rows are ever worked on; the ring stays as it was made
+	int begin = std::max(1, index * task->chunk);
+	int end = std::min(level.height - 1, (index + 1) * task->chunk);
+	if (begin < end)
+		(task->solver->*task->fn)(task->level, begin, end);
+}
+///////////////////////////////////////////////////////////////////////////////
+void PressureSolver::VCycle(int level)
+{
+	Level & l = levels[level];
+	std::fill(l.x.begin(), l.x.end(), 0.f);
+
+	if (level + 1 == (int) levels.size())
+	{
+		Smooth(level, COARSE_SWEEPS);
+		return;
+	}
+
+	Smooth(level, SMOOTH_SWEEPS);
+	ParallelRows(&PressureSolver::ResidualRows, level);
+	ParallelRows(&PressureSolver::RestrictRows, level + 1);
+	VCycle(level + 1);
+	ParallelRows(&PressureSolver::ProlongRows, level);
+	Smooth(level, SMOOTH_SWEEPS);
+}
+///////////////////////////////////////////////////////////////////////////////
+void PressureSolver::Smooth(int level, int sweeps)
+{
+	// Each sweep writes the new values into r, which is free until the 
+	// next residual, and the two swap places
+	Level & l = levels[level];
+	for (int i=0; i<sweeps; i++)
+	{
+		ParallelRows(&PressureSolver::SmoothRows, level);
+		l.x.swap(l.r);
+	}
+}
+///////////////////////////////////////////////////////////////////////////////
+float PressureSolver::Dot(const float * a, const float * b)
+{
+	pDotA = a;
+	pDotB = b;
+	ParallelRows(&PressureSolver::DotRows, 0);
+
+	double sum = 0.0;
+	for (int y=1; y<nHeight-1; y++)
+		sum += rowSums[y];
+	return (float) sum;
+}
+///////////////////////////////////////////////////////////////////////////////
+float PressureSolver::MaxAbs(const float * a)
+{
+	pDotA = a;
+	ParallelRows(&PressureSolver::MaxRows, 0);
+
+	float largest = 0.f;
+	for (int y=1; y<nHeight-1; y++)
+		largest = std::max(largest, rowSums[y]);
+	return largest;
+}
+///////////////////////////////////////////////////////////////////////////////
+void PressureSolver::SetupRows(int level, int begin, int end)
+{
+	Level & l = levels[level];
+	int s = l.stride;
+	for (int y=begin; y<end; y++)
+	{
+		for (int x=1, i=y*s+1; x<l.width-1; x++, i++)
+		{
+			// Solid neighbours drop out of the stencil, air ones stay in 
+			// at zero pressure
+			float diag = 0.f;
+			if (l.node[i] == PRESSURE_FLUID)
+			{
+				diag = (float)((l.node[i - 1] != PRESSURE_SOLID) + 
+					(l.node[i + 1] != PRESSURE_SOLID) + 
+					(l.node[i - s] != PRESSURE_SOLID) + 
+					(l.node[i + s] != PRESSURE_SOLID));
+			}
+
+			// Fluid walled in on every side has nothing to push against
+			l.mask[i] = diag > 0.f ? 1.f : 0.f;
+			l.diag[i] = diag;
+			l.inv[i] = diag > 0.f ? JACOBI_WEIGHT / diag : 0.f;
+		}
+	}
+}
+///////////////////////////////////////////////////////////////////////////////
+void PressureSolver::CoarsenRows(int level, int begin, int end)
+{
+	const Level & f = levels[level - 1];
+	Level & c = levels[level];
+	for (int y=begin; y<end; y++)
+	{
+		for (int x=1; x<c.width-1; x++)
+		{
+			int i = (2 * y) * f.stride + 2 * x;
+			unsigned char a = f.node[i];
+			unsigned char b = f.node[i + 1];
+			unsigned char d = f.node[i + f.stride];
+			unsigned char e = f.node[i + f.stride + 1];
+
+			unsigned char node = PRESSURE_SOLID;
+			if (a == PRESSURE_AIR || b == PRESSURE_AIR || 
+				d == PRESSURE_AIR || e == PRESSURE_AIR)
+			{
+				node = PRESSURE_AIR;
+			}
+			else if (a == PRESSURE_FLUID || b == PRESSURE_FLUID || 
+				d == PRESSURE_FLUID || e == PRESSURE_FLUID)
+			{
+				node = PRESSURE_FLUID;
+			}
+			c.node[y * c.stride + x] = node;
+		}
+	}
+}
+///////////////////////////////////////////////////////////////////////////////
+void PressureSolver::ResidualRows(int level, int begin, int end)
+{
+	Level & l = levels[level];
+	for (int y=begin; y<end; y++)
+	{
+		int row = y * l.stride;
+		StencilRow(&l.x[0], &l.b[0], &l.mask[0], &l.diag[0], &l.r[0], 
+			row + 1, row + l.width - 1, l.stride);
+	}
+}
+///////////////////////////////////////////////////////////////////////////////
+void PressureSolver::SmoothRows(int level, int begin, int end)
+{
+	Level & l = levels[level];
+	for (int y=begin; y<end; y++)
+	{
+		int row = y * l.stride;
+		JacobiRow(&l.x[0], &l.b[0], &l.diag[0], &l.inv[0], &l.r[0], 
+			row + 1, row + l.width - 1, l.stride);
+	}
+}
+///////////////////////////////////////////////////////////////////////////////
+void PressureSolver::RestrictRows(int level, int begin, int end)
+{
+	// Summing rather than averaging the residual matches the coarse stencil,
+	// which is unscaled although its spacing is twice the finer one's
+	const Level & f = levels[level - 1];
+	Level & c = levels[level];
+	for (int y=begin; y<end; y++)
+	{
+		for (int x=1; x<c.width-1; x++)
+		{
+			int i = (2 * y) * f.stride + 2 * x;
+			int o = y * c.stride + x;
+			c.b[o] = c.mask[o] * ((f.r[i] + f.r[i + 1]) + 
+				(f.r[i + f.stride] + f.r[i + f.stride + 1]));
+		}
+	}
+}
+///////////////////////////////////////////////////////////////////////////////
+void PressureSolver::ProlongRows(int level, int begin, int end)
+{
+	Level & f = levels[level];
+	const Level & c = levels[level + 1];
+	for (int y=begin; y<end; y++)
+	{
+		const float * coarse = &c.x[(y >> 1) * c.stride];
+		for (int x=1, i=y*f.stride+1; x<f.width-1; x++, i++)
+			f.x[i] += f.mask[i] * coarse[x >> 1];
+	}
+}
+///////////////////////////////////////////////////////////////////////////////
+void PressureSolver::StartRows(int level, int begin, int end)
+{
+	Level & l = levels[level];
+	for (int y=begin; y<end; y++)
+	{
+		for (int i=y*l.stride+1, lim=y*l.stride+l.width-1; i<lim; i++)
+		{
+			l.b[i] = l.mask[i] * cgB[i];
+			cgX[i] = 0.f;
+		}
+	}
+}
+///////////////////////////////////////////////////////////////////////////////
+void PressureSolver::ApplyRows(int level, int begin, int end)
+{
+	Level & l = levels[level];
+	for (int y=begin; y<end; y++)
+	{
+		int row = y * l.stride;
+		StencilRow(&cgP[0], NULL, &l.mask[0], &l.diag[0], &cgQ[0], 
+			row + 1, row + l.width - 1, l.stride);
+	}
+}
+///////////////////////////////////////////////////////////////////////////////
+void PressureSolver::DotRows(int level, int begin, int end)
+{
+	const Level & l = levels[level];
+	for (int y=begin; y<end; y++)
+	{
+		int i = y * l.stride + 1;
+		int lim = y * l.stride + l.width - 1;
+		float sum = 0.f;
+
+#if defined(__SSE2__)
+		__m128 acc = _mm_setzero_ps();
+		for (; i+4<=lim; i+=4)
+		{
+			acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(pDotA + i), 
+				_mm_loadu_ps(pDotB + i)));
+		}
+		float lanes[4];
+		_mm_storeu_ps(lanes, acc);
+		sum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+#endif
+
+		for (; i<lim; i++)
+			sum += pDotA[i] * pDotB[i];
+		rowSums[y] = sum;
+	}
+}
+///////////////////////////////////////////////////////////////////////////////
+void PressureSolver::MaxRows(int level, int begin, int end)
+{
+	const Level & l = levels[level];
+	for (int y=begin; y<end; y++)
+	{
+		int i = y * l.stride + 1;
+		int lim = y * l.stride + l.width - 1;
+		float largest = 0.f;
+
+#if defined(__SSE2__)
+		// Clearing the sign bit gives the magnitude without a branch
+		const __m128 magnitude = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+		__m128 acc = _mm_setzero_ps();
+		for (; i+4<=lim; i+=4)
+		{
+			acc = _mm_max_ps(acc, 
+				_mm_and_ps(_mm_loadu_ps(pDotA + i), magnitude));
+		}
+		float lanes[4];
+		_mm_storeu_ps(lanes, acc);
+		largest = std::max(std::max(lanes[0], lanes[1]), 
+			std::max(lanes[2], lanes[3]));
+#endif
+
+		for (; i<lim; i++)
+			largest = std::max(largest, fabsf(pDotA[i]));
+		rowSums[y] = largest;
+	}
+}
+///////////////////////////////////////////////////////////////////////////////
+void PressureSolver::UpdateRows(int level, int begin, int end)
+{
+	Level & l = levels[level];
+	float * r = &l.b[0];
+	for (int y=begin; y<end; y++)
+	{
+		for (int i=y*l.stride+1, lim=y*l.stride+l.width-1; i<lim; i++)
+		{
+			cgX[i] += fAlpha * cgP[i];
+			r[i] -= fAlpha * cgQ[i];
+		}
+	}
+}
+///////////////////////////////////////////////////////////////////////////////
+void PressureSolver::DirectionRows(int level, int begin, int end)
+{
+	const Level & l = levels[level];
+	const float * z = &l.x[0];
+	for (int y=begin; y<end; y++)
+	{
+		for (int i=y*l.stride+1, lim=y*l.stride+l.width-1; i<lim; i++)
+			cgP[i] = z[i] + fBeta * cgP[i];
+	}
+}
+///////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,160 @@
+/*
+Copyright (c) 2012 Chris Lentini
+http://divergentcoder.com
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of 
+this software and associated documentation files (the "Software"), to deal in 
+the Software without restriction, including without limitation the rights to use, 
+copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the 
+Software, and to permit persons to whom the Software is furnished to do so, 
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all 
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS 
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR 
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER 
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN 
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+
+#ifndef HH_MPM_PRESSURE_HH
+#define HH_MPM_PRESSURE_HH
+
+#include <vector>
+#include "Memory.h"
+
+class ThreadPool;
+
+// Kinds of grid node in the pressure solve
+enum PressureNode
+{
+	PRESSURE_AIR,		// free surface, pressure held at zero
+	PRESSURE_FLUID,		// unknown
+	PRESSURE_SOLID		// no flow across, pressure mirrors its neighbours
+};
+
+// Solves the 5-point Poisson problem of a pressure projection on a grid of
+// nodes, by conjugate gradients preconditioned with a multigrid V-cycle.
+// Coarser levels merge 2x2 blocks of nodes - air wins over fluid, and fluid
+// over solid - and the residual of a block is summed down and its 
+// correction copied back up.  Smoothing is damped Jacobi, so each level is
+// swept row by row in parallel, and with the same number of sweeps before 
+// and after the coarse correction the V-cycle stays symmetric as CG needs.
+// Dot products are summed per row and then in row order, so results don't
+// depend on the thread count or the rows per task.
+class PressureSolver
+{
+public:
+	PressureSolver();
+	~PressureSolver();
+
+	// Sizes the finest level to 'width' x 'height' nodes, keeping the 
+	// storage when the size is unchanged
+	void	Create(int width, int height);
+
+	// Row-major arrays of the finest level with GetStride() entries per row.
+	// The caller fills in the node kinds and the right hand side before 
+	// Solve(); the outermost ring of nodes is always treated as solid.
+	unsigned char *	GetNodes() { return &levels[0].node[0]; }
+	float *			GetRHS() { return &cgB[0]; }
+	const float *	GetPressure() const { return &cgX[0]; }
+
+	// Solves for the pressure, zero away from fluid nodes, until the largest
+	// residual drops below 'tolerance' times the largest right hand side or
+	// 'iterations' have run.  Rows are split into tasks of about 'chunk' 
+	// nodes on 'threads' when given.  Returns the iterations taken.
+	int		Solve(ThreadPool * threads, int chunk, int iterations, 
+				float tolerance);
+
+	int		GetWidth() const { return nWidth; }
+	int		GetHeight() const { return nHeight; }
+	int		GetStride() const { return nStride; }
+	int		GetLevelCount() const { return levels.size(); }
+
+	// Of the last Solve(), the residual relative to the right hand side
+	int		GetIterations() const { return nIterations; }
+	float	GetResidual() const { return fResidual; }
+
+	void	CountMemory(MemoryStats & stats, MemoryTag tag) const;
+
+private:
+	PressureSolver(const PressureSolver &);
+	PressureSolver & operator = (const PressureSolver &);
+
+	struct Level
+	{
+		int							width;
+		int							height;
+		int							stride;		// multiple of four
+		std::vector<unsigned char>	node;
+		std::vector<float>			mask;		// 1 at fluid nodes
+		std::vector<float>			diag;		// non-solid neighbours
+		std::vector<float>			inv;		// damped 1/diag, 0 off fluid
+		std::vector<float>			x;			// solution or correction
+		std::vector<float>			b;			// right hand side
+		std::vector<float>			r;			// residual
+	};
+
+	typedef void (PressureSolver::*RowFn)(int level, int begin, int end);
+
+	struct RowTask
+	{
+		PressureSolver *	solver;
+		RowFn				fn;
+		int					level;
+		int					rows;
+		int					chunk;
+	};
+
+	void	ParallelRows(RowFn fn, int level);
+	static void RunRows(void * data, int index);
+
+	void	VCycle(int level);
+	void	Smooth(int level, int sweeps);
+	float	Dot(const float * a, const float * b);
+	float	MaxAbs(const float * a);
+
+	// Row kernels; the vectors and scalars they work on are set in the 
+	// members below before each parallel pass
+	void	SetupRows(int level, int begin, int end);
+	void	CoarsenRows(int level, int begin, int end);
+	void	ResidualRows(int level, int begin, int end);
+	void	SmoothRows(int level, int begin, int end);
+	void	RestrictRows(int level, int begin, int end);
+	void	ProlongRows(int level, int begin, int end);
+	void	ApplyRows(int level, int begin, int end);
+	void	DotRows(int level, int begin, int end);
+	void	MaxRows(int level, int begin, int end);
+	void	StartRows(int level, int begin, int end);
+	void	UpdateRows(int level, int begin, int end);
+	void	DirectionRows(int level, int begin, int end);
+
+	std::vector<Level>	levels;
+
+	// Conjugate gradient vectors on the finest level.  The residual is kept
+	// in the level's b and the V-cycle leaves the preconditioned one in x.
+	std::vector<float>	cgB;
+	std::vector<float>	cgX;
+	std::vector<float>	cgP;		// search direction
+	std::vector<float>	cgQ;		// the operator applied to it
+	std::vector<float>	rowSums;	// per row, summed in order
+
+	ThreadPool *		pThreads;
+	int					nChunk;
+	const float *		pDotA;
+	const float *		pDotB;
+	float				fAlpha;
+	float				fBeta;
+
+	int					nWidth;
+	int					nHeight;
+	int					nStride;
+	int					nIterations;
+	float				fResidual;
+};
+
+#endif // HH_MPM_PRESSURE_HH
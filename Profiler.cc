@@ -0,0 +1,294 @@
+/*
+Copyright (c) 2012 Chris Lentini
+http://divergentcoder.com
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of 
+this software and associated documentation files (the "Software"), to deal in 
+the Software without restriction, including without limitation the rights to use, 
+copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the 
+Software, and to permit persons to whom the Software is furnished to do so, 
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all 
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS 
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR 
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER 
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN 
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <map>
+#include "Profiler.h"
+
+#define RING_SIZE		8192	// events per thread between collects
+#define BUCKETS_PER_OCTAVE 4
+#define BUCKET_COUNT	(40 * BUCKETS_PER_OCTAVE)	// up to ~18 minutes
+#define ROLL_COLLECTS	120		// collects per histogram window
+
+namespace
+{
+	struct Event
+	{
+		const char *	name;
+		int64_t			start;
+		int64_t			end;
+	};
+
+	// Written only by its thread; the count is published after the event
+	struct Ring
+	{
+		Event			events[RING_SIZE];
+		volatile unsigned nWritten;
+		unsigned		nRead;
+		int				nThread;
+	};
+
+	// Two log-scaled windows; percentiles cover the current and the last
+	// one, so a stall shows up for between one and two windows
+	struct Histogram
+	{
+		unsigned		buckets[2][BUCKET_COUNT];
+		int				counts[2];
+		int64_t			calls;		// since the last reset
+		int64_t			total;		// ns
+	};
+
+	struct TraceEvent
+	{
+		const char *	name;
+		int64_t			start;
+		int64_t			end;
+		int				thread;
+	};
+
+	pthread_once_t		gOnce = PTHREAD_ONCE_INIT;
+	pthread_key_t		gKey;
+	pthread_mutex_t		gMutex = PTHREAD_MUTEX_INITIALIZER;
+	std::vector<Ring *>	gRings;			// never freed, threads may outlive us
+
+	std::map<std::string, Histogram>	gHistograms;
+	int					gCollects = 0;
+	int					gWindow = 0;
+
+	std::vector<TraceEvent>	gTrace;
+	bool				gTracing = false;
+	int64_t				gTraceStart = 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+static void CreateKey()
+{
+	pthread_key_create(&gKey, NULL);
+}
+///////////////////////////////////////////////////////////////////////////////
+static Ring * GetRing()
+{
+	pthread_once(&gOnce, &CreateKey);
+	Ring * ring = (Ring *) pthread_getspecific(gKey);
+	if (ring)
+		return ring;
+
+	ring = new Ring;
+	ring->nWritten = 0;
+	ring->nRead = 0;
+
+	pthread_mutex_lock(&gMutex);
+	ring->nThread = gRings.size();
+	gRings.push_back(ring);
+	pthread_mutex_unlock(&gMutex);
+
+	pthread_setspecific(gKey, ring);
+	return ring;
+}
+///////////////////////////////////////////////////////////////////////////////
+static int Bucket(int64_t ns)
+{
+	if (ns < 1)
+		return 0;
+	int bucket = (int)(log2((double) ns) * BUCKETS_PER_OCTAVE);
+	return std::min(bucket, BUCKET_COUNT - 1);
+}
+///////////////////////////////////////////////////////////////////////////////
+static double Percentile(const Histogram & h, double fraction)
+{
+	int total = h.counts[0] + h.counts[1];
+	int target = (int)(fraction * (total - 1));
+	int seen = 0;
+	for (int i=0; i<BUCKET_COUNT; i++)
+	{
+		seen += h.buckets[0][i] + h.buckets[1][i];
+		if (seen > target)
+			return pow(2.0, (i + 0.5) / BUCKETS_PER_OCTAVE) * 1e-6;
+	}
+	return 0.0;
+}
+///////////////////////////////////////////////////////////////////////////////
+//
+// -------------------------------- Profiler ----------------------------------
+//
+///////////////////////////////////////////////////////////////////////////////
+void Profiler::Record(const char * name, int64_t start, int64_t end)
+{
+	Ring * ring = GetRing();
+	Event & e = ring->events[ring->nWritten % RING_SIZE];
+	e.name = name;
+	e.start = start;
+	e.end = end;
+
+	__sync_synchronize();
+	ring->nWritten = ring->nWritten + 1;
+}
+///////////////////////////////////////////////////////////////////////////////
+void Profiler::Collect()
+{
+	if (++gCollects >= ROLL_COLLECTS)
+	{
+		// Start a new window over the oldest one
+		gCollects = 0;
+		gWindow ^= 1;
+		std::map<std::string, Histogram>::iterator it;
+		for (it=gHistograms.begin(); it!=gHistograms.end(); ++it)
+		{
+			memset(it->second.buckets[gWindow], 0, 
+				sizeof(it->second.buckets[gWindow]));
+			it->second.counts[gWindow] = 0;
+		}
+	}
+
+	pthread_mutex_lock(&gMutex);
+	std::vector<Ring *> rings = gRings;
+	pthread_mutex_unlock(&gMutex);
+
+	// Histograms are keyed by string, so repeated lookups of the same name
+	// are cached by pointer for the duration of the drain
+	const char * lastName = NULL;
+	Histogram * last = NULL;
+
+	for (unsigned r=0; r<rings.size(); r++)
+	{
+		Ring * ring = rings[r];
+		unsigned written = ring->nWritten;
+		__sync_synchronize();
+
+		// Anything older than a full ring has been overwritten
+		if (written - ring->nRead > RING_SIZE)
+			ring->nRead = written - RING_SIZE;
+
+		for (; ring->nRead != written; ring->nRead++)
+		{
+			// The thread keeps writing while this drains; once it is a full
+			// ring ahead it may be rewriting the slot just copied
+			Event e = ring->events[ring->nRead % RING_SIZE];
+			__sync_synchronize();
+			if (ring->nWritten - ring->nRead >= RING_SIZE)
+				continue;
+
+			if (e.name != lastName)
+			{
+				std::map<std::string, Histogram>::iterator it = 
+					gHistograms.find(e.name);
+				if (it == gHistograms.end())
+				{
+					Histogram h;
+					memset(&h, 0, sizeof(h));
+					it = gHistograms.insert(std::make_pair(
+						std::string(e.name), h)).first;
+				}
+				lastName = e.name;
+				last = &it->second;
+			}
+
+			last->buckets[gWindow][Bucket(e.end - e.start)]++;
+			last->counts[gWindow]++;
+			last->calls++;
+			last->total += e.end - e.start;
+
+			if (gTracing)
+			{
+				TraceEvent t = { e.name, e.start, e.end, ring->nThread };
+				gTrace.push_back(t);
+			}
+		}
+	}
+}
+///////////////////////////////////////////////////////////////////////////////
+void Profiler::GetStats(std::vector<Stats> & out)
+{
+	out.clear();
+
+	std::map<std::string, Histogram>::const_iterator it;
+	for (it=gHistograms.begin(); it!=gHistograms.end(); ++it)
+	{
+		const Histogram & h = it->second;
+		if (h.calls == 0)
+			continue;
+
+		Stats s;
+		s.name = it->first;
+		s.count = h.counts[0] + h.counts[1];
+		s.p50 = Percentile(h, 0.5);
+		s.p99 = Percentile(h, 0.99);
+		s.calls = h.calls;
+		s.total = h.total * 1e-6;
+		out.push_back(s);
+	}
+}
+///////////////////////////////////////////////////////////////////////////////
+void Profiler::Reset()
+{
+	// Whatever is waiting in the rings belongs to before the reset
+	Collect();
+	gHistograms.clear();
+	gCollects = 0;
+}
+///////////////////////////////////////////////////////////////////////////////
+void Profiler::BeginTrace()
+{
+	// Drain what was recorded before the trace started
+	gTracing = false;
+	Collect();
+
+	gTrace.clear();
+	gTracing = true;
+	gTraceStart = GetTimeNS();
+}
+///////////////////////////////////////////////////////////////////////////////
+bool Profiler::EndTrace(const char * path)
+{
+	if (!gTracing)
+		return false;
+
+	Collect();
+	gTracing = false;
+
+	FILE * file = fopen(path, "w");
+	if (!file)
+		return false;
+
+	// Complete ("X") events with microsecond timestamps
+	fprintf(file, "{\"traceEvents\":[\n");
+	for (unsigned i=0; i<gTrace.size(); i++)
+	{
+		const TraceEvent & t = gTrace[i];
+		fprintf(file, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+			"\"ts\":%.3f,\"dur\":%.3f}\n", i ? "," : "", t.name, t.thread, 
+			(t.start - gTraceStart) * 1e-3, (t.end - t.start) * 1e-3);
+	}
+	fprintf(file, "]}\n");
+
+	gTrace.clear();
+	return fclose(file) == 0;
+}
+///////////////////////////////////////////////////////////////////////////////
+bool Profiler::IsTracing()
+{
+	return gTracing;
+}
+///////////////////////////////////////////////////////////////////////////////
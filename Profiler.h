@@ -0,0 +1,94 @@
+/*
+Copyright (c) 2012 Chris Lentini
+http://divergentcoder.com
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of 
+this software and associated documentation files (the "Software"), to deal in 
+the Software without restriction, including without limitation the rights to use, 
+copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the 
+Software, and to permit persons to whom the Software is furnished to do so, 
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all 
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS 
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR 
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER 
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN 
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+
+#ifndef HH_MPM_PROFILER_HH
+#define HH_MPM_PROFILER_HH
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "Util.h"
+
+// Scoped timers for the hot paths.  Building with FLUID_PROFILE defined makes
+// PROFILE_SCOPE("name") time the rest of the enclosing block; otherwise it 
+// expands to nothing.  Names must be string literals.
+//
+// Each thread appends to its own ring buffer without locking.  Once a frame 
+// the main thread calls Profiler::Collect(), which drains every ring into 
+// rolling per-name histograms and, while a trace is open, into a Chrome 
+// trace-event log (chrome://tracing, Perfetto).
+#ifdef FLUID_PROFILE
+#define PROFILE_JOIN2(a, b) a##b
+#define PROFILE_JOIN(a, b) PROFILE_JOIN2(a, b)
+#define PROFILE_SCOPE(name) ProfileScope PROFILE_JOIN(profile_, __LINE__)(name)
+#else
+#define PROFILE_SCOPE(name)
+#endif
+
+class Profiler
+{
+public:
+	struct Stats
+	{
+		std::string	name;
+		int			count;		// samples in the rolling window
+		double		p50;		// milliseconds
+		double		p99;
+		int64_t		calls;		// since the last Reset()
+		double		total;		// milliseconds since the last Reset()
+	};
+
+	static void	Record(const char * name, int64_t start, int64_t end);
+
+	// Only one thread may collect, reset, and trace or query stats
+	static void	Collect();
+	static void	GetStats(std::vector<Stats> & out);
+	static void	Reset();
+
+	static void	BeginTrace();
+	static bool	EndTrace(const char * path);
+	static bool	IsTracing();
+};
+
+class ProfileScope
+{
+public:
+	explicit ProfileScope(const char * name)
+	:	pName(name),
+		nStart(GetTimeNS())
+	{}
+
+	~ProfileScope()
+	{
+		Profiler::Record(pName, nStart, GetTimeNS());
+	}
+
+private:
+	ProfileScope(const ProfileScope &);
+	ProfileScope & operator = (const ProfileScope &);
+
+	const char *	pName;
+	int64_t			nStart;
+};
+
+#endif // HH_MPM_PROFILER_HH
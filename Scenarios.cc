@@ -0,0 +1,639 @@
+/*
+Copyright (c) 2012 Chris Lentini
+http://divergentcoder.com
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of 
+this software and associated documentation files (the "Software"), to deal in 
+the Software without restriction, including without limitation the rights to use, 
+copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the 
+Software, and to permit persons to whom the Software is furnished to do so, 
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all 
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS 
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR 
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER 
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN 
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+
+// Runs scripted scenes through FluidSim::Update() without a display and 
+// checks where they end up:
+//
+//   fluidscenarios [--update] [--goldens <path>] [--threads <n>] [name filter]
+//
+// Each scenario prints one JSON object with its wall time, steps and 
+// particle steps per second, p50/p99 step latency, peak memory and the time
+// and throughput of each phase.  The final particles are hashed and compared
+// with the golden hash stored for the scenario; any difference, or a 
+// scenario without a golden, is reported and makes the run fail.  --update
+// rewrites the goldens instead, for when a change to the results is 
+// intended or a scenario is added.  Afterwards the particle and grid 
+// queries are checked against brute force, and a mismatch fails the run too.
+//
+// Results don't depend on the thread count, but do on the compiler and 
+// floating point flags; the goldens are for the native SSE2 build.
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+#include "Util.h"
+#include "Fluid.h"
+#include "Scene.h"
+#include "Brush.h"
+#include "Obstacle.h"
+#include "Profiler.h"
+#include "ThreadPool.h"
+
+#ifndef FLUID_PROFILE
+#error Build the scenario runner with FLUID_PROFILE for the phase timings
+#endif
+
+#define GOLDEN_PATH		"scenarios.golden"
+#define BRUSH_STREAM	(RANDOM_STREAM_USER + 0x8000)
+#define QUERY_STREAM	(RANDOM_STREAM_USER + 0x9000)
+// Random queries checked against brute force in each round
+#define QUERY_COUNT		100
+
+// The phases Update() runs, in order
+static const char * gPhases[] =
+{
+	"ClearGrid",
+	"InitGrid",
+	"AverageVelocity",
+	"CalcAccel",
+	"AverageAcceleration",
+	"Project",
+	"CalcVelocity",
+	"UpdateParticles",
+	"BuildIndex"
+};
+
+#define PHASE_COUNT ((int)(sizeof(gPhases) / sizeof(gPhases[0])))
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// -------------------------------- Scenarios ---------------------------------
+//
+///////////////////////////////////////////////////////////////////////////////
+typedef void (*Script)(FluidSim * sim, int step);
+
+struct Scenario
+{
+	const char *	name;
+	const char *	scene;
+	int				steps;
+	Script			script;		// run before each step, may be NULL
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// A brush circling the middle of the tank once every 250 steps
+static void Stir(FluidSim * sim, int step)
+{
+	float angle = step * (2.f * 3.14159265f / 250.f);
+	float cx = sim->GWidth * 0.5f;
+	float cy = sim->GHeight * 0.6f;
+	StirBrush brush(cx + cosf(angle) * 25.f, cy + sinf(angle) * 25.f, 16.f, 0.3f);
+	sim->ApplyBrush(brush, BRUSH_STREAM);
+}
+///////////////////////////////////////////////////////////////////////////////
+// A paddle swept back and forth through the left of the pool every 300 
+// steps, and a four armed mixer on the right.  The mixer is given its spin
+// once and keeps it; the paddle is moved to each pose.
+static void Paddle(FluidSim * sim, int step)
+{
+	if (step == 0)
+	{
+		Obstacle * paddle = new Obstacle(32, 6.f, 26.f);
+		paddle->Field.BeginBatch();
+		for (int i=0; i<5; i++)
+			paddle->Field.AddCircle(3.f, 5.f + i * 4.f, 2.5f);
+		paddle->Field.EndBatch();
+		paddle->X = 35.f;
+		paddle->Y = 100.f;
+		paddle->MoveTo(35.f, 100.f, 0.f);
+		sim->Obstacles.push_back(paddle);
+
+		Obstacle * mixer = new Obstacle(64, 28.f, 28.f);
+		mixer->Field.BeginBatch();
+		mixer->Field.AddCircle(14.f, 14.f, 3.f);
+		for (int i=0; i<4; i++)
+		{
+			float a = i * (3.14159265f * 0.5f);
+			for (int j=1; j<=3; j++)
+			{
+				mixer->Field.AddCircle(14.f + cosf(a) * j * 3.5f, 
+					14.f + sinf(a) * j * 3.5f, 2.f);
+			}
+		}
+		mixer->Field.EndBatch();
+		mixer->X = 92.f;
+		mixer->Y = 104.f;
+		mixer->Spin = 0.04f;
+		sim->Obstacles.push_back(mixer);
+	}
+
+	float x = 35.f + sinf(step * (2.f * 3.14159265f / 300.f)) * 20.f;
+	sim->Obstacles[0]->MoveTo(x, 100.f, 0.f);
+}
+///////////////////////////////////////////////////////////////////////////////
+static const Scenario gScenarios[] =
+{
+	{
+		"dam_break",
+		"domain 64 64 0.5\n"
+		"fluid water density 2\n"
+		"block water 4 20 40 100 spacing 0.7\n",
+		600, NULL
+	},
+	{
+		"incompressible_dam_break",
+		"domain 64 64 0.5\n"
+		"incompressible\n"
+		"fluid water density 2\n"
+		"block water 4 20 40 100 spacing 0.7\n",
+		600, NULL
+	},
+	{
+		"pour",
+		"domain 64 64 0.5\n"
+		"fluid water density 2\n"
+		"addcircle 64.5 90 12\n"
+		"blur\n"
+		"emitter water 64 12 3 6 velocity 0 0.5\n",
+		800, NULL
+	},
+	{
+		"pour_narrow_band",
+		"domain 64 64 0.5\n"
+		"fluid water density 2\n"
+		"addcircle 64.5 90 12\n"
+		"blur\n"
+		"narrowband 6\n"
+		"emitter water 64 12 3 6 velocity 0 0.5\n",
+		800, NULL
+	},
+	{
+		"two_fluid_mixing",
+		"domain 64 64 0.5\n"
+		"fluid water density 2\n"
+		"fluid oil density 1 viscosity 4\n"
+		"block oil 4 50 60 75 spacing 0.7\n"
+		"block water 65 50 60 75 spacing 0.7\n",
+		600, NULL
+	},
+	{
+		"brush_stir",
+		"domain 64 64 0.5\n"
+		"fluid water density 2\n"
+		"fluid oil density 1 viscosity 4\n"
+		"block oil 4 50 121 20 spacing 0.7\n"
+		"block water 4 72 121 53 spacing 0.7\n",
+		600, &Stir
+	},
+	{
+		"paddle_and_mixer",
+		"domain 64 64 0.5\n"
+		"fluid water density 2\n"
+		"block water 4 76 121 49 spacing 0.7\n",
+		600, &Paddle
+	},
+	{
+		"large_dam_break_tiled",
+		"domain 128 128 0.25\n"
+		"layout tiled\n"
+		"fluid water density 2\n"
+		"block water 4 100 160 405 spacing 1\n",
+		150, NULL
+	}
+};
+
+#define SCENARIO_COUNT ((int)(sizeof(gScenarios) / sizeof(gScenarios[0])))
+
+///////////////////////////////////////////////////////////////////////////////
+// FNV-1a over every particle's bytes, fluid by fluid
+static uint64_t HashParticles(const FluidSim * sim)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	for (int f=0, flim=sim->Fluids.size(); f<flim; f++)
+	{
+		const std::vector<Particle> & particles = sim->Fluids[f]->Particles;
+		if (!particles.empty())
+		{
+			const unsigned char * bytes = (const unsigned char *) &particles[0];
+			size_t size = particles.size() * sizeof(Particle);
+			for (size_t i=0; i<size; i++)
+				hash = (hash ^ bytes[i]) * 1099511628211ULL;
+		}
+
+		// Separates fluids, so moving a particle between them changes the hash
+		hash = (hash ^ 0xff) * 1099511628211ULL;
+	}
+	return hash;
+}
+///////////////////////////////////////////////////////////////////////////////
+//
+// --------------------------------- Goldens ----------------------------------
+//
+///////////////////////////////////////////////////////////////////////////////
+typedef std::map<std::string, uint64_t> Goldens;
+
+// Lines of "<scenario> <hash in hex>", '#' starting a comment
+static void LoadGoldens(const char * path, Goldens & goldens)
+{
+	FILE * file = fopen(path, "r");
+	if (!file)
+		return;
+
+	char line[256];
+	while (fgets(line, sizeof(line), file))
+	{
+		char name[128];
+		unsigned long long hash;
+		if (line[0] != '#' && sscanf(line, "%127s %llx", name, &hash) == 2)
+			goldens[name] = hash;
+	}
+	fclose(file);
+}
+///////////////////////////////////////////////////////////////////////////////
+static bool SaveGoldens(const char * path, const Goldens & goldens)
+{
+	FILE * file = fopen(path, "w");
+	if (!file)
+		return false;
+
+	fprintf(file, "# Final particle hashes of the scenario runner; regenerate\n"
+		"# with 'fluidscenarios --update' when results change on purpose\n");
+	for (Goldens::const_iterator it=goldens.begin(); it!=goldens.end(); ++it)
+	{
+		fprintf(file, "%s %016llx\n", it->first.c_str(), 
+			(unsigned long long) it->second);
+	}
+	return fclose(file) == 0;
+}
+///////////////////////////////////////////////////////////////////////////////
+//
+// ------------------------------- Query check --------------------------------
+//
+///////////////////////////////////////////////////////////////////////////////
+static bool RefLess(const ParticleRef & a, const ParticleRef & b)
+{
+	return a.fluid != b.fluid ? a.fluid < b.fluid : a.index < b.index;
+}
+///////////////////////////////////////////////////////////////////////////////
+static bool SameRefs(std::vector<ParticleRef> a, std::vector<ParticleRef> b)
+{
+	if (a.size() != b.size())
+		return false;
+
+	std::sort(a.begin(), a.end(), RefLess);
+	std::sort(b.begin(), b.end(), RefLess);
+	for (int i=0, lim=a.size(); i<lim; i++)
+	{
+		if (RefLess(a[i], b[i]) || RefLess(b[i], a[i]))
+			return false;
+	}
+	return true;
+}
+///////////////////////////////////////////////////////////////////////////////
+// Same expression as QueryNearest, so ties compare exactly
+static float Distance2(const FluidSim * sim, const ParticleRef & ref, float x,
+	float y)
+{
+	const Particle & p = sim->Fluids[ref.fluid]->Particles[ref.index];
+	return (p.x - x) * (p.x - x) + (p.y - y) * (p.y - y);
+}
+///////////////////////////////////////////////////////////////////////////////
+// Every particle of the fluid, or of all with -1
+static void AllParticles(const FluidSim * sim, int fluid, 
+	std::vector<ParticleRef> & out)
+{
+	out.clear();
+	for (int f=0, flim=sim->Fluids.size(); f<flim; f++)
+	{
+		if (fluid >= 0 && f != fluid)
+			continue;
+
+		ParticleRef ref;
+		ref.fluid = f;
+		for (ref.index=0; ref.index<(int) sim->Fluids[f]->Particles.size(); 
+			ref.index++)
+		{
+			out.push_back(ref);
+		}
+	}
+}
+///////////////////////////////////////////////////////////////////////////////
+// Runs random queries, some reaching past the domain, through the index and 
+// by brute force over every particle or node; mismatches go to stderr
+static bool CheckQueryRound(FluidSim * sim, const char * name, 
+	const char * round)
+{
+	uint64_t key = sim->GetRandomKey(QUERY_STREAM);
+	int fluids = sim->Fluids.size();
+	int failed = 0;
+
+	std::vector<ParticleRef> all, found, expected;
+	std::vector<float> d2;
+	for (int q=0; q<QUERY_COUNT; q++)
+	{
+		float x = frand(key, 6*q) * (sim->GWidth + 8.f) - 4.f;
+		float y = frand(key, 6*q + 1) * (sim->GHeight + 8.f) - 4.f;
+		float w = frand(key, 6*q + 2) * 24.f;
+		float h = frand(key, 6*q + 3) * 24.f;
+		int k = 1 + (int)(frand(key, 6*q + 4) * 32.f);
+		int fluid = (int)(frand(key, 6*q + 5) * (fluids + 1)) - 1;
+		AllParticles(sim, fluid, all);
+
+		found.clear();
+		expected.clear();
+		sim->QueryRect(x, y, x + w, y + h, found, fluid);
+		for (int i=0, lim=all.size(); i<lim; i++)
+		{
+			const Particle & p = sim->Fluids[all[i].fluid]->Particles[all[i].index];
+			if (p.x >= x && p.x <= x + w && p.y >= y && p.y <= y + h)
+				expected.push_back(all[i]);
+		}
+		if (!SameRefs(found, expected))
+		{
+			fprintf(stderr, "%s: %s QueryRect(%g, %g, %g, %g) found %d of %d\n",
+				name, round, x, y, x + w, y + h, (int) found.size(), 
+				(int) expected.size());
+			failed++;
+		}
+
+		// The rectangle's width doubles as a radius
+		found.clear();
+		expected.clear();
+		sim->QueryRadius(x, y, w * 0.5f, found, fluid);
+		for (int i=0, lim=all.size(); i<lim; i++)
+		{
+			const Particle & p = sim->Fluids[all[i].fluid]->Particles[all[i].index];
+			float dx = p.x - x;
+			float dy = p.y - y;
+			if (dx*dx + dy*dy <= (w * 0.5f) * (w * 0.5f))
+				expected.push_back(all[i]);
+		}
+		if (!SameRefs(found, expected))
+		{
+			fprintf(stderr, "%s: %s QueryRadius(%g, %g, %g) found %d of %d\n",
+				name, round, x, y, w * 0.5f, (int) found.size(), 
+				(int) expected.size());
+			failed++;
+		}
+
+		// Ties may come back in any order, so the distances are compared, 
+		// plus that no particle is returned twice
+		sim->QueryNearest(x, y, k, found, fluid);
+		d2.resize(all.size());
+		for (int i=0, lim=all.size(); i<lim; i++)
+			d2[i] = Distance2(sim, all[i], x, y);
+		int n = std::min(k, (int) all.size());
+		std::partial_sort(d2.begin(), d2.begin() + n, d2.end());
+
+		bool ok = (int) found.size() == n;
+		for (int i=0; i<n && ok; i++)
+			ok = Distance2(sim, found[i], x, y) == d2[i];
+		expected = found;
+		std::sort(expected.begin(), expected.end(), RefLess);
+		for (int i=1; i<n && ok; i++)
+			ok = RefLess(expected[i-1], expected[i]);
+		if (!ok)
+		{
+			fprintf(stderr, "%s: %s QueryNearest(%g, %g, %d) differs\n", 
+				name, round, x, y, k);
+			failed++;
+		}
+
+		// Nodes sit on integer coordinates
+		float mass, vx, vy;
+		sim->GetRegionMass(x, y, x + w, y + h, &mass, &vx, &vy, fluid);
+		const CellGrid & grid = fluid >= 0 ? sim->Fluids[fluid]->Grid : 
+			sim->Grid;
+		float m = 0.f, mvx = 0.f, mvy = 0.f;
+		for (int gy=0; gy<sim->GHeight; gy++)
+		{
+			for (int gx=0; gx<sim->GWidth; gx++)
+			{
+				if (gx < x || gx > x + w || gy < y || gy > y + h)
+					continue;
+
+				int o = grid.Index(gx, gy);
+				m += grid.M[o];
+				mvx += grid.M[o] * grid.VX[o];
+				mvy += grid.M[o] * grid.VY[o];
+			}
+		}
+		if (mass != m || vx != (m > 0.f ? mvx / m : 0.f) || 
+			vy != (m > 0.f ? mvy / m : 0.f))
+		{
+			fprintf(stderr, "%s: %s GetRegionMass(%g, %g, %g, %g) gave %g, "
+				"not %g\n", name, round, x, y, x + w, y + h, mass, m);
+			failed++;
+		}
+	}
+	return failed == 0;
+}
+///////////////////////////////////////////////////////////////////////////////
+// Checks the queries on the final state, then after particles are added and
+// after they move under a new step number, as restoring a checkpoint does; 
+// a stale index shows up as a mismatch.  Leaves the simulation changed.
+static bool CheckQueries(FluidSim * sim, const char * name)
+{
+	bool ok = CheckQueryRound(sim, name, "final");
+
+	uint64_t key = sim->GetRandomKey(QUERY_STREAM + 1);
+	for (int f=0, flim=sim->Fluids.size(); f<flim; f++)
+	{
+		for (int i=0; i<64; i++)
+		{
+			sim->Fluids[f]->AddParticle(
+				2.f + frand(key, 2*i) * (sim->GWidth - 4.f),
+				2.f + frand(key, 2*i + 1) * (sim->GHeight - 4.f), 0.f, 0.f);
+		}
+	}
+	ok = CheckQueryRound(sim, name, "added") && ok;
+
+	// Same count, so only the step number tells the index it's stale
+	for (int f=0, flim=sim->Fluids.size(); f<flim; f++)
+	{
+		std::vector<Particle> & particles = sim->Fluids[f]->Particles;
+		for (int i=0, lim=particles.size(); i<lim; i++)
+		{
+			particles[i].x = std::max(1.f, std::min(sim->GWidth - 2.f, 
+				particles[i].x + frand(key, 2*i) * 8.f - 4.f));
+			particles[i].y = std::max(1.f, std::min(sim->GHeight - 2.f, 
+				particles[i].y + frand(key, 2*i + 1) * 8.f - 4.f));
+		}
+	}
+	sim->Step++;
+	ok = CheckQueryRound(sim, name, "moved") && ok;
+	return ok;
+}
+///////////////////////////////////////////////////////////////////////////////
+//
+// --------------------------------- Runner -----------------------------------
+//
+///////////////////////////////////////////////////////////////////////////////
+static double Percentile(std::vector<int64_t> & times, double fraction)
+{
+	size_t i = (size_t)(fraction * (times.size() - 1));
+	std::nth_element(times.begin(), times.begin() + i, times.end());
+	return times[i] * 1e-6;
+}
+///////////////////////////////////////////////////////////////////////////////
+// Runs the scenario and prints its results, leaving the object open for the
+// golden check; 'hash' gets the hash of the final particles and 'queries' 
+// whether the particle and grid queries agreed with brute force afterwards
+static bool RunScenario(const Scenario & scenario, ThreadPool * pool, 
+	uint64_t * hash, bool * queries)
+{
+	Scene scene;
+	if (!scene.Parse(scenario.scene))
+	{
+		fprintf(stderr, "%s: scene error on line %d\n", scenario.name, 
+			scene.GetErrorLine());
+		return false;
+	}
+
+	// Set up as the app does, with the collision field frozen
+	FluidSim * sim = scene.Build();
+	sim->Threads = pool;
+	sim->SDF.Freeze();
+
+	Profiler::Reset();
+	std::vector<int64_t> times;
+	int64_t particlesteps = 0;
+	int64_t start = GetTimeNS();
+	for (int i=0; i<scenario.steps; i++)
+	{
+		scene.Emit(sim);
+		if (scenario.script)
+			scenario.script(sim, i);
+
+		particlesteps += sim->ParticleCount();
+		int64_t t = GetTimeNS();
+		sim->Update();
+		times.push_back(GetTimeNS() - t);
+		Profiler::Collect();
+	}
+	double ms = (GetTimeNS() - start) * 1e-6;
+
+	std::vector<Profiler::Stats> stats;
+	Profiler::GetStats(stats);
+	*hash = HashParticles(sim);
+
+	printf("{\"scenario\": \"%s\", \"steps\": %d, \"particles\": %d, "
+		"\"ms\": %.1f, \"steps_per_s\": %.1f, \"particle_steps_per_s\": %.0f, "
+		"\"p50_ms\": %.3f, \"p99_ms\": %.3f, \"peak_bytes\": %lu, "
+		"\"hash\": \"%016llx\", \"phases\": {", 
+		scenario.name, scenario.steps, sim->ParticleCount(), ms, 
+		scenario.steps / (ms * 1e-3), particlesteps / (ms * 1e-3),
+		Percentile(times, 0.5), Percentile(times, 0.99), 
+		(unsigned long) sim->GetMemoryStats().PeakTotal,
+		(unsigned long long) *hash);
+
+	// Each phase as [total ms, particle steps per second]
+	for (int p=0; p<PHASE_COUNT; p++)
+	{
+		double total = 0.0;
+		for (int i=0, lim=stats.size(); i<lim; i++)
+		{
+			if (stats[i].name == gPhases[p])
+				total += stats[i].total;
+		}
+		printf("%s\"%s\": [%.1f, %.0f]", p ? ", " : "", gPhases[p], total,
+			total > 0.0 ? particlesteps / (total * 1e-3) : 0.0);
+	}
+	printf("}");
+
+	*queries = CheckQueries(sim, scenario.name);
+	printf(", \"queries\": \"%s\"", *queries ? "match" : "MISMATCH");
+
+	delete sim;
+	return true;
+}
+///////////////////////////////////////////////////////////////////////////////
+int main(int argc, char ** argv)
+{
+	const char * filter = NULL;
+	const char * path = GOLDEN_PATH;
+	bool update = false;
+	int threads = 0;
+	for (int i=1; i<argc; i++)
+	{
+		if (strcmp(argv[i], "--update") == 0)
+			update = true;
+		else if (strcmp(argv[i], "--goldens") == 0 && i + 1 < argc)
+			path = argv[++i];
+		else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+			threads = atoi(argv[++i]);
+		else
+			filter = argv[i];
+	}
+
+	Goldens goldens;
+	LoadGoldens(path, goldens);
+
+	ThreadPool * pool = threads == 1 ? NULL : new ThreadPool(threads);
+	int failed = 0;
+	for (int i=0; i<SCENARIO_COUNT; i++)
+	{
+		const Scenario & scenario = gScenarios[i];
+		if (filter && !strstr(scenario.name, filter))
+			continue;
+
+		uint64_t hash;
+		bool queries;
+		if (!RunScenario(scenario, pool, &hash, &queries))
+		{
+			failed++;
+			continue;
+		}
+		if (!queries)
+			failed++;
+
+		Goldens::iterator it = goldens.find(scenario.name);
+		const char * result;
+		if (update)
+		{
+			goldens[scenario.name] = hash;
+			result = "updated";
+		}
+		else if (it == goldens.end())
+		{
+			// A new scenario must have its golden recorded with --update
+			result = "MISSING";
+			failed++;
+		}
+		else if (it->second == hash)
+		{
+			result = "match";
+		}
+		else
+		{
+			result = "MISMATCH";
+			failed++;
+		}
+		printf(", \"golden\": \"%s\"}\n", result);
+		fflush(stdout);
+	}
+	delete pool;
+
+	if (update && !SaveGoldens(path, goldens))
+	{
+		fprintf(stderr, "can't write goldens to %s\n", path);
+		return 1;
+	}
+	return failed ? 1 : 0;
+}
+///////////////////////////////////////////////////////////////////////////////
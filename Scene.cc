@@ -0,0 +1,426 @@
+/*
+Copyright (c) 2012 Chris Lentini
+http://divergentcoder.com
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of 
+this software and associated documentation files (the "Software"), to deal in 
+the Software without restriction, including without limitation the rights to use, 
+copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the 
+Software, and to permit persons to whom the Software is furnished to do so, 
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all 
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS 
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR 
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER 
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN 
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+
+#include <algorithm>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sstream>
+#include "Util.h"
+#include "Fluid.h"
+#include "Scene.h"
+
+enum
+{
+	SCENE_ADD_CIRCLE,
+	SCENE_SUB_CIRCLE,
+	SCENE_SUB_RECT,
+	SCENE_BLUR
+};
+
+// Each emitter draws from its own random stream, starting here
+#define EMITTER_STREAM	RANDOM_STREAM_USER
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// ---------------------------------- Scene ----------------------------------- 
+//
+///////////////////////////////////////////////////////////////////////////////
+Scene::Scene()
+:	Width(64.f),
+	Height(64.f),
+	Scale(0.5f),
+	Layout(GRID_ROW_MAJOR),
+	fGravityX(0.f),
+	fGravityY(9.81f),
+	fGridCoeff(1.f),
+	fVolumeCorrection(0.3f),
+	bIncompressible(false),
+	fNarrowBand(0.f),
+	nBandTile(8),
+	nSeed(0),
+	nErrorLine(0)
+{
+}
+///////////////////////////////////////////////////////////////////////////////
+bool Scene::Load(const char * path)
+{
+	FILE * file = fopen(path, "rb");
+	if (!file)
+		return false;
+
+	std::string text;
+	char buffer[4096];
+	size_t read;
+	while ((read = fread(buffer, 1, sizeof(buffer), file)) > 0)
+		text.append(buffer, read);
+	fclose(file);
+
+	return Parse(text.c_str());
+}
+///////////////////////////////////////////////////////////////////////////////
+bool Scene::Parse(const char * text)
+{
+	*this = Scene();
+
+	std::istringstream stream(text);
+	std::string line;
+	for (int n=1; std::getline(stream, line); n++)
+	{
+		size_t comment = line.find('#');
+		if (comment != std::string::npos)
+			line.erase(comment);
+
+		if (!ParseLine(line))
+		{
+			nErrorLine = n;
+			return false;
+		}
+	}
+	return true;
+}
+///////////////////////////////////////////////////////////////////////////////
+bool Scene::ParseLine(const std::string & line)
+{
+	std::istringstream stream(line);
+	std::string cmd;
+	if (!(stream>>cmd))
+		return true;
+
+	if (cmd == "domain")
+	{
+		stream>>Width>>Height>>Scale;
+		if (!stream || Width <= 0.f || Height <= 0.f || Scale <= 0.f)
+			return false;
+	}
+	else if (cmd == "layout")
+	{
+		std::string layout;
+		stream>>layout;
+		if (layout == "rows")
+			Layout = GRID_ROW_MAJOR;
+		else if (layout == "tiled")
+			Layout = GRID_TILED;
+		else
+			return false;
+	}
+	else if (cmd == "gravity")
+	{
+		stream>>fGravityX>>fGravityY;
+	}
+	else if (cmd == "gridcoeff")
+	{
+		stream>>fGridCoeff;
+	}
+	else if (cmd == "incompressible")
+	{
+		bIncompressible = true;
+		std::string key;
+		while (stream>>key)
+		{
+			if (key != "correction" || !(stream>>fVolumeCorrection))
+				return false;
+		}
+		return true;
+	}
+	else if (cmd == "seed")
+	{
+		stream>>nSeed;
+	}
+	else if (cmd == "fluid")
+	{
+		Material m;
+		m.color = 0xff0000ff;
+		m.density = 3.5f;
+		m.stiffness = 0.5f;
+		m.viscosity = 0.f;
+		if (!(stream>>m.name) || FindMaterial(m.name) >= 0)
+			return false;
+
+		std::string key;
+		while (stream>>key)
+		{
+			bool ok;
+			if (key == "density")
+				ok = !!(stream>>m.density);
+			else if (key == "stiffness")
+				ok = !!(stream>>m.stiffness);
+			else if (key == "viscosity")
+				ok = !!(stream>>m.viscosity);
+			else if (key == "color")
+			{
+				int r, g, b;
+				ok = !!(stream>>r>>g>>b);
+				m.color = (255 << 24) | ((r & 0xff) << 16) | 
+					((g & 0xff) << 8) | (b & 0xff);
+			}
+			else
+				ok = false;
+
+			if (!ok)
+				return false;
+		}
+		materials.push_back(m);
+		return true;
+	}
+	else if (cmd == "addcircle" || cmd == "subcircle")
+	{
+		Shape s;
+		s.type = cmd == "addcircle" ? SCENE_ADD_CIRCLE : SCENE_SUB_CIRCLE;
+		s.d = 0.f;
+		stream>>s.a>>s.b>>s.c;
+		shapes.push_back(s);
+	}
+	else if (cmd == "subrect")
+	{
+		Shape s;
+		s.type = SCENE_SUB_RECT;
+		stream>>s.a>>s.b>>s.c>>s.d;
+		shapes.push_back(s);
+	}
+	else if (cmd == "blur")
+	{
+		Shape s;
+		s.type = SCENE_BLUR;
+		s.a = s.b = s.c = s.d = 0.f;
+		shapes.push_back(s);
+	}
+	else if (cmd == "narrowband")
+	{
+		if (!(stream>>fNarrowBand) || fNarrowBand <= 0.f)
+			return false;
+
+		std::string key;
+		while (stream>>key)
+		{
+			if (key != "tile" || !(stream>>nBandTile) || nBandTile < 1)
+				return false;
+		}
+		return true;
+	}
+	else if (cmd == "block" || cmd == "emitter")
+	{
+		std::string name;
+		stream>>name;
+		int fluid = FindMaterial(name);
+		if (fluid < 0)
+			return false;
+
+		Block b;
+		Emitter e;
+		b.fluid = e.fluid = fluid;
+		b.spacing = 0.5f;
+		b.vx = b.vy = e.vx = e.vy = 0.f;
+		if (cmd == "block")
+			stream>>b.x>>b.y>>b.w>>b.h;
+		else
+			stream>>e.x>>e.y>>e.radius>>e.rate;
+		if (!stream)
+			return false;
+
+		std::string key;
+		while (stream>>key)
+		{
+			bool ok;
+			if (key == "spacing" && cmd == "block")
+				ok = !!(stream>>b.spacing);
+			else if (key == "velocity")
+				ok = !!(stream>>b.vx>>b.vy);
+			else
+				ok = false;
+
+			if (!ok)
+				return false;
+		}
+		e.vx = b.vx;
+		e.vy = b.vy;
+
+		if (cmd == "block")
+		{
+			if (b.spacing <= 0.f)
+				return false;
+			blocks.push_back(b);
+		}
+		else
+		{
+			emitters.push_back(e);
+		}
+		return true;
+	}
+	else
+	{
+		return false;
+	}
+
+	// Anything left over is as much an error as too little
+	std::string extra;
+	return !stream.fail() && !(stream>>extra);
+}
+///////////////////////////////////////////////////////////////////////////////
+int Scene::FindMaterial(const std::string & name) const
+{
+	for (int i=0, lim=materials.size(); i<lim; i++)
+	{
+		if (materials[i].name == name)
+			return i;
+	}
+	return -1;
+}
+///////////////////////////////////////////////////////////////////////////////
+FluidSim * Scene::Build(const char * cachedir)
+{
+	FluidSim * sim = new FluidSim(Width, Height, Scale, Layout, true);
+	sim->Seed = nSeed;
+	sim->GridCoeff = fGridCoeff;
+	sim->Incompressible = bIncompressible;
+	sim->VolumeCorrection = fVolumeCorrection;
+	sim->GravityX = (fGravityX / Scale) * (1.f / 900.f);
+	sim->GravityY = (fGravityY / Scale) * (1.f / 900.f);
+
+	for (int i=0, lim=materials.size(); i<lim; i++)
+	{
+		Fluid * fluid = new Fluid(sim->GWidth, sim->GHeight);
+		fluid->Color = materials[i].color;
+		fluid->Density = materials[i].density;
+		fluid->Stiffness = materials[i].stiffness;
+		fluid->Viscosity = materials[i].viscosity;
+		sim->Fluids.push_back(fluid);
+	}
+
+	// The field is left batching, so every shape here lands in the same 
+	// propagation as the walls
+	for (int i=0, lim=shapes.size(); i<lim; i++)
+	{
+		const Shape & s = shapes[i];
+		switch (s.type)
+		{
+		case SCENE_ADD_CIRCLE:	sim->SDF.AddCircle(s.a, s.b, s.c); break;
+		case SCENE_SUB_CIRCLE:	sim->SDF.SubCircle(s.a, s.b, s.c); break;
+		case SCENE_SUB_RECT:	sim->SDF.SubRect(s.a, s.b, s.c, s.d); break;
+		case SCENE_BLUR:		sim->SDF.Blur(); break;
+		}
+	}
+	sim->SDF.EndBatch(cachedir);
+
+	// Built from the dense field, so a narrow band saves memory while the 
+	// simulation runs but not while the scene is being built
+	if (fNarrowBand > 0.f)
+		sim->SDF.BuildNarrowBand(fNarrowBand, nBandTile);
+
+	// Blocks are laid out on a regular lattice, dropping whatever lands 
+	// inside a solid
+	for (int i=0, lim=blocks.size(); i<lim; i++)
+	{
+		const Block & b = blocks[i];
+		int nx = (int)(b.w / b.spacing);
+		int ny = (int)(b.h / b.spacing);
+		for (int y=0; y<ny; y++)
+		{
+			for (int x=0; x<nx; x++)
+			{
+				AddCandidate(b.fluid, b.x + (x + 0.5f) * b.spacing, 
+					b.y + (y + 0.5f) * b.spacing, b.vx, b.vy);
+			}
+		}
+	}
+	AddCandidates(sim);
+	return sim;
+}
+///////////////////////////////////////////////////////////////////////////////
+void Scene::Emit(FluidSim * sim)
+{
+	for (int i=0, lim=emitters.size(); i<lim; i++)
+	{
+		const Emitter & e = emitters[i];
+		uint64_t key = sim->GetRandomKey(EMITTER_STREAM + i);
+		for (int j=0; j<e.rate; j++)
+		{
+			// Uniform over the disc
+			float r = e.radius * sqrtf(frand(key, 2*j));
+			float a = frand(key, 2*j + 1) * 6.2831853f;
+			AddCandidate(e.fluid, e.x + r * cosf(a), e.y + r * sinf(a), 
+				e.vx, e.vy);
+		}
+	}
+	AddCandidates(sim);
+}
+///////////////////////////////////////////////////////////////////////////////
+void Scene::AddCandidate(int fluid, float x, float y, float vx, float vy)
+{
+	candidateX.push_back(x);
+	candidateY.push_back(y);
+	candidateVX.push_back(vx);
+	candidateVY.push_back(vy);
+	candidateFluid.push_back(fluid);
+}
+///////////////////////////////////////////////////////////////////////////////
+void Scene::AddCandidates(FluidSim * sim)
+{
+	int count = candidateX.size();
+	if (count > 0)
+	{
+		candidateD.resize(count);
+		sim->SDF.SampleDistanceBatch(&candidateX[0], &candidateY[0], 
+			&candidateD[0], count);
+
+		// Size every fluid once per batch rather than growing per particle,
+		// at least doubling so a steady emitter still grows geometrically
+		int fluids = sim->Fluids.size();
+		std::vector<int> added(fluids, 0);
+		for (int i=0; i<count; i++)
+		{
+			int f = candidateFluid[i];
+			if (f < fluids && candidateD[i] > 0.f)
+				added[f]++;
+		}
+		for (int f=0; f<fluids; f++)
+		{
+			Fluid * fluid = sim->Fluids[f];
+			size_t needed = fluid->Particles.size() + added[f];
+			if (needed > fluid->Particles.capacity())
+			{
+				size_t capacity = std::max(2 * fluid->Particles.capacity(), 
+					needed);
+				fluid->Particles.reserve(capacity);
+				fluid->Weights.reserve(capacity);
+			}
+		}
+
+		for (int i=0; i<count; i++)
+		{
+			int f = candidateFluid[i];
+			if (f < fluids && candidateD[i] > 0.f)
+			{
+				sim->Fluids[f]->AddParticle(candidateX[i], candidateY[i], 
+					candidateVX[i], candidateVY[i]);
+			}
+		}
+	}
+
+	candidateX.clear();
+	candidateY.clear();
+	candidateVX.clear();
+	candidateVY.clear();
+	candidateFluid.clear();
+}
+///////////////////////////////////////////////////////////////////////////////
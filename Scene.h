@@ -0,0 +1,142 @@
+/*
+Copyright (c) 2012 Chris Lentini
+http://divergentcoder.com
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of 
+this software and associated documentation files (the "Software"), to deal in 
+the Software without restriction, including without limitation the rights to use, 
+copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the 
+Software, and to permit persons to whom the Software is furnished to do so, 
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all 
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS 
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR 
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER 
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN 
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+
+#ifndef HH_MPM_SCENE_HH
+#define HH_MPM_SCENE_HH
+
+#include <string>
+#include <vector>
+#include "Grid.h"
+
+class FluidSim;
+
+// A scene description read from text, one directive per line and '#' 
+// starting a comment.  Positions and sizes are in grid cells, as everywhere
+// else in the simulation.
+//
+//   domain <width> <height> <scale>  world size and world units per cell
+//   layout rows|tiled                grid node layout, tiles suit big grids
+//   gravity <x> <y>                  in m/s^2, as the page sets it
+//   gridcoeff <c>
+//   incompressible [correction c]   pressure projection instead of stiffness
+//   seed <n>                         for the simulation's random numbers
+//   fluid <name> [density d] [stiffness s] [viscosity v] [color r g b]
+//   addcircle <x> <y> <r>            solid disc
+//   subcircle <x> <y> <r>            carves out a disc
+//   subrect <x> <y> <w> <h>          carves out a rectangle
+//   blur
+//   narrowband <band> [tile n]       keeps the field at full resolution only 
+//                                    within 'band' cells of a surface
+//   block <fluid> <x> <y> <w> <h> [spacing s] [velocity vx vy]
+//   emitter <fluid> <x> <y> <radius> <rate> [velocity vx vy]
+//
+// Fluids must be declared before blocks and emitters name them.  The domain
+// is always enclosed by the simulation's own walls.
+class Scene
+{
+public:
+	Scene();
+
+	bool	Load(const char * path);
+	bool	Parse(const char * text);
+
+	// Line of the first directive that failed to parse, 0 if none did
+	int		GetErrorLine() const { return nErrorLine; }
+
+	// Creates the simulation, rasterizes every shape with a single 
+	// propagation and fills the blocks.  The collision field is left dense
+	// and editable unless the scene asks for a narrow band, which is built
+	// from the dense field and leaves it read-only.
+	FluidSim *	Build(const char * cachedir = NULL);
+
+	// Adds one step's worth of particles from every emitter
+	void	Emit(FluidSim * sim);
+
+	float	Width;
+	float	Height;
+	float	Scale;
+	GridLayout	Layout;
+
+private:
+	struct Material
+	{
+		std::string	name;
+		int			color;
+		float		density;
+		float		stiffness;
+		float		viscosity;
+	};
+
+	struct Shape
+	{
+		int			type;
+		float		a, b, c, d;
+	};
+
+	struct Block
+	{
+		int			fluid;
+		float		x, y, w, h;
+		float		spacing;
+		float		vx, vy;
+	};
+
+	struct Emitter
+	{
+		int			fluid;
+		float		x, y;
+		float		radius;
+		int			rate;
+		float		vx, vy;
+	};
+
+	bool	ParseLine(const std::string & line);
+	int		FindMaterial(const std::string & name) const;
+	void	AddCandidate(int fluid, float x, float y, float vx, float vy);
+	void	AddCandidates(FluidSim * sim);
+
+	float					fGravityX;
+	float					fGravityY;
+	float					fGridCoeff;
+	float					fVolumeCorrection;
+	bool					bIncompressible;
+	float					fNarrowBand;
+	int						nBandTile;
+	unsigned				nSeed;
+	int						nErrorLine;
+
+	std::vector<Material>	materials;
+	std::vector<Shape>		shapes;
+	std::vector<Block>		blocks;
+	std::vector<Emitter>	emitters;
+
+	// Candidate particles, sampled against the collision field in one batch
+	std::vector<float>		candidateX;
+	std::vector<float>		candidateY;
+	std::vector<float>		candidateD;
+	std::vector<float>		candidateVX;
+	std::vector<float>		candidateVY;
+	std::vector<int>		candidateFluid;
+};
+
+#endif // HH_MPM_SCENE_HH
@@ -0,0 +1,133 @@
+/*
+Copyright (c) 2012 Chris Lentini
+http://divergentcoder.com
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of 
+this software and associated documentation files (the "Software"), to deal in 
+the Software without restriction, including without limitation the rights to use, 
+copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the 
+Software, and to permit persons to whom the Software is furnished to do so, 
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all 
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS 
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR 
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER 
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN 
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+
+#include <algorithm>
+#include <math.h>
+#include "Fluid.h"
+#include "ThreadPool.h"
+#include "SurfaceRenderer.h"
+#include "Profiler.h"
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// ----------------------------- SurfaceRenderer ------------------------------
+//
+///////////////////////////////////////////////////////////////////////////////
+SurfaceRenderer::SurfaceRenderer(ThreadPool * threadpool)
+:	Threshold(0.5f),
+	pool(threadpool),
+	pSim(NULL),
+	pPixels(NULL),
+	nWidth(0),
+	nHeight(0)
+{}
+///////////////////////////////////////////////////////////////////////////////
+SurfaceRenderer::~SurfaceRenderer()
+{}
+///////////////////////////////////////////////////////////////////////////////
+void SurfaceRenderer::Render(const FluidSim * sim, int32_t * pixels, 
+	int width, int height)
+{
+	PROFILE_SCOPE("SurfaceRender");
+	pSim = sim;
+	pPixels = pixels;
+	nWidth = width;
+	nHeight = height;
+
+	// Each row of cells covers its own band of pixel rows
+	pool->Run(&RenderRow, this, sim->GHeight - 1);
+}
+///////////////////////////////////////////////////////////////////////////////
+void SurfaceRenderer::RenderRow(void * data, int y)
+{
+	PROFILE_SCOPE("RenderRow");
+	SurfaceRenderer * r = (SurfaceRenderer *) data;
+	const FluidSim * sim = r->pSim;
+
+	// Grid node i sits at position i, which maps to pixel i * scale
+	float sx = r->nWidth / (float) sim->GWidth;
+	float sy = r->nHeight / (float) sim->GHeight;
+	int py0 = std::min(r->nHeight, (int) ceilf(y * sy));
+	int py1 = std::min(r->nHeight, (int) ceilf((y + 1) * sy));
+	if (py0 >= py1)
+		return;
+
+	// Later fluids draw over earlier ones, as the particle renderer does
+	for (int f=0, flim=sim->Fluids.size(); f<flim; f++)
+	{
+		const Fluid * fluid = sim->Fluids[f];
+		const CellGrid & grid = fluid->Grid;
+		float iso = r->Threshold * fluid->Density;
+		int color = fluid->Color;
+
+		const float * m = grid.M;
+		int oy0 = grid.OffsetY(y);
+		int oy1 = grid.OffsetY(y + 1);
+		for (int x=0, xlim=sim->GWidth-1; x<xlim; x++)
+		{
+			int ox0 = grid.OffsetX(x);
+			int ox1 = grid.OffsetX(x + 1);
+			float m00 = m[ox0 + oy0];
+			float m10 = m[ox1 + oy0];
+			float m01 = m[ox0 + oy1];
+			float m11 = m[ox1 + oy1];
+
+			int id = (m00 >= iso ? 1 : 0) | (m10 >= iso ? 2 : 0) |
+				(m01 >= iso ? 4 : 0) | (m11 >= iso ? 8 : 0);
+			if (id == 0)
+				continue;
+
+			int px0 = std::min(r->nWidth, (int) ceilf(x * sx));
+			int px1 = std::min(r->nWidth, (int) ceilf((x + 1) * sx));
+
+			if (id == 15)
+			{
+				for (int py=py0; py<py1; py++)
+				{
+					int32_t * out = r->pPixels + py * r->nWidth;
+					for (int px=px0; px<px1; px++)
+						out[px] = color;
+				}
+				continue;
+			}
+
+			// The contour crosses this cell; fill the side of the bilinear
+			// mass surface above the iso level
+			for (int py=py0; py<py1; py++)
+			{
+				float v = (py / sy) - y;
+				float m0 = m00 + (m01 - m00) * v;
+				float m1 = m10 + (m11 - m10) * v;
+				int32_t * out = r->pPixels + py * r->nWidth;
+
+				for (int px=px0; px<px1; px++)
+				{
+					float u = (px / sx) - x;
+					if (m0 + (m1 - m0) * u >= iso)
+						out[px] = color;
+				}
+			}
+		}
+	}
+}
+///////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,61 @@
+/*
+Copyright (c) 2012 Chris Lentini
+http://divergentcoder.com
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of 
+this software and associated documentation files (the "Software"), to deal in 
+the Software without restriction, including without limitation the rights to use, 
+copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the 
+Software, and to permit persons to whom the Software is furnished to do so, 
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all 
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS 
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR 
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER 
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN 
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+
+#ifndef HH_MPM_SURFACERENDERER_HH
+#define HH_MPM_SURFACERENDERER_HH
+
+#include <stdint.h>
+
+class FluidSim;
+class ThreadPool;
+
+// Draws each fluid as a continuous liquid from the mass its particles spread
+// onto its grid.  Marching squares classifies every grid cell against the 
+// iso level: cells entirely inside are filled as a block, cells the contour 
+// passes through are filled per pixel from the bilinear mass, and the rest 
+// are skipped, so the cost follows grid size rather than particle count.
+class SurfaceRenderer
+{
+public:
+	explicit SurfaceRenderer(ThreadPool * pool);
+	~SurfaceRenderer();
+
+	void	Render(const FluidSim * sim, int32_t * pixels, int width, int height);
+
+	// Iso level as a fraction of each fluid's rest density
+	float	Threshold;
+
+private:
+	SurfaceRenderer(const SurfaceRenderer &);
+	SurfaceRenderer & operator = (const SurfaceRenderer &);
+
+	static void RenderRow(void * data, int row);
+
+	ThreadPool *		pool;
+	const FluidSim *	pSim;
+	int32_t *			pPixels;
+	int					nWidth;
+	int					nHeight;
+};
+
+#endif // HH_MPM_SURFACERENDERER_HH
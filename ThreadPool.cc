@@ -0,0 +1,164 @@
+/*
+Copyright (c) 2012 Chris Lentini
+http://divergentcoder.com
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of 
+this software and associated documentation files (the "Software"), to deal in 
+the Software without restriction, including without limitation the rights to use, 
+copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the 
+Software, and to permit persons to whom the Software is furnished to do so, 
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all 
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS 
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR 
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER 
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN 
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+
+#include <unistd.h>
+#include "ThreadPool.h"
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// ------------------------------- ThreadPool ---------------------------------
+//
+///////////////////////////////////////////////////////////////////////////////
+ThreadPool::ThreadPool(int threads)
+:	task(NULL),
+	pData(NULL),
+	nCount(0),
+	nNext(0),
+	nFinished(0),
+	nActive(0),
+	nGeneration(0),
+	nThreads(threads > 0 ? threads : CPUCount()),
+	bQuit(false)
+{
+	pthread_mutex_init(&mutex, NULL);
+	pthread_cond_init(&wake, NULL);
+	pthread_cond_init(&done, NULL);
+
+	// The calling thread works too, so one fewer worker is needed
+	for (int i=1; i<nThreads; i++)
+	{
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, &WorkerMain, this) != 0)
+			break;
+		workers.push_back(thread);
+	}
+	nThreads = workers.size() + 1;
+}
+///////////////////////////////////////////////////////////////////////////////
+ThreadPool::~ThreadPool()
+{
+	pthread_mutex_lock(&mutex);
+	bQuit = true;
+	pthread_cond_broadcast(&wake);
+	pthread_mutex_unlock(&mutex);
+
+	for (unsigned i=0; i<workers.size(); i++)
+		pthread_join(workers[i], NULL);
+
+	pthread_cond_destroy(&done);
+	pthread_cond_destroy(&wake);
+	pthread_mutex_destroy(&mutex);
+}
+///////////////////////////////////////////////////////////////////////////////
+void ThreadPool::Run(Task t, void * data, int count)
+{
+	if (count <= 0)
+		return;
+
+	if (workers.empty() || count == 1)
+	{
+		for (int i=0; i<count; i++)
+			t(data, i);
+		return;
+	}
+
+	pthread_mutex_lock(&mutex);
+	task = t;
+	pData = data;
+	nCount = count;
+	nNext = 0;
+	nFinished = 0;
+	nGeneration++;
+	pthread_cond_broadcast(&wake);
+	pthread_mutex_unlock(&mutex);
+
+	Work();
+
+	// Wait for stragglers to leave Work() too, so none of them can pick up
+	// an index belonging to the next Run
+	pthread_mutex_lock(&mutex);
+	while (nFinished < nCount || nActive > 0)
+		pthread_cond_wait(&done, &mutex);
+	task = NULL;
+	pthread_mutex_unlock(&mutex);
+}
+///////////////////////////////////////////////////////////////////////////////
+int ThreadPool::CPUCount()
+{
+#if defined(_SC_NPROCESSORS_ONLN)
+	long count = sysconf(_SC_NPROCESSORS_ONLN);
+	return count > 0 ? (int) count : 1;
+#else
+	return 1;
+#endif
+}
+///////////////////////////////////////////////////////////////////////////////
+void * ThreadPool::WorkerMain(void * arg)
+{
+	ThreadPool * pool = (ThreadPool *) arg;
+	unsigned generation = 0;
+
+	pthread_mutex_lock(&pool->mutex);
+	for (;;)
+	{
+		while (!pool->bQuit && (pool->task == NULL || pool->nGeneration == generation))
+			pthread_cond_wait(&pool->wake, &pool->mutex);
+		if (pool->bQuit)
+			break;
+
+		generation = pool->nGeneration;
+		pool->nActive++;
+		pthread_mutex_unlock(&pool->mutex);
+
+		pool->Work();
+
+		pthread_mutex_lock(&pool->mutex);
+		pool->nActive--;
+		if (pool->nActive == 0)
+			pthread_cond_signal(&pool->done);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+	return NULL;
+}
+///////////////////////////////////////////////////////////////////////////////
+void ThreadPool::Work()
+{
+	// Indices are handed out one at a time so uneven tasks balance out
+	int finished = 0;
+	for (;;)
+	{
+		int index = __sync_fetch_and_add(&nNext, 1);
+		if (index >= nCount)
+			break;
+		task(pData, index);
+		finished++;
+	}
+
+	if (finished == 0)
+		return;
+
+	pthread_mutex_lock(&mutex);
+	nFinished += finished;
+	pthread_mutex_unlock(&mutex);
+}
+///////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,71 @@
+/*
+Copyright (c) 2012 Chris Lentini
+http://divergentcoder.com
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of 
+this software and associated documentation files (the "Software"), to deal in 
+the Software without restriction, including without limitation the rights to use, 
+copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the 
+Software, and to permit persons to whom the Software is furnished to do so, 
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all 
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS 
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR 
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER 
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN 
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+
+#ifndef HH_MPM_THREADPOOL_HH
+#define HH_MPM_THREADPOOL_HH
+
+#include <pthread.h>
+#include <vector>
+
+// Fixed set of worker threads for data parallel loops.  Run() splits a range
+// of task indices between the workers and the calling thread and returns 
+// once every index has been processed.
+class ThreadPool
+{
+public:
+	typedef void (*Task)(void * data, int index);
+
+	// A thread count of 0 uses one thread per online CPU
+	explicit ThreadPool(int threads = 0);
+	~ThreadPool();
+
+	void	Run(Task task, void * data, int count);
+
+	int		GetThreadCount() const { return nThreads; }
+
+	static int CPUCount();
+
+private:
+	ThreadPool(const ThreadPool &);
+	ThreadPool & operator = (const ThreadPool &);
+
+	static void * WorkerMain(void * arg);
+	void	Work();
+
+	std::vector<pthread_t>	workers;
+	pthread_mutex_t		mutex;
+	pthread_cond_t		wake;
+	pthread_cond_t		done;
+
+	Task				task;
+	void *				pData;
+	int					nCount;
+	volatile int		nNext;			// next index to hand out
+	int					nFinished;		// indices completed
+	int					nActive;		// workers inside Work()
+	unsigned			nGeneration;	// bumped for every Run
+	int					nThreads;
+	bool				bQuit;
+};
+
+#endif // HH_MPM_THREADPOOL_HH
@@ -0,0 +1,669 @@
+/*
+Copyright (c) 2012 Chris Lentini
+http://divergentcoder.com
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of 
+this software and associated documentation files (the "Software"), to deal in 
+the Software without restriction, including without limitation the rights to use, 
+copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the 
+Software, and to permit persons to whom the Software is furnished to do so, 
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all 
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS 
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR 
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER 
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN 
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+
+#include <algorithm>
+#include <fcntl.h>
+#include <math.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "Fluid.h"
+#include "Trajectory.h"
+
+// Bump whenever the layout or the coding below changes
+#define TRAJECTORY_VERSION	1
+
+#define CHUNK_FRAMES	64
+#define POS_SCALE		256.f	// quantization steps per grid cell
+#define VEL_SCALE		256.f	// steps per grid cell per simulation step
+#define QUANT_LIMIT		(1 << 22)
+
+// File layout: this header, then chunks, each a ChunkHeader followed by its
+// frames, then an array of IndexEntry and an IndexTrailer.  Files cut short
+// without an index can still be read by walking the chunk headers.
+struct TrajectoryHeader
+{
+	char		magic[4];		// "NFTR"
+	uint32_t	version;
+	int32_t		gwidth;
+	int32_t		gheight;
+	uint32_t	chunkframes;
+	uint32_t	reserved[3];
+};
+
+struct ChunkHeader
+{
+	char		magic[4];		// "NFTC"
+	uint32_t	first;
+	uint32_t	frames;
+	uint32_t	bytes;
+};
+
+struct IndexTrailer
+{
+	uint64_t	offset;			// of the first IndexEntry
+	uint32_t	chunks;
+	uint32_t	frames;
+	char		magic[4];		// "NFTI"
+	uint32_t	reserved;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+static int32_t Quantize(float v, float scale)
+{
+	float q = floorf(v * scale + 0.5f);
+	q = std::min(std::max(q, (float) -QUANT_LIMIT), (float) QUANT_LIMIT);
+	return (int32_t) q;
+}
+///////////////////////////////////////////////////////////////////////////////
+static void PutVarint(std::vector<unsigned char> & out, uint32_t v)
+{
+	while (v >= 0x80)
+	{
+		out.push_back((v & 0x7f) | 0x80);
+		v >>= 7;
+	}
+	out.push_back(v);
+}
+///////////////////////////////////////////////////////////////////////////////
+static bool GetVarint(const unsigned char *& p, const unsigned char * end, 
+	uint32_t * v)
+{
+	*v = 0;
+	for (int shift=0; shift<35; shift+=7)
+	{
+		if (p >= end)
+			return false;
+		unsigned char b = *p++;
+		*v |= (uint32_t)(b & 0x7f) << shift;
+		if (!(b & 0x80))
+			return true;
+	}
+	return false;
+}
+///////////////////////////////////////////////////////////////////////////////
+// Four signed values, zigzag coded, behind a byte of 2 bit codes: 0 for zero,
+// 1 for a nibble, 2 for a byte and 3 for a varint.  The nibbles are packed
+// first, two to a byte, followed by the wider values in order.
+static void PutGroup(std::vector<unsigned char> & out, const int32_t * v)
+{
+	uint32_t z[4];
+	unsigned codes = 0;
+	unsigned nibbles = 0;
+	int nibblecount = 0;
+	for (int i=0; i<4; i++)
+	{
+		z[i] = ((uint32_t) v[i] << 1) ^ (uint32_t)(v[i] >> 31);
+		int code = z[i] == 0 ? 0 : (z[i] < 0x10 ? 1 : (z[i] < 0x100 ? 2 : 3));
+		codes |= code << (i * 2);
+		if (code == 1)
+			nibbles |= z[i] << (4 * nibblecount++);
+	}
+
+	out.push_back(codes);
+	for (int i=0; i<nibblecount; i+=2)
+		out.push_back((nibbles >> (i * 4)) & 0xff);
+
+	for (int i=0; i<4; i++)
+	{
+		int code = (codes >> (i * 2)) & 3;
+		if (code == 2)
+			out.push_back(z[i]);
+		else if (code == 3)
+			PutVarint(out, z[i]);
+	}
+}
+///////////////////////////////////////////////////////////////////////////////
+static bool GetGroup(const unsigned char *& p, const unsigned char * end,
+	int32_t * v)
+{
+	if (p >= end)
+		return false;
+	unsigned codes = *p++;
+
+	int nibblecount = 0;
+	for (int i=0; i<4; i++)
+	{
+		if (((codes >> (i * 2)) & 3) == 1)
+			nibblecount++;
+	}
+	if (end - p < (nibblecount + 1) / 2)
+		return false;
+
+	unsigned nibbles = 0;
+	for (int i=0; i<nibblecount; i+=2)
+		nibbles |= (unsigned) *p++ << (i * 4);
+
+	for (int i=0, n=0; i<4; i++)
+	{
+		uint32_t z = 0;
+		switch ((codes >> (i * 2)) & 3)
+		{
+		case 1:
+			z = (nibbles >> (4 * n++)) & 0xf;
+			break;
+		case 2:
+			if (p >= end)
+				return false;
+			z = *p++;
+			break;
+		case 3:
+			if (!GetVarint(p, end, &z))
+				return false;
+			break;
+		}
+		v[i] = (int32_t)(z >> 1) ^ -(int32_t)(z & 1);
+	}
+	return true;
+}
+///////////////////////////////////////////////////////////////////////////////
+//
+// ---------------------------- TrajectoryWriter ------------------------------
+//
+///////////////////////////////////////////////////////////////////////////////
+TrajectoryWriter::TrajectoryWriter()
+:	pFile(NULL),
+	nOffset(0),
+	nFrames(0),
+	nQueued(0),
+	nNext(0),
+	bFailed(false),
+	bQuit(false),
+	bStarted(false)
+{
+	pthread_mutex_init(&mutex, NULL);
+	pthread_cond_init(&ready, NULL);
+	pthread_cond_init(&written, NULL);
+	bStarted = pthread_create(&worker, NULL, &WorkerMain, this) == 0;
+}
+///////////////////////////////////////////////////////////////////////////////
+TrajectoryWriter::~TrajectoryWriter()
+{
+	Close();
+
+	if (bStarted)
+	{
+		pthread_mutex_lock(&mutex);
+		bQuit = true;
+		pthread_cond_signal(&ready);
+		pthread_mutex_unlock(&mutex);
+		pthread_join(worker, NULL);
+	}
+
+	pthread_cond_destroy(&written);
+	pthread_cond_destroy(&ready);
+	pthread_mutex_destroy(&mutex);
+}
+///////////////////////////////////////////////////////////////////////////////
+bool TrajectoryWriter::Open(const char * path, const FluidSim * sim)
+{
+	Close();
+
+	pFile = fopen(path, "wb");
+	if (!pFile)
+		return false;
+
+	TrajectoryHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, "NFTR", 4);
+	header.version = TRAJECTORY_VERSION;
+	header.gwidth = sim->GWidth;
+	header.gheight = sim->GHeight;
+	header.chunkframes = CHUNK_FRAMES;
+
+	bFailed = fwrite(&header, sizeof(header), 1, pFile) != 1;
+	nOffset = sizeof(header);
+	nFrames = 0;
+	index.clear();
+	current.data.clear();
+	current.first = 0;
+	current.frames = 0;
+	return !bFailed;
+}
+///////////////////////////////////////////////////////////////////////////////
+void TrajectoryWriter::Record(const FluidSim * sim)
+{
+	if (!pFile)
+		return;
+
+	// Every chunk codes its first frame from nothing
+	if (current.frames == 0)
+	{
+		current.first = nFrames;
+		state.clear();
+	}
+
+	std::vector<unsigned char> & out = current.data;
+	int fluids = sim->Fluids.size();
+	state.resize(fluids);
+	PutVarint(out, fluids);
+
+	for (int f=0; f<fluids; f++)
+	{
+		const Fluid * fluid = sim->Fluids[f];
+		std::vector<int32_t> & s = state[f];
+		int count = fluid->Particles.size();
+		int previous = s.size() / 4;
+		s.resize(std::max(count, previous) * 4);
+
+		uint32_t color = fluid->Color;
+		for (int b=0; b<4; b++)
+			out.push_back((color >> (b * 8)) & 0xff);
+		PutVarint(out, count);
+
+		for (int i=0; i<count; i++)
+		{
+			const Particle & p = fluid->Particles[i];
+			int32_t * q = &s[i * 4];
+			int32_t x = Quantize(p.x, POS_SCALE);
+			int32_t y = Quantize(p.y, POS_SCALE);
+			int32_t vx = Quantize(p.vx, VEL_SCALE);
+			int32_t vy = Quantize(p.vy, VEL_SCALE);
+
+			// Positions are predicted by moving at the previous velocity and 
+			// velocities by the distance actually moved; both are exact for 
+			// particles that keep their speed
+			int32_t v[4];
+			if (i < previous)
+			{
+				v[0] = x - (q[0] + q[2]);
+				v[1] = y - (q[1] + q[3]);
+				v[2] = vx - (x - q[0]);
+				v[3] = vy - (y - q[1]);
+			}
+			else
+			{
+				v[0] = x;
+				v[1] = y;
+				v[2] = vx;
+				v[3] = vy;
+			}
+			PutGroup(out, v);
+
+			q[0] = x;
+			q[1] = y;
+			q[2] = vx;
+			q[3] = vy;
+		}
+		s.resize(count * 4);
+	}
+
+	nFrames++;
+	if (++current.frames == CHUNK_FRAMES)
+		QueueChunk();
+}
+///////////////////////////////////////////////////////////////////////////////
+void TrajectoryWriter::QueueChunk()
+{
+	pthread_mutex_lock(&mutex);
+	while (nQueued == 2)
+		pthread_cond_wait(&written, &mutex);
+	pthread_mutex_unlock(&mutex);
+
+	// The free slot's buffer, already written, becomes the next chunk's so
+	// no memory is allocated once capacities settle
+	Chunk & slot = chunks[nNext];
+	slot.data.swap(current.data);
+	slot.first = current.first;
+	slot.frames = current.frames;
+	current.data.clear();
+	current.frames = 0;
+
+	if (!bStarted)
+	{
+		if (!WriteChunk(slot))
+			bFailed = true;
+		return;
+	}
+
+	pthread_mutex_lock(&mutex);
+	nNext ^= 1;
+	nQueued++;
+	pthread_cond_signal(&ready);
+	pthread_mutex_unlock(&mutex);
+}
+///////////////////////////////////////////////////////////////////////////////
+bool TrajectoryWriter::Close()
+{
+	if (!pFile)
+		return false;
+
+	if (current.frames > 0)
+		QueueChunk();
+
+	pthread_mutex_lock(&mutex);
+	while (nQueued > 0)
+		pthread_cond_wait(&written, &mutex);
+	pthread_mutex_unlock(&mutex);
+
+	IndexTrailer trailer;
+	memset(&trailer, 0, sizeof(trailer));
+	trailer.offset = nOffset;
+	trailer.chunks = index.size();
+	trailer.frames = nFrames;
+	memcpy(trailer.magic, "NFTI", 4);
+
+	bool ok = !bFailed &&
+		(index.empty() || 
+		fwrite(&index[0], sizeof(IndexEntry), index.size(), pFile) == index.size()) &&
+		fwrite(&trailer, sizeof(trailer), 1, pFile) == 1;
+	ok = (fclose(pFile) == 0) && ok;
+	pFile = NULL;
+	bFailed = !ok;
+	return ok;
+}
+///////////////////////////////////////////////////////////////////////////////
+void * TrajectoryWriter::WorkerMain(void * arg)
+{
+	((TrajectoryWriter *) arg)->Work();
+	return NULL;
+}
+///////////////////////////////////////////////////////////////////////////////
+void TrajectoryWriter::Work()
+{
+	pthread_mutex_lock(&mutex);
+	for (;;)
+	{
+		while (nQueued == 0 && !bQuit)
+			pthread_cond_wait(&ready, &mutex);
+		if (nQueued == 0)
+			break;
+
+		// Chunks are written in the order they were queued
+		const Chunk & chunk = chunks[nQueued == 2 ? nNext : nNext ^ 1];
+		pthread_mutex_unlock(&mutex);
+
+		bool ok = WriteChunk(chunk);
+
+		pthread_mutex_lock(&mutex);
+		if (!ok)
+			bFailed = true;
+		nQueued--;
+		pthread_cond_broadcast(&written);
+	}
+	pthread_mutex_unlock(&mutex);
+}
+///////////////////////////////////////////////////////////////////////////////
+bool TrajectoryWriter::WriteChunk(const Chunk & chunk)
+{
+	ChunkHeader header;
+	memcpy(header.magic, "NFTC", 4);
+	header.first = chunk.first;
+	header.frames = chunk.frames;
+	header.bytes = chunk.data.size();
+
+	IndexEntry entry = { nOffset, (uint32_t) chunk.first, (uint32_t) chunk.frames };
+	index.push_back(entry);
+	nOffset += sizeof(header) + chunk.data.size();
+
+	return fwrite(&header, sizeof(header), 1, pFile) == 1 &&
+		fwrite(&chunk.data[0], 1, chunk.data.size(), pFile) == chunk.data.size();
+}
+///////////////////////////////////////////////////////////////////////////////
+//
+// ---------------------------- TrajectoryReader ------------------------------
+//
+///////////////////////////////////////////////////////////////////////////////
+TrajectoryReader::TrajectoryReader()
+:	pData(NULL),
+	nSize(0),
+	pCursor(NULL),
+	pChunkEnd(NULL),
+	nChunk(-1),
+	nFrame(-1),
+	nFrames(0),
+	nGridWidth(0),
+	nGridHeight(0)
+{}
+///////////////////////////////////////////////////////////////////////////////
+TrajectoryReader::~TrajectoryReader()
+{
+	Close();
+}
+///////////////////////////////////////////////////////////////////////////////
+bool TrajectoryReader::Open(const char * path)
+{
+	Close();
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	struct stat info;
+	if (fstat(fd, &info) != 0 || info.st_size < (off_t) sizeof(TrajectoryHeader))
+	{
+		close(fd);
+		return false;
+	}
+
+	nSize = info.st_size;
+	void * mapping = mmap(NULL, nSize, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mapping == MAP_FAILED)
+	{
+		nSize = 0;
+		return false;
+	}
+	pData = (const unsigned char *) mapping;
+
+	const TrajectoryHeader * header = (const TrajectoryHeader *) pData;
+	if (memcmp(header->magic, "NFTR", 4) != 0 || 
+		header->version != TRAJECTORY_VERSION)
+	{
+		Close();
+		return false;
+	}
+	nGridWidth = header->gwidth;
+	nGridHeight = header->gheight;
+
+	// Use the index when the file was closed properly
+	const IndexTrailer * trailer = (const IndexTrailer *)
+		(pData + nSize - sizeof(IndexTrailer));
+	if (nSize >= sizeof(TrajectoryHeader) + sizeof(IndexTrailer) &&
+		memcmp(trailer->magic, "NFTI", 4) == 0 &&
+		trailer->offset + (uint64_t) trailer->chunks * 16 + 
+			sizeof(IndexTrailer) == nSize)
+	{
+		const unsigned char * entries = pData + trailer->offset;
+		for (uint32_t i=0; i<trailer->chunks; i++)
+		{
+			ChunkInfo c;
+			memcpy(&c.offset, entries + i * 16, 8);
+			uint32_t first, frames;
+			memcpy(&first, entries + i * 16 + 8, 4);
+			memcpy(&frames, entries + i * 16 + 12, 4);
+			c.first = first;
+			c.frames = frames;
+			if (c.offset + sizeof(ChunkHeader) > trailer->offset)
+			{
+				Close();
+				return false;
+			}
+			chunks.push_back(c);
+		}
+		nFrames = trailer->frames;
+	}
+	else if (!ScanChunks())
+	{
+		Close();
+		return false;
+	}
+	return nFrames > 0;
+}
+///////////////////////////////////////////////////////////////////////////////
+bool TrajectoryReader::ScanChunks()
+{
+	uint64_t offset = sizeof(TrajectoryHeader);
+	nFrames = 0;
+
+	while (offset + sizeof(ChunkHeader) <= nSize)
+	{
+		ChunkHeader header;
+		memcpy(&header, pData + offset, sizeof(header));
+		if (memcmp(header.magic, "NFTC", 4) != 0 ||
+			offset + sizeof(header) + header.bytes > nSize ||
+			(int) header.first != nFrames)
+		{
+			break;
+		}
+
+		ChunkInfo c = { offset, (int) header.first, (int) header.frames };
+		chunks.push_back(c);
+		nFrames += header.frames;
+		offset += sizeof(header) + header.bytes;
+	}
+	return !chunks.empty();
+}
+///////////////////////////////////////////////////////////////////////////////
+void TrajectoryReader::Close()
+{
+	if (pData)
+		munmap((void *) pData, nSize);
+	pData = NULL;
+	nSize = 0;
+	chunks.clear();
+	state.clear();
+	pCursor = pChunkEnd = NULL;
+	nChunk = -1;
+	nFrame = -1;
+	nFrames = 0;
+}
+///////////////////////////////////////////////////////////////////////////////
+bool TrajectoryReader::ReadFrame(int frame, FluidSim * sim)
+{
+	if (!pData || frame < 0 || frame >= nFrames)
+		return false;
+
+	// Chunks are in frame order
+	int lo = 0, hi = chunks.size() - 1;
+	while (lo < hi)
+	{
+		int mid = (lo + hi + 1) / 2;
+		if (chunks[mid].first <= frame)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+
+	if (lo != nChunk || frame <= nFrame)
+	{
+		const ChunkInfo & c = chunks[lo];
+		ChunkHeader header;
+		memcpy(&header, pData + c.offset, sizeof(header));
+		if (c.offset + sizeof(header) + header.bytes > nSize)
+			return false;
+
+		pCursor = pData + c.offset + sizeof(header);
+		pChunkEnd = pCursor + header.bytes;
+		nChunk = lo;
+		nFrame = c.first - 1;
+		state.clear();
+	}
+
+	while (nFrame < frame)
+	{
+		if (!DecodeFrame(sim))
+		{
+			nChunk = -1;
+			return false;
+		}
+		nFrame++;
+	}
+	sim->BuildIndex();
+	return true;
+}
+///////////////////////////////////////////////////////////////////////////////
+bool TrajectoryReader::DecodeFrame(FluidSim * sim)
+{
+	uint32_t fluids;
+	if (!GetVarint(pCursor, pChunkEnd, &fluids) || fluids > 1024)
+		return false;
+
+	while (sim->Fluids.size() > fluids)
+	{
+		delete sim->Fluids.back();
+		sim->Fluids.pop_back();
+	}
+	while (sim->Fluids.size() < fluids)
+		sim->Fluids.push_back(new Fluid(sim->GWidth, sim->GHeight));
+	state.resize(fluids);
+
+	for (uint32_t f=0; f<fluids; f++)
+	{
+		Fluid * fluid = sim->Fluids[f];
+		std::vector<int32_t> & s = state[f];
+
+		uint32_t color = 0, count;
+		if (pChunkEnd - pCursor < 4)
+			return false;
+		for (int b=0; b<4; b++)
+			color |= (uint32_t) *pCursor++ << (b * 8);
+		if (!GetVarint(pCursor, pChunkEnd, &count) || 
+			count > (uint32_t)(pChunkEnd - pCursor))
+		{
+			return false;
+		}
+
+		// Every particle takes at least its tag byte, so 'count' is sane
+		int previous = s.size() / 4;
+		s.resize(std::max((int) count, previous) * 4);
+		fluid->Color = color;
+		fluid->Particles.resize(count);
+		fluid->Weights.resize(count);
+
+		for (uint32_t i=0; i<count; i++)
+		{
+			int32_t v[4];
+			if (!GetGroup(pCursor, pChunkEnd, v))
+				return false;
+
+			int32_t * q = &s[i * 4];
+			if ((int) i < previous)
+			{
+				int32_t x = q[0] + q[2] + v[0];
+				int32_t y = q[1] + q[3] + v[1];
+				q[2] = (x - q[0]) + v[2];
+				q[3] = (y - q[1]) + v[3];
+				q[0] = x;
+				q[1] = y;
+			}
+			else
+			{
+				q[0] = v[0];
+				q[1] = v[1];
+				q[2] = v[2];
+				q[3] = v[3];
+			}
+
+			Particle & p = fluid->Particles[i];
+			p.x = q[0] / POS_SCALE;
+			p.y = q[1] / POS_SCALE;
+			p.vx = q[2] / VEL_SCALE;
+			p.vy = q[3] / VEL_SCALE;
+		}
+		s.resize(count * 4);
+	}
+	return true;
+}
+///////////////////////////////////////////////////////////////////////////////
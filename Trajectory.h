@@ -0,0 +1,150 @@
+/*
+Copyright (c) 2012 Chris Lentini
+http://divergentcoder.com
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of 
+this software and associated documentation files (the "Software"), to deal in 
+the Software without restriction, including without limitation the rights to use, 
+copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the 
+Software, and to permit persons to whom the Software is furnished to do so, 
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all 
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS 
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR 
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER 
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN 
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+
+#ifndef HH_MPM_TRAJECTORY_HH
+#define HH_MPM_TRAJECTORY_HH
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <vector>
+
+class FluidSim;
+
+// Particle trajectories are stored per frame with positions quantized to 
+// 1/256 of a grid cell and velocities to 1/256 of a cell per step.  Within a
+// chunk each particle is coded against its previous frame - position as the 
+// residual from moving at the previous velocity, velocity as the residual 
+// from the distance moved - so a smoothly moving fluid costs two or three
+// bytes per particle.  
+// Each chunk starts afresh and an index of chunks at the end of the file 
+// lets a reader seek to any frame by decoding at most one chunk.
+
+// Streams frames to disk.  Record() encodes on the calling thread into the 
+// current chunk; finished chunks are written by a background thread, with at
+// most two waiting, so memory stays bounded however long the capture.
+class TrajectoryWriter
+{
+public:
+	TrajectoryWriter();
+	~TrajectoryWriter();
+
+	bool	Open(const char * path, const FluidSim * sim);
+	void	Record(const FluidSim * sim);
+
+	// Writes the last partial chunk and the frame index
+	bool	Close();
+
+	bool	IsOpen() const { return pFile != NULL; }
+	int		GetFrameCount() const { return nFrames; }
+	bool	HasFailed() const { return bFailed; }
+
+private:
+	TrajectoryWriter(const TrajectoryWriter &);
+	TrajectoryWriter & operator = (const TrajectoryWriter &);
+
+	struct Chunk
+	{
+		std::vector<unsigned char>	data;
+		int							first;	// first frame
+		int							frames;
+	};
+
+	struct IndexEntry
+	{
+		uint64_t	offset;
+		uint32_t	first;
+		uint32_t	frames;
+	};
+
+	void	QueueChunk();
+	static void * WorkerMain(void * arg);
+	void	Work();
+	bool	WriteChunk(const Chunk & chunk);
+
+	FILE *					pFile;
+	Chunk					chunks[2];
+	Chunk					current;
+	std::vector< std::vector<int32_t> >	state;	// last coded frame per fluid
+	std::vector<IndexEntry>	index;			// owned by the worker until Close
+	uint64_t				nOffset;		// file position of the next chunk
+	int						nFrames;
+
+	int						nQueued;
+	int						nNext;
+	pthread_t				worker;
+	pthread_mutex_t			mutex;
+	pthread_cond_t			ready;
+	pthread_cond_t			written;
+	bool					bFailed;
+	bool					bQuit;
+	bool					bStarted;
+};
+
+// Decodes frames back into a FluidSim's fluids for rendering or analysis
+class TrajectoryReader
+{
+public:
+	TrajectoryReader();
+	~TrajectoryReader();
+
+	bool	Open(const char * path);
+	void	Close();
+
+	int		GetFrameCount() const { return nFrames; }
+	int		GetGridWidth() const { return nGridWidth; }
+	int		GetGridHeight() const { return nGridHeight; }
+
+	// Replaces the fluids' particles, velocities and colors with 'frame'; 
+	// fluids are created or deleted to match.  Reading frames in order 
+	// decodes each only once.
+	bool	ReadFrame(int frame, FluidSim * sim);
+
+private:
+	TrajectoryReader(const TrajectoryReader &);
+	TrajectoryReader & operator = (const TrajectoryReader &);
+
+	struct ChunkInfo
+	{
+		uint64_t	offset;
+		int			first;
+		int			frames;
+	};
+
+	bool	DecodeFrame(FluidSim * sim);
+	bool	ScanChunks();
+
+	const unsigned char *	pData;
+	size_t					nSize;
+	std::vector<ChunkInfo>	chunks;
+	std::vector< std::vector<int32_t> >	state;
+	const unsigned char *	pCursor;	// next frame in the current chunk
+	const unsigned char *	pChunkEnd;
+	int						nChunk;
+	int						nFrame;		// last decoded frame, or -1
+	int						nFrames;
+	int						nGridWidth;
+	int						nGridHeight;
+};
+
+#endif // HH_MPM_TRAJECTORY_HH
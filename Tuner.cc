@@ -0,0 +1,362 @@
+/*
+Copyright (c) 2012 Chris Lentini
+http://divergentcoder.com
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of 
+this software and associated documentation files (the "Software"), to deal in 
+the Software without restriction, including without limitation the rights to use, 
+copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the 
+Software, and to permit persons to whom the Software is furnished to do so, 
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all 
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS 
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR 
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER 
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN 
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+
+#include <algorithm>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "Util.h"
+#include "Fluid.h"
+#include "ThreadPool.h"
+#include "Tuner.h"
+
+// Steps run before timing, so the particles have left their starting grid
+#define WARMUP_STEPS	3
+// Fewest timed steps per trial, whatever the budget
+#define MIN_STEPS		3
+// A candidate must beat the best so far by this much to replace it, so 
+// timing noise doesn't pick settings at random
+#define MIN_GAIN		0.03
+
+static const int gParticleChunks[] = { 256, 512, 1024, 2048, 4096 };
+static const int gCellChunks[] = { 1024, 4096, 16384 };
+
+#define ARRAY_COUNT(a) ((int)(sizeof(a) / sizeof((a)[0])))
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// ------------------------------ TuneSettings -------------------------------- 
+//
+///////////////////////////////////////////////////////////////////////////////
+TuneSettings::TuneSettings()
+:	Threads(ThreadPool::CPUCount()),
+	ParticleChunk(1024),
+	CellChunk(4096)
+{}
+///////////////////////////////////////////////////////////////////////////////
+//
+// --------------------------------- Tuner ------------------------------------ 
+//
+///////////////////////////////////////////////////////////////////////////////
+
+// Two fluids dropped as a block into an empty tank, about the size of the 
+// default scene
+static FluidSim * CreateLoad()
+{
+	FluidSim * sim = new FluidSim(128, 128, 0.5f);
+	sim->SDF.Freeze();
+
+	for (int f=0; f<2; f++)
+	{
+		Fluid * fluid = new Fluid(sim->GWidth, sim->GHeight);
+		fluid->Density = f ? 1.f : 2.f;
+		fluid->Viscosity = f ? 4.f : 0.f;
+		sim->Fluids.push_back(fluid);
+
+		for (int y=0; y<80; y++)
+		{
+			for (int x=0; x<100; x++)
+			{
+				fluid->AddParticle(40.f + f * 100.f + x * 0.6f, 
+					60.f + y * 0.6f, 0.f, 0.f);
+			}
+		}
+	}
+	return sim;
+}
+///////////////////////////////////////////////////////////////////////////////
+// Median nanoseconds per Update() with the given settings
+static double TimeTrial(const TuneSettings & settings, ThreadPool * pool, 
+	int64_t budget)
+{
+	FluidSim * sim = CreateLoad();
+	Tuner::Apply(settings, sim);
+	sim->Threads = pool;
+	for (int i=0; i<WARMUP_STEPS; i++)
+		sim->Update();
+
+	std::vector<int64_t> times;
+	int64_t end = GetTimeNS() + budget;
+	while ((int) times.size() < MIN_STEPS || GetTimeNS() < end)
+	{
+		int64_t start = GetTimeNS();
+		sim->Update();
+		times.push_back(GetTimeNS() - start);
+	}
+	delete sim;
+
+	std::nth_element(times.begin(), times.begin() + times.size() / 2, 
+		times.end());
+	return (double) times[times.size() / 2];
+}
+///////////////////////////////////////////////////////////////////////////////
+TuneSettings Tuner::Run(int64_t budget)
+{
+	std::vector<int> threads;
+	int cpus = ThreadPool::CPUCount();
+	for (int n=1; n<cpus; n*=2)
+		threads.push_back(n);
+	threads.push_back(cpus);
+
+	int trials = threads.size() + ARRAY_COUNT(gParticleChunks) + 
+		ARRAY_COUNT(gCellChunks);
+	int64_t slice = budget / std::max(1, trials);
+
+	// A single thread runs everything on the caller, without a pool
+	TuneSettings best;
+	ThreadPool * pool = NULL;
+	double besttime = 0.0;
+	for (int i=0, lim=threads.size(); i<lim; i++)
+	{
+		TuneSettings settings = best;
+		settings.Threads = threads[i];
+		ThreadPool * trial = threads[i] > 1 ? new ThreadPool(threads[i]) : NULL;
+		double t = TimeTrial(settings, trial, slice);
+		if (i == 0 || t < besttime * (1.0 - MIN_GAIN))
+		{
+			best = settings;
+			besttime = t;
+			std::swap(pool, trial);
+		}
+		delete trial;
+	}
+
+	besttime = TimeTrial(best, pool, slice);
+	for (int i=0; i<ARRAY_COUNT(gParticleChunks); i++)
+	{
+		TuneSettings settings = best;
+		settings.ParticleChunk = gParticleChunks[i];
+		if (settings.ParticleChunk == best.ParticleChunk)
+			continue;
+
+		double t = TimeTrial(settings, pool, slice);
+		if (t < besttime * (1.0 - MIN_GAIN))
+		{
+			best = settings;
+			besttime = t;
+		}
+	}
+
+	for (int i=0; i<ARRAY_COUNT(gCellChunks); i++)
+	{
+		TuneSettings settings = best;
+		settings.CellChunk = gCellChunks[i];
+		if (settings.CellChunk == best.CellChunk)
+			continue;
+
+		double t = TimeTrial(settings, pool, slice);
+		if (t < besttime * (1.0 - MIN_GAIN))
+		{
+			best = settings;
+			besttime = t;
+		}
+	}
+
+	delete pool;
+	return best;
+}
+///////////////////////////////////////////////////////////////////////////////
+// Cache lines are "<host key>\t<threads> <particle chunk> <cell chunk>"; 
+// lines starting with '#' are comments
+static void ReadCache(const char * path, std::vector<std::string> & lines)
+{
+	FILE * file = fopen(path, "r");
+	if (!file)
+		return;
+
+	char line[512];
+	while (fgets(line, sizeof(line), file))
+	{
+		size_t len = strlen(line);
+		while (len > 0 && (line[len-1] == '\n' || line[len-1] == '\r'))
+			line[--len] = '\0';
+		if (len > 0 && line[0] != '#')
+			lines.push_back(line);
+	}
+	fclose(file);
+}
+///////////////////////////////////////////////////////////////////////////////
+bool Tuner::Load(const char * path, TuneSettings * out)
+{
+	std::vector<std::string> lines;
+	ReadCache(path, lines);
+
+	std::string key = GetHostKey() + "\t";
+	for (int i=0, lim=lines.size(); i<lim; i++)
+	{
+		if (lines[i].compare(0, key.size(), key) != 0)
+			continue;
+
+		TuneSettings settings;
+		if (sscanf(lines[i].c_str() + key.size(), "%d %d %d", &settings.Threads,
+			&settings.ParticleChunk, &settings.CellChunk) != 3 ||
+			settings.Threads < 1 || settings.ParticleChunk < 4 || 
+			settings.CellChunk < 4)
+		{
+			return false;
+		}
+
+		*out = settings;
+		return true;
+	}
+	return false;
+}
+///////////////////////////////////////////////////////////////////////////////
+bool Tuner::Save(const char * path, const TuneSettings & settings)
+{
+	std::vector<std::string> lines;
+	ReadCache(path, lines);
+
+	// Written aside and renamed over the cache, so other instances starting
+	// at the same time never read half a file
+	std::string key = GetHostKey() + "\t";
+	std::string temp = std::string(path) + ".tmp";
+	FILE * file = fopen(temp.c_str(), "w");
+	if (!file)
+		return false;
+
+	fprintf(file, "# host\tthreads particle-chunk cell-chunk\n");
+	for (int i=0, lim=lines.size(); i<lim; i++)
+	{
+		if (lines[i].compare(0, key.size(), key) != 0)
+			fprintf(file, "%s\n", lines[i].c_str());
+	}
+	fprintf(file, "%s%d %d %d\n", key.c_str(), settings.Threads, 
+		settings.ParticleChunk, settings.CellChunk);
+
+	bool ok = (fclose(file) == 0);
+	if (!ok || rename(temp.c_str(), path) != 0)
+	{
+		remove(temp.c_str());
+		return false;
+	}
+	return true;
+}
+///////////////////////////////////////////////////////////////////////////////
+void Tuner::Apply(const TuneSettings & settings, FluidSim * sim)
+{
+	// Held to the multiples of four the simulation splits work into
+	sim->ParticleChunk = std::max(4, settings.ParticleChunk & ~3);
+	sim->CellChunk = std::max(4, settings.CellChunk & ~3);
+}
+///////////////////////////////////////////////////////////////////////////////
+std::string Tuner::GetHostKey()
+{
+	std::string model = "unknown";
+	FILE * file = fopen("/proc/cpuinfo", "r");
+	if (file)
+	{
+		// x86 names the model per processor; some ARM kernels only give a 
+		// "Hardware" line
+		char line[512];
+		while (fgets(line, sizeof(line), file))
+		{
+			bool name = strncmp(line, "model name", 10) == 0;
+			if (!name && strncmp(line, "Hardware", 8) != 0)
+				continue;
+
+			const char * value = strchr(line, ':');
+			if (!value)
+				continue;
+
+			std::string s(value + 1);
+			size_t first = s.find_first_not_of(" \t");
+			size_t last = s.find_last_not_of(" \t\r\n");
+			if (first != std::string::npos)
+				model = s.substr(first, last - first + 1);
+			if (name)
+				break;
+		}
+		fclose(file);
+	}
+
+	// Tabs separate the key in the cache
+	std::replace(model.begin(), model.end(), '\t', ' ');
+
+	char cpus[32];
+	snprintf(cpus, sizeof(cpus), " x%d", ThreadPool::CPUCount());
+	return model + cpus;
+}
+///////////////////////////////////////////////////////////////////////////////
+//
+// -------------------------------- TuneTask ----------------------------------
+//
+///////////////////////////////////////////////////////////////////////////////
+TuneTask::TuneTask()
+:	nBudget(0),
+	bRunning(false),
+	bDone(false)
+{
+	pthread_mutex_init(&mutex, NULL);
+}
+///////////////////////////////////////////////////////////////////////////////
+TuneTask::~TuneTask()
+{
+	if (bRunning)
+		pthread_join(worker, NULL);
+	pthread_mutex_destroy(&mutex);
+}
+///////////////////////////////////////////////////////////////////////////////
+bool TuneTask::Start(int64_t budget)
+{
+	if (bRunning)
+		return false;
+
+	nBudget = budget;
+	bDone = false;
+	bRunning = pthread_create(&worker, NULL, &WorkerMain, this) == 0;
+	return bRunning;
+}
+///////////////////////////////////////////////////////////////////////////////
+bool TuneTask::Poll(TuneSettings * out)
+{
+	if (!bRunning)
+		return false;
+
+	pthread_mutex_lock(&mutex);
+	bool done = bDone;
+	if (done)
+		*out = result;
+	pthread_mutex_unlock(&mutex);
+
+	if (done)
+	{
+		pthread_join(worker, NULL);
+		bRunning = false;
+	}
+	return done;
+}
+///////////////////////////////////////////////////////////////////////////////
+void * TuneTask::WorkerMain(void * arg)
+{
+	TuneTask * task = (TuneTask *) arg;
+	TuneSettings settings = Tuner::Run(task->nBudget);
+
+	pthread_mutex_lock(&task->mutex);
+	task->result = settings;
+	task->bDone = true;
+	pthread_mutex_unlock(&task->mutex);
+	return NULL;
+}
+///////////////////////////////////////////////////////////////////////////////
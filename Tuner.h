@@ -0,0 +1,94 @@
+/*
+Copyright (c) 2012 Chris Lentini
+http://divergentcoder.com
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of 
+this software and associated documentation files (the "Software"), to deal in 
+the Software without restriction, including without limitation the rights to use, 
+copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the 
+Software, and to permit persons to whom the Software is furnished to do so, 
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all 
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS 
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR 
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER 
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN 
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+
+#ifndef HH_MPM_TUNER_HH
+#define HH_MPM_TUNER_HH
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string>
+
+class FluidSim;
+
+// Settings that only change how fast the simulation runs
+struct TuneSettings
+{
+	TuneSettings();
+
+	int		Threads;		// including the calling thread
+	int		ParticleChunk;
+	int		CellChunk;
+};
+
+// Picks the fastest settings for the host by timing short runs of Update() 
+// on a synthetic dam break.  Results are cached in a text file with one line
+// per CPU model and core count, so each kind of host tunes once.
+class Tuner
+{
+public:
+	// Tries the thread counts, then the particle and then the cell chunk 
+	// sizes, each keeping the best so far, in about 'budget' nanoseconds
+	static TuneSettings Run(int64_t budget);
+
+	static bool		Load(const char * path, TuneSettings * out);
+	// Adds or replaces this host's entry, keeping the others
+	static bool		Save(const char * path, const TuneSettings & settings);
+
+	static void		Apply(const TuneSettings & settings, FluidSim * sim);
+
+	// "<model name> x<online CPUs>" from /proc/cpuinfo, or "unknown x<n>"
+	static std::string GetHostKey();
+};
+
+// Runs Tuner::Run() on a worker thread so a caller with a display keeps 
+// drawing meanwhile.  The caller polls for the settings and applies them on
+// its own thread, where it can safely swap out the pools they change.
+class TuneTask
+{
+public:
+	TuneTask();
+	// Waits for any trials still running
+	~TuneTask();
+
+	// Starts the trials unless some are already running
+	bool	Start(int64_t budget);
+	bool	IsRunning() const { return bRunning; }
+
+	// True once, when the trials have finished, with their result in 'out'
+	bool	Poll(TuneSettings * out);
+
+private:
+	TuneTask(const TuneTask &);
+	TuneTask & operator = (const TuneTask &);
+
+	static void * WorkerMain(void * arg);
+
+	int64_t					nBudget;
+	TuneSettings			result;
+	pthread_t				worker;
+	pthread_mutex_t			mutex;
+	bool					bRunning;	// started and not yet polled done
+	bool					bDone;		// result is ready
+};
+
+#endif // HH_MPM_TUNER_HH
@@ -23,7 +23,10 @@ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #ifndef HH_SDFC_UTIL_HH
 #define HH_SDFC_UTIL_HH
 #include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <sys/time.h>
+#include <time.h>
 #include <algorithm>
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -34,18 +37,55 @@ inline int64_t GetTimeMS()
 	return (int64_t)(t.tv_sec) * 1000 + (t.tv_usec / 1000);
 }
 ///////////////////////////////////////////////////////////////////////////////
+// Monotonic, for measuring intervals too short for GetTimeMS
+inline int64_t GetTimeNS()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (int64_t)(t.tv_sec) * 1000000000 + t.tv_nsec;
+}
+///////////////////////////////////////////////////////////////////////////////
 inline float frand()
 {
 	return rand() / (float)RAND_MAX;
 }
 ///////////////////////////////////////////////////////////////////////////////
+// SplitMix64 finalizer - every input bit affects every output bit
+inline uint64_t MixBits(uint64_t x)
+{
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebULL;
+	x ^= x >> 31;
+	return x;
+}
+///////////////////////////////////////////////////////////////////////////////
+// Counter based random numbers.  A key names an independent stream for one 
+// simulation step, and the counter (usually a particle index) picks a value
+// from it, so the same numbers come out whichever thread draws them and in 
+// whatever order.
+inline uint64_t RandomKey(uint32_t seed, uint32_t step, uint32_t stream)
+{
+	return MixBits((((uint64_t) seed << 32) | step) ^ 
+		MixBits(stream + 0x9e3779b97f4a7c15ULL));
+}
+///////////////////////////////////////////////////////////////////////////////
+// Uniform in [0, 1)
+inline float frand(uint64_t key, uint32_t counter)
+{
+	uint64_t bits = MixBits(key + counter * 0x9e3779b97f4a7c15ULL);
+	return (bits >> 40) * (1.f / 16777216.f);
+}
+///////////////////////////////////////////////////////////////////////////////
 inline void DrawCircle(int32_t * pixels, int xres, int yres, int x, int y, 
-	int r, int rgb = 0xff0000ff)
+	int r, int rgb, int clipx0, int clipy0, int clipx1, int clipy1)
 {
-	int ulx = std::max(x - r, 0);
-	int uly = std::max(y - r, 0);
-	int lrx = std::min(x + r, xres - 1);
-	int lry = std::min(y + r, yres - 1);
+	// Only pixels inside [clipx0, clipx1) x [clipy0, clipy1) are written
+	int ulx = std::max(x - r, std::max(clipx0, 0));
+	int uly = std::max(y - r, std::max(clipy0, 0));
+	int lrx = std::min(std::min(x + r, xres - 1), clipx1);
+	int lry = std::min(std::min(y + r, yres - 1), clipy1);
 	for (int i=uly; i<lry; i++)
 	{
 		for (int j=ulx; j<lrx; j++)
@@ -59,9 +99,21 @@ inline void DrawCircle(int32_t * pixels, int xres, int yres, int x, int y,
 	}
 }
 ///////////////////////////////////////////////////////////////////////////////
+inline void DrawCircle(int32_t * pixels, int xres, int yres, int x, int y, 
+	int r, int rgb = 0xff0000ff)
+{
+	DrawCircle(pixels, xres, yres, x, y, r, rgb, 0, 0, xres, yres);
+}
+///////////////////////////////////////////////////////////////////////////////
 inline void DrawLine(int32_t * pixels, int xres, int yres, int x0, int y0, 
-	int x1, int y1, int rgb = 0xff0000ff)
+	int x1, int y1, int rgb, int clipx0, int clipy0, int clipx1, int clipy1)
 {
+	// Only pixels inside [clipx0, clipx1) x [clipy0, clipy1) are written
+	clipx0 = std::max(clipx0, 0);
+	clipy0 = std::max(clipy0, 0);
+	clipx1 = std::min(clipx1, xres);
+	clipy1 = std::min(clipy1, yres);
+
     int dx = (x1 - x0);
     char ix = (dx > 0) - (dx < 0);
     dx = std::abs(dx) << 1;
@@ -70,7 +122,7 @@ inline void DrawLine(int32_t * pixels, int xres, int yres, int x0, int y0,
     char iy = (dy > 0) - (dy < 0);
     dy = std::abs(dy) << 1;
 
-    if ((y0 >= 0 && y0 < yres) && (x0 >= 0 && x0 < xres))
+    if ((y0 >= clipy0 && y0 < clipy1) && (x0 >= clipx0 && x0 < clipx1))
 	    pixels[(y0*xres)+x0] = rgb;
 
     if (dx >= dy)
@@ -94,7 +146,7 @@ inline void DrawLine(int32_t * pixels, int xres, int yres, int x0, int y0,
             x0 += ix;
             error += dy;
  
-            if ((y0 >= 0 && y0 < yres) && (x0 >= 0 && x0 < xres))
+            if ((y0 >= clipy0 && y0 < clipy1) && (x0 >= clipx0 && x0 < clipx1))
 	    		pixels[(y0*xres)+x0] = rgb;
         }
     }
@@ -119,11 +171,17 @@ inline void DrawLine(int32_t * pixels, int xres, int yres, int x0, int y0,
             y0 += iy;
             error += dx;
  
-            if ((y0 >= 0 && y0 < yres) && (x0 >= 0 && x0 < xres))
+            if ((y0 >= clipy0 && y0 < clipy1) && (x0 >= clipx0 && x0 < clipx1))
 	    		pixels[(y0*xres)+x0] = rgb;
         }
     }
 }
 ///////////////////////////////////////////////////////////////////////////////
+inline void DrawLine(int32_t * pixels, int xres, int yres, int x0, int y0, 
+	int x1, int y1, int rgb = 0xff0000ff)
+{
+	DrawLine(pixels, xres, yres, x0, y0, x1, y1, rgb, 0, 0, xres, yres);
+}
+///////////////////////////////////////////////////////////////////////////////
 
 #endif // HH_SDFC_UTIL_HH
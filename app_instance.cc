@@ -26,12 +26,79 @@ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include <ppapi/cpp/completion_callback.h>
 #include <ppapi/cpp/Var.h>
 #include <sstream>
+#include <vector>
+#include <algorithm>
 #include "Util.h"
 #include "Fluid.h"
+#include "ThreadPool.h"
+#include "ParticleRenderer.h"
+#include "SurfaceRenderer.h"
+#include "FrameRecorder.h"
+#include "Profiler.h"
+#include "Checkpoint.h"
+#include "Trajectory.h"
+#include "Scene.h"
+#include "Brush.h"
+#include "FeedWriter.h"
 
 #define PI 3.1415926535897932384626433832795f
-#define GRID_SIZE 128
-#define TANK_SIZE 64.f
+
+// Random number streams for the mouse, clear of the scene's emitters
+#define BRUSH_STREAM	(RANDOM_STREAM_USER + 0x8000)
+#define PUFF_STREAM		(RANDOM_STREAM_USER + 0x9000)
+
+// Scene loaded at launch, falling back on DEFAULT_SCENE when it is missing
+// or doesn't parse
+#ifndef SCENE_PATH
+#define SCENE_PATH "fluid.scene"
+#endif
+
+static const char DEFAULT_SCENE[] =
+	"domain 64 64 0.5\n"
+	"fluid water density 2 viscosity 0 color 0 0 255\n"
+	"fluid oil density 1 viscosity 4 color 255 255 0\n"
+	"addcircle 64.5 64.5 32\n"
+	"addcircle 0 129 32\n"
+	"addcircle 129 129 32\n"
+	"blur\n";
+
+// Directory for baked collision fields, if the build provides one
+#ifndef SDF_CACHE_DIR
+#define SDF_CACHE_DIR NULL
+#endif
+
+// Where profiling traces are written, and how many frames between the 
+// percentiles posted to the page
+#ifndef TRACE_PATH
+#define TRACE_PATH "fluid_trace.json"
+#endif
+#define PROFILE_INTERVAL 30
+
+// Saved scene, restored at launch when present
+#ifndef CHECKPOINT_PATH
+#define CHECKPOINT_PATH "fluid.ckpt"
+#endif
+
+// Where recorded frames are written, as a path prefix
+#ifndef RECORD_PREFIX
+#define RECORD_PREFIX "frame_"
+#endif
+
+// Where particle trajectories are recorded and replayed from
+#ifndef TRAJECTORY_PATH
+#define TRAJECTORY_PATH "fluid.traj"
+#endif
+
+// Shared memory ring the particles are published to for other processes
+#ifndef FEED_PATH
+#define FEED_PATH "/dev/shm/fluid.feed"
+#endif
+
+// Cache of tuned settings per kind of host, and how long tuning may take
+#ifndef TUNE_PATH
+#define TUNE_PATH "fluid.tune"
+#endif
+#define TUNE_BUDGET 2000000000LL	// ns
 
 ///////////////////////////////////////////////////////////////////////////////
 void FlushCallback(void * data, int32_t result)
@@ -60,43 +127,78 @@ AppInstance::AppInstance(PP_Instance instance)
 		bRenderSurface(true),
 		bRenderDistance(false),
 		bRenderFiltered(true),
+		bRenderFluidSurface(false),
+		bReportMemory(false),
+		bRedrawAll(true),
 		bMouseDown(false),
 		bOneDown(false),
 		bTwoDown(false),
+		nBackgroundVersion(0),
+		nBackgroundFlags(0),
+		nBackgroundWidth(0),
+		nBackgroundHeight(0),
+		nDrawnX0(0),
+		nDrawnY0(0),
+		nDrawnX1(0),
+		nDrawnY1(0),
+		nDirtyX0(0),
+		nDirtyY0(0),
+		nDirtyX1(0),
+		nDirtyY1(0),
+		nProfileFrames(0),
+		nPlaybackFrame(0),
+		scene(NULL),
 		sim(NULL),
+		playback(NULL),
 		water(NULL),
-		oil(NULL)
+		oil(NULL),
+		pool(NULL),
+		renderer(NULL),
+		surface(NULL),
+		recorder(NULL),
+		checkpoints(NULL),
+		trajectory(NULL),
+		replay(NULL),
+		feed(NULL)
 
 {
 	RequestInputEvents(PP_INPUTEVENT_CLASS_MOUSE);
 	RequestFilteringInputEvents(PP_INPUTEVENT_CLASS_KEYBOARD);
 
-	sim = new FluidSim(TANK_SIZE, TANK_SIZE, 0.5f);
-	water = new Fluid(sim->GWidth, sim->GHeight);
-
-	water->Density = 2.f;
-	water->Viscosity = 0.f;
-	water->Color = 0xff0000ff;
-
-	oil = new Fluid(sim->GWidth, sim->GHeight);
-
-	oil->Density = 1.f;
-	oil->Viscosity = 4.f;
-	oil->Color = 0xffffff00;
+	// Trials would hold up the page for seconds, so a host without cached
+	// settings starts on the defaults until asked to retune, and even then
+	// they run off the main thread
+	if (!Tuner::Load(TUNE_PATH, &tuning))
+		tuning = TuneSettings();
+	pool = new ThreadPool(tuning.Threads);
+	if (!LoadScene(SCENE_PATH))
+	{
+		scene = new Scene();
+		scene->Parse(DEFAULT_SCENE);
+		SetSimulation(scene->Build(SDF_CACHE_DIR));
+	}
 
-	// Collision environment
-	sim->SDF.AddCircle(sim->GWidth/2.f, sim->GHeight/2.f, 32.f);
-	sim->SDF.AddCircle(0.f, sim->GHeight, 32.f);
-	sim->SDF.AddCircle(sim->GWidth, sim->GHeight, 32.f);
-	sim->SDF.Blur();
+	// Pick up a settled scene rather than settling it again
+	RestoreCheckpoint();
 
-	sim->Fluids.push_back(water);
-	sim->Fluids.push_back(oil);
+	renderer = new ParticleRenderer(pool);
+	surface = new SurfaceRenderer(pool);
+	checkpoints = new CheckpointWriter();
 }
 ///////////////////////////////////////////////////////////////////////////////
 AppInstance::~AppInstance()
 {
+	delete feed;
+	delete replay;
+	delete trajectory;
+	delete checkpoints;
+	delete recorder;
+	delete surface;
+	delete renderer;
+	delete pool;
+	delete playback;
 	delete sim;
+	delete scene;
 	DestroyContext();
 }
 ///////////////////////////////////////////////////////////////////////////////
@@ -106,6 +208,92 @@ void AppInstance::Clear()
 		sim->Fluids[i]->Particles.clear();
 }
 ///////////////////////////////////////////////////////////////////////////////
+bool AppInstance::RestoreCheckpoint()
+{
+	if (!LoadCheckpoint(sim, CHECKPOINT_PATH))
+		return false;
+
+	// The restored collision field is dense again
+	SetSimulation(sim);
+	return true;
+}
+///////////////////////////////////////////////////////////////////////////////
+bool AppInstance::LoadScene(const char * path)
+{
+	Scene * loaded = new Scene();
+	if (!loaded->Load(path))
+	{
+		delete loaded;
+		return false;
+	}
+
+	// Replays and recordings are tied to the old grid
+	if (replay)
+		ToggleReplay();
+	if (trajectory)
+	{
+		trajectory->Close();
+		delete trajectory;
+		trajectory = NULL;
+	}
+
+	delete scene;
+	delete sim;
+	scene = loaded;
+	SetSimulation(scene->Build(SDF_CACHE_DIR));
+	return true;
+}
+///////////////////////////////////////////////////////////////////////////////
+void AppInstance::SetSimulation(FluidSim * newsim)
+{
+	sim = newsim;
+	sim->Threads = pool;
+	Tuner::Apply(tuning, sim);
+	sim->SDF.Freeze();
+
+	// The mouse adds to the first two fluids
+	while (sim->Fluids.size() < 2)
+		sim->Fluids.push_back(new Fluid(sim->GWidth, sim->GHeight));
+	water = sim->Fluids[0];
+	oil = sim->Fluids[1];
+
+	// Force the overlay to be rebuilt from the new field
+	nBackgroundFlags = -1;
+	bRedrawAll = true;
+}
+///////////////////////////////////////////////////////////////////////////////
+void AppInstance::Retune()
+{
+	// Picked up by the first frame after the trials finish; the simulation 
+	// keeps running meanwhile, sharing the cores with them
+	retune.Start(TUNE_BUDGET);
+}
+///////////////////////////////////////////////////////////////////////////////
+void AppInstance::FinishRetune()
+{
+	if (!retune.Poll(&tuning))
+		return;
+	Tuner::Save(TUNE_PATH, tuning);
+
+	// Nothing uses the pool between frames, and the renderers share it, so 
+	// all three are rebuilt here
+	delete surface;
+	delete renderer;
+	delete pool;
+	pool = new ThreadPool(tuning.Threads);
+	renderer = new ParticleRenderer(pool);
+	surface = new SurfaceRenderer(pool);
+	sim->Threads = pool;
+	Tuner::Apply(tuning, sim);
+	bRedrawAll = true;
+
+	std::stringstream ss;
+	ss<<"{ \"Tuning\": \""<<tuning.Threads<<" threads, chunks of "
+		<<tuning.ParticleChunk<<" particles and "<<tuning.CellChunk
+		<<" cells\" }";
+	PostMessage(pp::Var(ss.str()));
+}
+///////////////////////////////////////////////////////////////////////////////
 void AppInstance::HandleMessage(const pp::Var & var_message)
 {
 	if (!var_message.is_string())
@@ -127,6 +315,26 @@ void AppInstance::HandleMessage(const pp::Var & var_message)
 	{
 		Clear();
 	}
+	else if (cmd == "Retune")
+	{
+		Retune();
+	}
+	else if (cmd == "LoadScene")
+	{
+		std::string path;
+		stream>>path;
+		LoadScene(path.empty() ? SCENE_PATH : path.c_str());
+	}
+	else if (cmd == "SaveCheckpoint")
+	{
+		checkpoints->Save(sim, CHECKPOINT_PATH);
+	}
+	else if (cmd == "LoadCheckpoint")
+	{
+		// Make sure a save still in flight has landed first
+		checkpoints->Finish();
+		RestoreCheckpoint();
+	}
 	else if (cmd == "ToggleSurface")
 	{
 		bRenderSurface = !bRenderSurface;
@@ -139,6 +347,80 @@ void AppInstance::HandleMessage(const pp::Var & var_message)
 	{
 		bRenderFiltered = !bRenderFiltered;
 	}
+	else if (cmd == "ToggleFluidSurface")
+	{
+		bRenderFluidSurface = !bRenderFluidSurface;
+	}
+	else if (cmd == "ToggleIncompressible")
+	{
+		sim->Incompressible = !sim->Incompressible;
+	}
+	else if (cmd == "ToggleMemoryStats")
+	{
+		bReportMemory = !bReportMemory;
+	}
+	else if (cmd == "ToggleRecording")
+	{
+		// Deleting the recorder waits for the queued frames to be written
+		if (recorder)
+		{
+			delete recorder;
+			recorder = NULL;
+		}
+		else
+		{
+			recorder = new FrameRecorder(RECORD_PREFIX);
+		}
+	}
+	else if (cmd == "ToggleTrajectory")
+	{
+		// Closing writes the remaining frames and the index
+		if (trajectory)
+		{
+			trajectory->Close();
+			delete trajectory;
+			trajectory = NULL;
+		}
+		else
+		{
+			trajectory = new TrajectoryWriter();
+			if (!trajectory->Open(TRAJECTORY_PATH, sim))
+			{
+				delete trajectory;
+				trajectory = NULL;
+			}
+		}
+	}
+	else if (cmd == "ToggleFeed")
+	{
+		if (feed)
+		{
+			delete feed;
+			feed = NULL;
+		}
+		else
+		{
+			feed = new FeedWriter();
+			if (!feed->Open(FEED_PATH))
+			{
+				delete feed;
+				feed = NULL;
+			}
+		}
+	}
+	else if (cmd == "ToggleReplay")
+	{
+		ToggleReplay();
+	}
+#ifdef FLUID_PROFILE
+	else if (cmd == "ToggleTrace")
+	{
+		if (Profiler::IsTracing())
+			Profiler::EndTrace(TRACE_PATH);
+		else
+			Profiler::BeginTrace();
+	}
+#endif
 	else if (cmd == "GridCoeff")
 	{
 		float value;
@@ -299,6 +581,7 @@ void AppInstance::DidChangeView(const pp::Rect & position,
 
 	nWidth = position.size().width();
 	nHeight = position.size().height();
+	bRedrawAll = true;
 
 	DestroyContext();
 	CreateContext(position.size());
@@ -316,58 +599,104 @@ void AppInstance::DidChangeView(const pp::Rect & position,
 void AppInstance::Paint()
 {
 	std::stringstream ss;
+	ss.setf(std::ios::fixed);
+	ss.precision(2);
 
-	int64_t start, end;
-	start = GetTimeMS();
-	UpdateSimulation();
-	end = GetTimeMS();
+	FinishRetune();
 
-	ss<<"{ \"Update\": \""<<((int)(end-start))<<"\" }";
+	int64_t start, end;
+	start = GetTimeNS();
+	if (replay)
+		UpdatePlayback();
+	else
+		UpdateSimulation();
+	if (trajectory && !replay)
+		trajectory->Record(sim);
+	if (feed)
+		feed->Publish(GetDisplaySim());
+	end = GetTimeNS();
+
+	ss<<"{ \"Update\": \""<<((end-start) * 1e-6)<<"\" }";
 	PostMessage(pp::Var(ss.str()));
 
-	start = GetTimeMS();
+	start = GetTimeNS();
 	RenderSimulation();
+	if (recorder)
+	{
+		PROFILE_SCOPE("SubmitFrame");
+		recorder->Submit((int32_t *) pixels->data(), nWidth, nHeight);
+	}
 	FlushPixelBuffer();
-	end = GetTimeMS();
+	end = GetTimeNS();
 
 	ss.str("");
-	ss<<"{ \"Render\": \""<<((int)(end-start))<<"\" }";
+	ss<<"{ \"Render\": \""<<((end-start) * 1e-6)<<"\" }";
 	PostMessage(pp::Var(ss.str()));
 
 	ss.str("");
-	ss<<"{ \"Count\": \""<<sim->ParticleCount()<<"\" }";
+	ss<<"{ \"Count\": \""<<GetDisplaySim()->ParticleCount()<<"\"";
+	if (bReportMemory)
+	{
+		// Bytes per subsystem as [used, reserved, peak]
+		const MemoryStats & memory = sim->GetMemoryStats();
+		ss<<", \"Memory\": { \"total\": ["<<memory.GetUsed()<<", "
+			<<memory.GetReserved()<<", "<<memory.PeakTotal<<"]";
+		for (int i=0; i<MEMORY_TAG_COUNT; i++)
+		{
+			ss<<", \""<<MemoryStats::GetTagName(i)<<"\": ["<<memory.Used[i]
+				<<", "<<memory.Reserved[i]<<", "<<memory.Peak[i]<<"]";
+		}
+		ss<<" }";
+	}
+	ss<<" }";
 	PostMessage(pp::Var(ss.str()));
+
+#ifdef FLUID_PROFILE
+	PostProfile();
+#endif
 }
 ///////////////////////////////////////////////////////////////////////////////
+#ifdef FLUID_PROFILE
+void AppInstance::PostProfile()
+{
+	Profiler::Collect();
+	if (++nProfileFrames < PROFILE_INTERVAL)
+		return;
+	nProfileFrames = 0;
+
+	// Milliseconds per scope as [p50, p99]
+	std::vector<Profiler::Stats> stats;
+	Profiler::GetStats(stats);
+
+	std::stringstream ss;
+	ss.setf(std::ios::fixed);
+	ss.precision(3);
+	ss<<"{ \"Profile\": {";
+	for (unsigned i=0; i<stats.size(); i++)
+	{
+		ss<<(i ? ", " : " ")<<"\""<<stats[i].name<<"\": ["<<stats[i].p50
+			<<", "<<stats[i].p99<<"]";
+	}
+	ss<<" } }";
+	PostMessage(pp::Var(ss.str()));
+}
+#endif
+///////////////////////////////////////////////////////////////////////////////
 void AppInstance::UpdateSimulation()
 {
+	PROFILE_SCOPE("UpdateSimulation");
 	if (bMouseDown)
 	{
-		float fx = fMouseX * sim->GWidth;
-		float fy = fMouseY * sim->GHeight;
-
-		for (unsigned i=0; i<sim->Fluids.size(); i++)
-		{
-			for (int j=0, lim=sim->Fluids[i]->Particles.size(); j<lim; j++)
-			{
-				float dx = sim->Fluids[i]->Particles[j].x - fx;
-				float dy = sim->Fluids[i]->Particles[j].y - fy;
-				float l2 = dx*dx + dy*dy;
-				if (l2 < 64.f)
-				{
-					float l = sqrtf(l2);
-					sim->Fluids[i]->Particles[j].vx += (0.5f - (l / 16.f)) * dx * (1.f + frand() * 0.1f);
-					sim->Fluids[i]->Particles[j].vy += (0.5f - (l / 16.f)) * dy * (1.f + frand() * 0.1f);
-				}
-			}
-		}
+		PushBrush brush(fMouseX * sim->GWidth, fMouseY * sim->GHeight, 8.f);
+		sim->ApplyBrush(brush, BRUSH_STREAM);
 	}
 	else if (bOneDown)
 	{
+		uint64_t key = sim->GetRandomKey(PUFF_STREAM);
 		for (int i=0; i<32; i++)
 		{
-			float x = (fMouseX * sim->GWidth) + (frand() * 6.f) - 3.f;
-			float y = (fMouseY * sim->GHeight) + (frand() * 6.f) - 3.f;
+			float x = (fMouseX * sim->GWidth) + (frand(key, 2*i) * 6.f) - 3.f;
+			float y = (fMouseY * sim->GHeight) + (frand(key, 2*i + 1) * 6.f) - 3.f;
 			if (sim->SDF.SampleDistance(x, y) <= 0.f)
 				continue;
 
@@ -376,10 +705,11 @@ void AppInstance::UpdateSimulation()
 	}
 	else if (bTwoDown)
 	{
+		uint64_t key = sim->GetRandomKey(PUFF_STREAM);
 		for (int i=0; i<32; i++)
 		{
-			float x = (fMouseX * sim->GWidth) + (frand() * 6.f) - 3.f;
-			float y = (fMouseY * sim->GHeight) + (frand() * 6.f) - 3.f;
+			float x = (fMouseX * sim->GWidth) + (frand(key, 2*i) * 6.f) - 3.f;
+			float y = (fMouseY * sim->GHeight) + (frand(key, 2*i + 1) * 6.f) - 3.f;
 			if (sim->SDF.SampleDistance(x, y) <= 0.f)
 				continue;
 
@@ -387,106 +717,247 @@ void AppInstance::UpdateSimulation()
 		}
 	}
 
+	scene->Emit(sim);
 	sim->Update();
 }
 ///////////////////////////////////////////////////////////////////////////////
+void AppInstance::ToggleReplay()
+{
+	if (replay)
+	{
+		delete replay;
+		delete playback;
+		replay = NULL;
+		playback = NULL;
+		bRedrawAll = true;
+		return;
+	}
+
+	// Make sure a recording in progress is complete on disk first
+	if (trajectory)
+	{
+		trajectory->Close();
+		delete trajectory;
+		trajectory = NULL;
+	}
+
+	replay = new TrajectoryReader();
+	if (!replay->Open(TRAJECTORY_PATH) || replay->GetFrameCount() == 0 ||
+		replay->GetGridWidth() != sim->GWidth || 
+		replay->GetGridHeight() != sim->GHeight)
+	{
+		delete replay;
+		replay = NULL;
+		return;
+	}
+
+	// Frames are decoded into a separate simulation, so the live one picks up
+	// where it was left once the replay stops
+	playback = new FluidSim(scene->Width, scene->Height, scene->Scale, 
+		scene->Layout);
+	nPlaybackFrame = 0;
+}
+///////////////////////////////////////////////////////////////////////////////
+void AppInstance::UpdatePlayback()
+{
+	PROFILE_SCOPE("UpdatePlayback");
+	if (nPlaybackFrame >= replay->GetFrameCount())
+		nPlaybackFrame = 0;
+	if (!replay->ReadFrame(nPlaybackFrame++, playback))
+		return;
+
+	// The surface renderer draws from grid mass, which only the particle
+	// splat of a simulation step would otherwise provide
+	if (bRenderFluidSurface)
+	{
+		playback->ClearGrid();
+		for (unsigned i=0; i<playback->Fluids.size(); i++)
+			playback->InitGrid(playback->Fluids[i]);
+	}
+}
+///////////////////////////////////////////////////////////////////////////////
 void AppInstance::RenderSimulation()
 {
+	PROFILE_SCOPE("RenderSimulation");
 	int32_t * buffer = (int32_t *) pixels->data();
-	memset(buffer, 0, sizeof(int32_t) * nWidth * nHeight);
 	
-	if (bRenderDistance || bRenderSurface)
+	// The overlay only changes with the collision field, so it is rendered
+	// once into a background layer that then serves as the clear source
+	if (UpdateBackground())
+		bRedrawAll = true;
+
+	// Only what was drawn last frame and what will be drawn this frame can
+	// differ from the background, so the clear and the paint are limited to
+	// the union of the two particle bounds
+	int bounds[4];
+	GetParticleBounds(bounds);
+
+	if (bRedrawAll)
 	{
-		float dx = (1.f / nWidth);
-		float dy = (1.f / nHeight);
-		float fx = 0.f, fy = 0.f;
-
-		for (int y=0; y<nHeight; y++, fy+=dy)
-		{
-			fx = 0.f;
-			for (int x=0; x<nWidth; x++, fx+=dx)
-			{
-				float d;
-
-				if (!bRenderFiltered)
-				{
-					int mx = (int)(fx * sim->SDF.GetResolution());
-					int my = (int)(fy * sim->SDF.GetResolution());
-					d = sim->SDF.SampleDistance(mx, my);	
-				}
-				else
-				{
-					d = sim->SDF.SampleDistanceN(fx, fy);	
-				}
-
-				int id = y*nWidth+x;
-				if (d < 0.1f && d > -0.1f && bRenderSurface)
-				{
-					buffer[id] = 0xffff0000;
-				}
-				else if (bRenderDistance)
-				{
-					int v = (fabs(d) / 5.f) * 255.f;
-					v = v > 255 ? 255 : v;
-					buffer[id] = 0xff000000 | v << 16 | v << 8 | v;
-				}	
-			}
-		}
+		nDirtyX0 = 0;
+		nDirtyY0 = 0;
+		nDirtyX1 = nWidth;
+		nDirtyY1 = nHeight;
+		bRedrawAll = false;
 	}
-	
-	for (int i=0, lim=water->Particles.size(); i<lim; i++)
+	else if (nDrawnX0 >= nDrawnX1)
 	{
-		int x0 = floor((water->Particles[i].x / sim->GWidth) * nWidth);
-		int y0 = floor((water->Particles[i].y / sim->GHeight) * nHeight);
+		nDirtyX0 = bounds[0];
+		nDirtyY0 = bounds[1];
+		nDirtyX1 = bounds[2];
+		nDirtyY1 = bounds[3];
+	}
+	else if (bounds[0] >= bounds[2])
+	{
+		nDirtyX0 = nDrawnX0;
+		nDirtyY0 = nDrawnY0;
+		nDirtyX1 = nDrawnX1;
+		nDirtyY1 = nDrawnY1;
+	}
+	else
+	{
+		nDirtyX0 = std::min(nDrawnX0, bounds[0]);
+		nDirtyY0 = std::min(nDrawnY0, bounds[1]);
+		nDirtyX1 = std::max(nDrawnX1, bounds[2]);
+		nDirtyY1 = std::max(nDrawnY1, bounds[3]);
+	}
 
-		float dx = (water->Particles[i].vx / sim->GWidth) * nWidth;
-		float dy = (water->Particles[i].vy / sim->GHeight) * nHeight;
-		float len = sqrtf(dx*dx + dy*dy);
+	nDrawnX0 = bounds[0];
+	nDrawnY0 = bounds[1];
+	nDrawnX1 = bounds[2];
+	nDrawnY1 = bounds[3];
 
-		if (len < 0.5f)
+	if (nDirtyX0 >= nDirtyX1 || nDirtyY0 >= nDirtyY1)
+		return;
+
+	for (int y=nDirtyY0; y<nDirtyY1; y++)
+	{
+		int id = y*nWidth + nDirtyX0;
+		memcpy(buffer + id, &background[id], 
+			sizeof(int32_t) * (nDirtyX1 - nDirtyX0));
+	}
+	
+	if (bRenderFluidSurface)
+		surface->Render(GetDisplaySim(), buffer, nWidth, nHeight);
+	else
+		renderer->Render(GetDisplaySim(), buffer, nWidth, nHeight);
+}
+///////////////////////////////////////////////////////////////////////////////
+void AppInstance::GetParticleBounds(int * bounds) const
+{
+	bounds[0] = bounds[1] = bounds[2] = bounds[3] = 0;
+
+	const FluidSim * shown = GetDisplaySim();
+	float minx = 1e30f, miny = 1e30f, maxx = -1e30f, maxy = -1e30f;
+	for (unsigned i=0; i<shown->Fluids.size(); i++)
+	{
+		const std::vector<Particle> & particles = shown->Fluids[i]->Particles;
+		for (int j=0, lim=particles.size(); j<lim; j++)
 		{
-			DrawCircle(buffer, nWidth, nHeight, x0, y0, 1, water->Color);
-			continue;
+			minx = std::min(minx, particles[j].x);
+			miny = std::min(miny, particles[j].y);
+			maxx = std::max(maxx, particles[j].x);
+			maxy = std::max(maxy, particles[j].y);
 		}
+	}
 
-		dx /= len;
-		dy /= len;
-		int x1 = floor(x0 - dx*std::min(len*4.f, 10.f));
-		int y1 = floor(y0 - dy*std::min(len*4.f, 10.f));
+	if (minx > maxx)
+		return;
 
-		DrawLine(buffer, nWidth, nHeight, x0, y0, x1, y1, water->Color);
+	// Pad for the longest velocity streak and for the two grid cells the 
+	// surface renderer's mass can spread beyond the particles
+	float sx = nWidth / (float) sim->GWidth;
+	float sy = nHeight / (float) sim->GHeight;
+	int padx = std::max(12, (int) ceilf(2.f * sx) + 1);
+	int pady = std::max(12, (int) ceilf(2.f * sy) + 1);
+
+	bounds[0] = std::max(0, (int) floorf(minx * sx) - padx);
+	bounds[1] = std::max(0, (int) floorf(miny * sy) - pady);
+	bounds[2] = std::min(nWidth, (int) floorf(maxx * sx) + padx + 1);
+	bounds[3] = std::min(nHeight, (int) floorf(maxy * sy) + pady + 1);
+	if (bounds[0] >= bounds[2] || bounds[1] >= bounds[3])
+		bounds[0] = bounds[1] = bounds[2] = bounds[3] = 0;
+}
+///////////////////////////////////////////////////////////////////////////////
+bool AppInstance::UpdateBackground()
+{
+	PROFILE_SCOPE("UpdateBackground");
+	int flags = (bRenderSurface ? 1 : 0) | (bRenderDistance ? 2 : 0) | 
+		(bRenderFiltered ? 4 : 0);
+	if (nBackgroundVersion == sim->SDF.GetVersion() && 
+		nBackgroundFlags == flags &&
+		nBackgroundWidth == nWidth && 
+		nBackgroundHeight == nHeight)
+	{
+		return false;
 	}
 
-	for (int i=0, lim=oil->Particles.size(); i<lim; i++)
-	{
-		int x0 = floor((oil->Particles[i].x / sim->GWidth) * nWidth);
-		int y0 = floor((oil->Particles[i].y / sim->GHeight) * nHeight);
+	nBackgroundVersion = sim->SDF.GetVersion();
+	nBackgroundFlags = flags;
+	nBackgroundWidth = nWidth;
+	nBackgroundHeight = nHeight;
+	background.assign(nWidth * nHeight, 0);
+	if (!bRenderSurface && !bRenderDistance)
+		return true;
 
-		float dx = (oil->Particles[i].vx / sim->GWidth) * nWidth;
-		float dy = (oil->Particles[i].vy / sim->GHeight) * nHeight;
-		float len = sqrtf(dx*dx + dy*dy);
+	// Distances are fetched a full row at a time through the batched query
+	std::vector<float> rowx(nWidth), rowy(nWidth), rowd(nWidth);
+	float dx = (1.f / nWidth);
+	float dy = (1.f / nHeight);
+	float fx = 0.f, fy = 0.f;
 
-		if (len < 0.5f)
+	for (int x=0; x<nWidth; x++, fx+=dx)
+		rowx[x] = fx * sim->GWidth;
+
+	for (int y=0; y<nHeight; y++, fy+=dy)
+	{
+		if (!bRenderFiltered)
 		{
-			DrawCircle(buffer, nWidth, nHeight, x0, y0, 1, oil->Color);
-			continue;
+			int my = (int)(fy * sim->SDF.GetResolutionY());
+			fx = 0.f;
+			for (int x=0; x<nWidth; x++, fx+=dx)
+			{
+				int mx = (int)(fx * sim->SDF.GetResolutionX());
+				rowd[x] = sim->SDF.SampleDistance(mx, my);
+			}
+		}
+		else
+		{
+			std::fill(rowy.begin(), rowy.end(), fy * sim->GHeight);
+			sim->SDF.SampleDistanceBatch(&rowx[0], &rowy[0], &rowd[0], nWidth);
 		}
 
-		dx /= len;
-		dy /= len;
-		int x1 = floor(x0 - dx*std::min(len*4.f, 10.f));
-		int y1 = floor(y0 - dy*std::min(len*4.f, 10.f));
-
-		DrawLine(buffer, nWidth, nHeight, x0, y0, x1, y1, oil->Color);
+		for (int x=0; x<nWidth; x++)
+		{
+			float d = rowd[x];
+			int id = y*nWidth+x;
+			if (d < 0.1f && d > -0.1f && bRenderSurface)
+			{
+				background[id] = 0xffff0000;
+			}
+			else if (bRenderDistance)
+			{
+				int v = (fabs(d) / 5.f) * 255.f;
+				v = v > 255 ? 255 : v;
+				background[id] = 0xff000000 | v << 16 | v << 8 | v;
+			}	
+		}
 	}
+
+	return true;
 }
 ///////////////////////////////////////////////////////////////////////////////
 void AppInstance::FlushPixelBuffer()
 {
+	PROFILE_SCOPE("FlushPixelBuffer");
 	if (!context)
 		return;
 		
-	context->PaintImageData(*pixels, pp::Point());
+	if (nDirtyX0 < nDirtyX1 && nDirtyY0 < nDirtyY1)
+	{
+		context->PaintImageData(*pixels, pp::Point(), pp::Rect(nDirtyX0, 
+			nDirtyY0, nDirtyX1 - nDirtyX0, nDirtyY1 - nDirtyY0));
+	}
 
 	if (bFlushIsPending)
 		return;
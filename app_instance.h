@@ -30,7 +30,19 @@ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include <ppapi/cpp/size.h>
 #include <ppapi/cpp/input_event.h>
 
+#include <vector>
 #include "Fluid.h"
+#include "Tuner.h"
+
+class ThreadPool;
+class ParticleRenderer;
+class SurfaceRenderer;
+class FrameRecorder;
+class CheckpointWriter;
+class TrajectoryWriter;
+class TrajectoryReader;
+class FeedWriter;
+class Scene;
 
 class AppInstance : public pp::Instance 
 {
@@ -47,9 +59,22 @@ public:
 
 private:
 	void Clear();
+	bool RestoreCheckpoint();
+	bool LoadScene(const char * path);
+	void SetSimulation(FluidSim * newsim);
+	void Retune();
+	void FinishRetune();
 	void UpdateSimulation();
+	void ToggleReplay();
+	void UpdatePlayback();
 	void RenderSimulation();
+	bool UpdateBackground();
+	void GetParticleBounds(int * bounds) const;
+	const FluidSim * GetDisplaySim() const { return playback ? playback : sim; }
 	void FlushPixelBuffer();
+#ifdef FLUID_PROFILE
+	void PostProfile();
+#endif
 	void CreateContext(const pp::Size & size);
 	void DestroyContext();
 
@@ -61,15 +86,51 @@ private:
 	bool				bRenderSurface;
 	bool				bRenderDistance;
 	bool				bRenderFiltered;
+	bool				bRenderFluidSurface;
+	bool				bReportMemory;		// add memory use to the stats
+	bool				bRedrawAll;
 	bool				bMouseDown;
 	bool				bOneDown;
 	bool				bTwoDown;
 	float				fMouseX;
 	float				fMouseY;
 
+	// Cached distance field overlay and what it was rendered from
+	std::vector<int32_t>	background;
+	unsigned			nBackgroundVersion;
+	int					nBackgroundFlags;
+	int					nBackgroundWidth;
+	int					nBackgroundHeight;
+
+	// Pixel bounds drawn last frame and the region cleared and painted this 
+	// frame, as [x0, x1) x [y0, y1)
+	int					nDrawnX0;
+	int					nDrawnY0;
+	int					nDrawnX1;
+	int					nDrawnY1;
+	int					nDirtyX0;
+	int					nDirtyY0;
+	int					nDirtyX1;
+	int					nDirtyY1;
+	int					nProfileFrames;
+	int					nPlaybackFrame;
+
+	Scene *				scene;
 	FluidSim * 			sim;
+	FluidSim *			playback;	// replayed frames, non-NULL while replaying
 	Fluid * 			water;
 	Fluid * 			oil;
+
+	TuneSettings		tuning;
+	TuneTask			retune;		// trials run here while the page goes on
+	ThreadPool *		pool;
+	ParticleRenderer *	renderer;
+	SurfaceRenderer *	surface;
+	FrameRecorder *		recorder;	// non-NULL while recording
+	CheckpointWriter *	checkpoints;
+	TrajectoryWriter *	trajectory;	// non-NULL while recording trajectories
+	TrajectoryReader *	replay;
+	FeedWriter *		feed;		// non-NULL while publishing particles
 };
 
 #endif // HH_APP_INSTANCE_HH